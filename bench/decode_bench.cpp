@@ -0,0 +1,159 @@
+// Decode throughput: the legacy decode_instr() loop (with and without a
+// DecodeCache) against decode() and the batch decode_range() kernels, on a
+// stream of random 32-bit words decode() accepts (RV64IMA, FENCE, ECALL and
+// EBREAK). Given an ELF file as well, the legacy decoders are also run over
+// its executable sections, where the cache's hit rate says whether it pays
+// off on real code.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "buffer.h"
+#include "decode.h"
+#include "decode_block.h"
+#include "decode_cache.h"
+#include "elf.h"
+#include "risc.h"
+
+using namespace riscy::risc;
+
+namespace {
+
+std::vector<uint32_t> randomWords(size_t count) {
+  std::mt19937 rng(42);
+  std::vector<uint32_t> words;
+  words.reserve(count);
+  while (words.size() < count) {
+    // Any uncompressed word the decoder accepts.
+    uint32_t w = rng() | 0b11;
+    if (decode(w).valid()) {
+      words.push_back(w);
+    }
+  }
+  return words;
+}
+
+// Every instruction (raw halfword or word) of the executable sections of
+// the ELF file at `path`.
+std::vector<uint32_t> corpusWords(const char *path) {
+  auto buf = riscy::buffer::Buffer::map(path);
+  auto elf = riscy::elf::readELF(buf);
+  std::vector<uint32_t> words;
+  for (const auto &section : elf->sectionHeaders()) {
+    if (!(section->flags & riscy::elf::SectionHeaderEntry::SHF_EXECINSTR) ||
+        section->type ==
+            riscy::elf::SectionHeaderEntry::Type::ProgramSpaceNoData) {
+      continue;
+    }
+    auto code = section->buffer.span();
+    for (size_t off = 0; off + 1 < code.size();
+         off += instrLength(code[off])) {
+      words.push_back(rawInstr(code.subspan(off)));
+    }
+  }
+  return words;
+}
+
+template <typename F>
+void report(const char *name, size_t words, int reps, F &&body) {
+  body(); // warm up
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < reps; r++) {
+    body();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  double rate = double(words) * reps / elapsed.count();
+  std::printf("%-24s %10.1f Mwords/s\n", name, rate / 1e6);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 0) : 1 << 22;
+  auto words = randomWords(count);
+  std::printf("%zu words\n", words.size());
+
+  volatile uint64_t sink = 0;
+
+  // The legacy decoders, with the cache's hit rate over the last run.
+  auto legacy = [&](const char *label, const std::vector<uint32_t> &stream) {
+    std::printf("%s:\n", label);
+    report("decode_instr (legacy)", stream.size(), 1, [&] {
+      uint64_t acc = 0;
+      for (uint32_t w : stream) {
+        acc += decode_instr(w)->opcode;
+      }
+      sink = sink + acc;
+    });
+    // The hit rate is that of a first pass, starting from an empty cache.
+    DecodeCache cache;
+    for (uint32_t w : stream) {
+      sink = sink + cache.decode(w)->opcode;
+    }
+    const DecodeCache::Stats cold = cache.stats();
+    report("decode_instr (cached)", stream.size(), 1, [&] {
+      uint64_t acc = 0;
+      for (uint32_t w : stream) {
+        acc += cache.decode(w)->opcode;
+      }
+      sink = sink + acc;
+    });
+    std::printf("  %zu slots: %.1f%% hits, %llu evictions\n", cache.capacity(),
+                cold.hitRate() * 100,
+                static_cast<unsigned long long>(cold.evictions));
+  };
+
+  legacy("random words", words);
+  if (argc > 2) {
+    auto corpus = corpusWords(argv[2]);
+    std::printf("%zu instructions in %s\n", corpus.size(), argv[2]);
+    legacy("corpus", corpus);
+  }
+
+  std::vector<DecodedInstr> aos(words.size());
+  report("decode (per word)", words.size(), 5, [&] {
+    for (size_t i = 0; i < words.size(); i++) {
+      aos[i] = decode(words[i]);
+    }
+    sink = sink + aos.back().imm;
+  });
+
+  DecodedBlock block;
+  const std::pair<const char *, DecodeKernel> kernels[] = {
+      {"decode_range (scalar)", DecodeKernel::Scalar},
+      {"decode_range (sse2)", DecodeKernel::SSE2},
+      {"decode_range (avx2)", DecodeKernel::AVX2},
+  };
+  for (auto [name, kernel] : kernels) {
+    if (kernel > bestDecodeKernel()) {
+      continue;
+    }
+    report(name, words.size(), 5, [&] {
+      decode_range(words, block, kernel);
+      sink = sink + block.imm.back();
+    });
+  }
+
+  // Every kernel must agree with decode().
+  for (auto [name, kernel] : kernels) {
+    if (kernel > bestDecodeKernel()) {
+      continue;
+    }
+    decode_range(words, block, kernel);
+    for (size_t i = 0; i < words.size(); i++) {
+      DecodedInstr a = block[i], b = decode(words[i]);
+      if (a.op != b.op || a.format != b.format || a.rd != b.rd ||
+          a.rs1 != b.rs1 || a.rs2 != b.rs2 || a.imm != b.imm) {
+        std::fprintf(stderr, "%s: mismatch at %zu (%08x)\n", name, i,
+                     words[i]);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
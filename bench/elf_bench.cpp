@@ -0,0 +1,141 @@
+// Front-end throughput on a synthetic RISC-V shared object: readELF(),
+// getSymbolLocation(), decode_instr() per word, bulk word reads and
+// disassembly of whole functions. The object comes from synth.h, generated
+// in memory, so no cross toolchain is needed; its size is set by the
+// function count and function length.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "buffer.h"
+#include "decode.h"
+#include "disasm.h"
+#include "elf.h"
+#include "output.h"
+#include "risc.h"
+#include "synth.h"
+
+using namespace riscy;
+
+namespace {
+
+template <typename F>
+void report(const char *name, size_t items, const char *unit, int reps,
+            F &&body) {
+  body(); // warm up
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < reps; r++) {
+    body();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  double rate = double(items) * reps / elapsed.count();
+  std::printf("%-28s %10.1f M%s/s\n", name, rate / 1e6, unit);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  size_t functions = argc > 1 ? std::strtoull(argv[1], nullptr, 0) : 20000;
+  size_t length = argc > 2 ? std::strtoull(argv[2], nullptr, 0) : 64;
+  length = std::max<size_t>(length, 1);
+  // The lookups below need at least fn_0.
+  if (functions == 0) {
+    std::fprintf(stderr, "usage: %s [functions > 0] [instructions]\n",
+                 argv[0]);
+    return 2;
+  }
+
+  synth::Options options;
+  options.functions = functions;
+  options.minLength = options.maxLength = length;
+  const buffer::Buffer image(synth::generate(options));
+  const size_t instrs = functions * length;
+  std::printf("%zu functions, %zu instructions, %zu bytes\n", functions,
+              instrs, image.size());
+
+  volatile uint64_t sink = 0;
+
+  // readELF() itself only parses the file header. The object has no hash
+  // section, so its first lookup decodes the whole symbol table.
+  report("readELF + first lookup", image.size(), "B", 5, [&] {
+    buffer::Buffer buf = image;
+    sink = sink + elf::readELF(buf)->getSymbolLocation("fn_0")->value;
+  });
+
+  buffer::Buffer buf = image;
+  auto elf = elf::readELF(buf);
+
+  std::vector<std::string> names(functions);
+  for (size_t f = 0; f < functions; f++) {
+    names[f] = "fn_" + std::to_string(f);
+  }
+  std::shuffle(names.begin(), names.end(), std::mt19937(7));
+  report("getSymbolLocation", names.size(), "lookups", 5, [&] {
+    uint64_t acc = 0;
+    for (const auto &name : names) {
+      acc += elf->getSymbolLocation(name)->value;
+    }
+    sink = sink + acc;
+  });
+
+  auto text = elf->getSectionByName(".text");
+  auto code = text->buffer.span();
+  report("decode_instr", instrs, "words", 1, [&] {
+    uint64_t acc = 0;
+    for (size_t off = 0; off + 4 <= code.size(); off += 4) {
+      uint32_t w;
+      std::memcpy(&w, code.data() + off, 4);
+      acc += risc::decode_instr(w)->opcode;
+    }
+    sink = sink + acc;
+  });
+
+  // .text as words, one read_u32() each and with one read_u32_array().
+  const size_t words = text->buffer.size() / 4;
+  std::vector<uint32_t> textWords(words);
+  report("read_u32", words, "words", 5, [&] {
+    for (size_t i = 0; i < words; i++) {
+      textWords[i] = text->buffer.read_u32(i * 4);
+    }
+    sink = sink + textWords[words / 2];
+  });
+  report("read_u32_array", words, "words", 5, [&] {
+    text->buffer.read_u32_array(0, textWords);
+    sink = sink + textWords[words / 2];
+  });
+
+  std::FILE *null = std::fopen("/dev/null", "w");
+  if (!null) {
+    std::perror("/dev/null");
+    return 1;
+  }
+  output::Writer out(null);
+  const std::pair<const char *, disasm::Style> styles[] = {
+      {"disassemble (objdump)", disasm::Style::Objdump},
+      {"disassemble (json)", disasm::Style::JSONLines},
+      {"disassemble (pseudo-c)", disasm::Style::PseudoC},
+  };
+  for (auto [name, style] : styles) {
+    report(name, instrs, "instrs", 1, [&] {
+      for (const auto *sym : elf->symbols().functions()) {
+        disasm::disassembleFunction(
+            out, style, sym->name, sym->value,
+            code.subspan(sym->value - text->virtAddr, sym->size));
+      }
+    });
+  }
+  report("disassemble (whole object)", instrs, "instrs", 1,
+         [&] { disasm::disassemble(*elf, out); });
+  out.flush();
+  std::fclose(null);
+  return 0;
+}
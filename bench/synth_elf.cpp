@@ -0,0 +1,35 @@
+// Writes a synthetic RISC-V shared object (see synth.h), for benchmarks and
+// fuzzers that need large inputs without a cross toolchain.
+//
+// usage: synth_elf <out> [functions] [symbols] [seed]
+
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+
+#include "synth.h"
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "usage: %s <out> [functions] [symbols] [seed]\n",
+                 argv[0]);
+    return 2;
+  }
+  riscy::synth::Options options;
+  if (argc > 2) {
+    options.functions = std::strtoull(argv[2], nullptr, 0);
+  }
+  if (argc > 3) {
+    options.symbols = std::strtoull(argv[3], nullptr, 0);
+  }
+  if (argc > 4) {
+    options.seed = std::strtoull(argv[4], nullptr, 0);
+  }
+  try {
+    riscy::synth::writeFile(argv[1], options);
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,254 @@
+#include "block_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace riscy::vm {
+
+namespace {
+
+// Stored blocks are only valid for the decoder that produced them; bump the
+// low byte whenever decoding changes.
+constexpr uint64_t kLayout = (uint64_t(sizeof(risc::DecodedInstr)) << 32) |
+                             (uint64_t(risc::Op::_count) << 8) | 1;
+
+// Payload of a cache::Kind::Blocks entry: a PageRecord, then per block a
+// BlockRecord followed by its instructions.
+struct PageRecord {
+  // End of the code the blocks cover, from the page start.
+  uint64_t end;
+  uint64_t count;
+};
+
+struct BlockRecord {
+  uint64_t start;
+  uint64_t end;
+  uint64_t length;
+};
+
+template <typename T> void append(std::vector<uint8_t> &out, const T &value) {
+  const auto *p = reinterpret_cast<const uint8_t *>(&value);
+  out.insert(out.end(), p, p + sizeof(T));
+}
+
+} // namespace
+
+void BlockCache::insert(std::unique_ptr<Block> block, Memory &mem) {
+  uint64_t page = block->start & ~(Memory::kPageSize - 1);
+  for (uint64_t p = page; p < block->end; p += Memory::kPageSize) {
+    mem.markCode(p);
+    blocksByPage[p].push_back(block->start);
+  }
+  blocks[block->start] = std::move(block);
+}
+
+Block *BlockCache::translate(uint64_t pc, Memory &mem, StopReason &stop) {
+  if (pc & 1) {
+    stop = StopReason::MisalignedFetch;
+    return nullptr;
+  }
+
+  uint64_t page = pc & ~(Memory::kPageSize - 1);
+  if (store && pagesLoaded.insert(page).second) {
+    preload(page, mem);
+    if (auto it = blocks.find(pc); it != blocks.end()) {
+      return it->second.get();
+    }
+  }
+
+  auto block = std::make_unique<Block>();
+  block->start = pc;
+
+  uint64_t addr = pc;
+  while (block->instrs.size() < kMaxBlockLength &&
+         (addr & ~(Memory::kPageSize - 1)) == page) {
+    uint16_t lo;
+    if (!mem.fetch(addr, lo)) {
+      break;
+    }
+    risc::DecodedInstr d;
+    if (risc::instrLength(lo) == 2) {
+      d = risc::decodeCompressed(lo);
+    } else {
+      // A 32-bit instruction may straddle the end of the page. Only the
+      // first instruction of a block is allowed to; otherwise the block
+      // ends before it.
+      uint64_t offset = addr & (Memory::kPageSize - 1);
+      if (offset == Memory::kPageSize - 2 && !block->instrs.empty()) {
+        break;
+      }
+      uint16_t hi;
+      if (!mem.fetch(addr + 2, hi)) {
+        break;
+      }
+      d = risc::decode(lo | uint32_t(hi) << 16);
+    }
+    block->instrs.push_back(d);
+    addr += d.length;
+
+    if (!d.valid() || risc::isControlTransfer(d.op) ||
+        d.op == risc::Op::FENCE_I || d.op == risc::Op::ECALL ||
+        d.op == risc::Op::EBREAK) {
+      break;
+    }
+  }
+
+  if (block->instrs.empty()) {
+    stop = pc == kReturnAddress ? StopReason::Returned : StopReason::FetchFault;
+    return nullptr;
+  }
+  block->end = addr;
+
+  if (store) {
+    pagesDecoded.insert(page);
+  }
+  Block *raw = block.get();
+  insert(std::move(block), mem);
+  return raw;
+}
+
+void BlockCache::invalidatePage(uint64_t pageAddr) {
+  auto it = blocksByPage.find(pageAddr);
+  if (it == blocksByPage.end()) {
+    return;
+  }
+  for (uint64_t pc : it->second) {
+    JumpEntry &e = jumpCache[slot(pc)];
+    if (e.pc == pc) {
+      e = {};
+    }
+    blocks.erase(pc);
+  }
+  blocksByPage.erase(it);
+  epoch++;
+}
+
+void BlockCache::catchUp(const Memory &mem) {
+  auto pages = mem.dirtyCodeSince(codeSeen);
+  if (!pages) {
+    clear();
+    return;
+  }
+  for (uint64_t page : *pages) {
+    invalidatePage(page);
+  }
+}
+
+void BlockCache::clear() {
+  blocks.clear();
+  blocksByPage.clear();
+  jumpCache.fill({});
+  pagesLoaded.clear();
+  pagesDecoded.clear();
+  epoch++;
+}
+
+void BlockCache::attach(cache::TranslationCache *cache, uint64_t binary) {
+  store = cache;
+  this->binary = binary;
+  pagesLoaded.clear();
+  pagesDecoded.clear();
+}
+
+std::optional<uint64_t> BlockCache::pageInput(uint64_t page, uint64_t end,
+                                              const Memory &mem) const {
+  if (end <= page || !mem.permits(page, end - page, Memory::kExec)) {
+    return std::nullopt;
+  }
+  // Page by page, as paged memory needn't be contiguous on the host.
+  uint64_t h = kLayout;
+  for (uint64_t p = page; p < end; p += Memory::kPageSize) {
+    uint64_t n = std::min(end - p, Memory::kPageSize);
+    const uint8_t *bytes = mem.translate(p, n);
+    if (!bytes) {
+      return std::nullopt;
+    }
+    h = cache::hash({bytes, n}, h);
+  }
+  return h;
+}
+
+void BlockCache::preload(uint64_t page, Memory &mem) {
+  auto entry = store->load({binary, cache::Kind::Blocks, page});
+  if (!entry || entry->payload.size() < sizeof(PageRecord)) {
+    return;
+  }
+  auto bytes = entry->payload.span();
+  PageRecord header;
+  std::memcpy(&header, bytes.data(), sizeof(header));
+  if (pageInput(page, page + header.end, mem) != entry->input) {
+    return;
+  }
+
+  size_t off = sizeof(PageRecord);
+  for (uint64_t i = 0; i < header.count; i++) {
+    BlockRecord record;
+    if (bytes.size() - off < sizeof(record)) {
+      return;
+    }
+    std::memcpy(&record, bytes.data() + off, sizeof(record));
+    off += sizeof(record);
+    if (record.length == 0 || record.length > kMaxBlockLength ||
+        (bytes.size() - off) / sizeof(risc::DecodedInstr) < record.length ||
+        (record.start & ~(Memory::kPageSize - 1)) != page ||
+        record.end <= record.start || record.end > page + header.end) {
+      return;
+    }
+    auto block = std::make_unique<Block>();
+    block->start = record.start;
+    block->end = record.end;
+    block->instrs.resize(record.length);
+    std::memcpy(block->instrs.data(), bytes.data() + off,
+                record.length * sizeof(risc::DecodedInstr));
+    off += record.length * sizeof(risc::DecodedInstr);
+    if (!blocks.contains(block->start)) {
+      insert(std::move(block), mem);
+    }
+  }
+}
+
+size_t BlockCache::persist(const Memory &mem) {
+  if (!store) {
+    return 0;
+  }
+  size_t written = 0;
+  std::vector<uint8_t> payload;
+  for (uint64_t page : pagesDecoded) {
+    auto it = blocksByPage.find(page);
+    if (it == blocksByPage.end()) {
+      continue;
+    }
+    // Only the blocks starting in this page; ones straddling in from the
+    // previous page are stored with it.
+    std::vector<const Block *> own;
+    uint64_t end = page;
+    for (uint64_t pc : it->second) {
+      if ((pc & ~(Memory::kPageSize - 1)) == page) {
+        const Block *block = blocks.at(pc).get();
+        own.push_back(block);
+        end = std::max(end, block->end);
+      }
+    }
+    auto input = pageInput(page, end, mem);
+    if (own.empty() || !input) {
+      continue;
+    }
+
+    payload.clear();
+    append(payload, PageRecord{end - page, own.size()});
+    for (const Block *block : own) {
+      append(payload, BlockRecord{block->start, block->end,
+                                  block->instrs.size()});
+      const auto *p =
+          reinterpret_cast<const uint8_t *>(block->instrs.data());
+      payload.insert(payload.end(), p,
+                     p + block->instrs.size() * sizeof(risc::DecodedInstr));
+    }
+    written += store->store({binary, cache::Kind::Blocks, page}, *input,
+                            payload);
+  }
+  pagesDecoded.clear();
+  return written;
+}
+
+} // namespace riscy::vm
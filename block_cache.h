@@ -0,0 +1,123 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "decode.h"
+#include "execute.h"
+#include "memory.h"
+#include "translation_cache.h"
+
+namespace riscy::vm {
+
+// A straight-line run of pre-decoded guest instructions. Only the last one
+// may transfer control (BRANCH, JAL, JALR, SYSTEM, FENCE.I) or be invalid;
+// blocks also end at page boundaries so each lies within a single page,
+// unless it starts with a 32-bit instruction straddling two.
+struct Block {
+  uint64_t start;
+  uint64_t end;
+  std::vector<risc::DecodedInstr> instrs;
+};
+
+// Pre-decoded blocks keyed by guest pc. Blocks are discovered lazily the
+// first time control reaches their start address and dropped when the page
+// they were decoded from is written to.
+class BlockCache {
+private:
+  static constexpr size_t kMaxBlockLength = 64;
+  static constexpr size_t kJumpCacheSize = 4096;
+
+  std::unordered_map<uint64_t, std::unique_ptr<Block>> blocks;
+  // Page base address -> start pcs of the blocks decoded from that page.
+  std::unordered_map<uint64_t, std::vector<uint64_t>> blocksByPage;
+
+  // Direct-mapped front for `blocks`, indexed by pc bits; avoids a hash
+  // lookup on most block transitions.
+  struct JumpEntry {
+    uint64_t pc = ~uint64_t(0);
+    Block *block = nullptr;
+  };
+  std::array<JumpEntry, kJumpCacheSize> jumpCache{};
+
+  // Bumped whenever blocks are dropped, so that anything derived from them
+  // (such as JIT-compiled code) can tell it is stale.
+  uint64_t epoch = 0;
+
+  // Code-page writes already applied (see Memory::codeWrites()).
+  uint64_t codeSeen = 0;
+
+  // Persistent store (see attach()), the pages already looked up in it, and
+  // the pages with blocks it doesn't have yet.
+  cache::TranslationCache *store = nullptr;
+  uint64_t binary = 0;
+  std::unordered_set<uint64_t> pagesLoaded;
+  std::unordered_set<uint64_t> pagesDecoded;
+
+  [[nodiscard]] static inline size_t slot(uint64_t pc) {
+    return (pc >> 1) & (kJumpCacheSize - 1);
+  }
+
+  void insert(std::unique_ptr<Block> block, Memory &mem);
+  Block *translate(uint64_t pc, Memory &mem, StopReason &stop);
+
+  // Hash of the guest code [page, end) that blocks stored for `page` were
+  // decoded from, or nullopt if it isn't all mapped executable.
+  [[nodiscard]] std::optional<uint64_t> pageInput(uint64_t page, uint64_t end,
+                                                  const Memory &mem) const;
+  // Adds the stored blocks of `page`, if they still match its code.
+  void preload(uint64_t page, Memory &mem);
+
+  void catchUp(const Memory &mem);
+
+public:
+  // The block starting at `pc`, decoding it on a miss. Returns nullptr (and
+  // sets `stop`) if not even its first instruction can be fetched.
+  [[nodiscard]] inline Block *lookup(uint64_t pc, Memory &mem,
+                                     StopReason &stop) {
+    JumpEntry &e = jumpCache[slot(pc)];
+    if (e.pc == pc) [[likely]] {
+      return e.block;
+    }
+    auto it = blocks.find(pc);
+    Block *block = it != blocks.end() ? it->second.get()
+                                      : translate(pc, mem, stop);
+    if (block) {
+      e = {pc, block};
+    }
+    return block;
+  }
+
+  // Drops every block decoded from the page at `pageAddr`.
+  void invalidatePage(uint64_t pageAddr);
+
+  // Applies the code-page writes recorded by `mem` since the last call.
+  // Each cache keeps its own place, so harts sharing `mem` all see every
+  // write.
+  inline void sync(const Memory &mem) {
+    if (mem.codeWrites() != codeSeen) [[unlikely]] {
+      catchUp(mem);
+    }
+  }
+
+  void clear();
+
+  // Backs this cache with `cache`: the first time control reaches a page,
+  // the blocks stored for it are used (if the page's code is unchanged)
+  // rather than decoded again. `binary` names the program, as the hash of
+  // its file; see persist().
+  void attach(cache::TranslationCache *cache, uint64_t binary);
+
+  // Stores the blocks of every page that gained some since attach(), for
+  // the next run to preload. Returns the number of pages written.
+  size_t persist(const Memory &mem);
+
+  [[nodiscard]] inline size_t size() const { return blocks.size(); }
+  [[nodiscard]] inline uint64_t generation() const { return epoch; }
+};
+
+} // namespace riscy::vm
@@ -1,10 +1,30 @@
 #pragma once
 
+#include <array>
+#include <bit>
 #include <cassert>
+#include <cerrno>
 #include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// AVX2 is detected at runtime for whole-array byte swaps.
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 namespace riscy::buffer {
 
 enum class Endianness {
@@ -12,55 +32,191 @@ enum class Endianness {
   Little,
 };
 
+namespace detail {
+
+// std::byteswap is C++23; this tree builds as C++20.
+template <typename T> [[nodiscard]] constexpr T byteswap(T v) {
+  static_assert(std::is_integral_v<T>);
+  if constexpr (sizeof(T) == 2) {
+    return static_cast<T>(__builtin_bswap16(static_cast<uint16_t>(v)));
+  } else if constexpr (sizeof(T) == 4) {
+    return static_cast<T>(__builtin_bswap32(static_cast<uint32_t>(v)));
+  } else if constexpr (sizeof(T) == 8) {
+    return static_cast<T>(__builtin_bswap64(static_cast<uint64_t>(v)));
+  } else {
+    static_assert(sizeof(T) == 1);
+    return v;
+  }
+}
+
+#if defined(__x86_64__)
+// pshufb control reversing every N-byte element. The shuffle stays within
+// 128-bit lanes, which N divides.
+template <size_t N>
+inline constexpr std::array<uint8_t, 32> kSwapMask = [] {
+  std::array<uint8_t, 32> mask{};
+  for (size_t i = 0; i < mask.size(); i++) {
+    mask[i] = uint8_t((i % 16) / N * N + (N - 1 - i % N));
+  }
+  return mask;
+}();
+
+// Swaps whole 32-byte blocks of N-byte elements at `p`; returns how many
+// bytes it covered. Only called after a CPUID check.
+template <size_t N>
+__attribute__((target("avx2"))) inline size_t byteswapAVX2(uint8_t *p,
+                                                            size_t bytes) {
+  const __m256i mask = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i *>(kSwapMask<N>.data()));
+  size_t i = 0;
+  for (; i + 32 <= bytes; i += 32) {
+    auto *v = reinterpret_cast<__m256i *>(p + i);
+    _mm256_storeu_si256(v, _mm256_shuffle_epi8(_mm256_loadu_si256(v), mask));
+  }
+  return i;
+}
+
+[[nodiscard]] inline bool hasAVX2() {
+  static const bool has = __builtin_cpu_supports("avx2");
+  return has;
+}
+#endif
+
+template <typename T> inline void byteswapAll(std::span<T> values) {
+  size_t i = 0;
+#if defined(__x86_64__)
+  if constexpr (sizeof(T) > 1) {
+    if (hasAVX2()) {
+      i = byteswapAVX2<sizeof(T)>(reinterpret_cast<uint8_t *>(values.data()),
+                                  values.size_bytes()) /
+          sizeof(T);
+    }
+  }
+#endif
+  for (; i < values.size(); i++) {
+    values[i] = byteswap(values[i]);
+  }
+}
+
+} // namespace detail
+
+// Swaps each of `fields` in place; for the byteswap() member of the records
+// passed to Buffer::read_struct().
+template <typename... T> inline void byteswapFields(T &...fields) {
+  ((fields = detail::byteswap(fields)), ...);
+}
+
+// Owns a read-only-by-convention mmap'd file for as long as any Buffer views
+// it. Pages are mapped MAP_PRIVATE, so writes through a Buffer are
+// copy-on-write and never reach the file.
+class Mapping {
+private:
+  void *_addr = nullptr;
+  size_t _size = 0;
+
+public:
+  Mapping(void *addr, size_t size) : _addr(addr), _size(size) {}
+  Mapping(const Mapping &) = delete;
+  Mapping &operator=(const Mapping &) = delete;
+  ~Mapping() {
+    if (_addr)
+      munmap(_addr, _size);
+  }
+
+  [[nodiscard]] inline uint8_t *data() const {
+    return static_cast<uint8_t *>(_addr);
+  }
+  [[nodiscard]] inline size_t size() const { return _size; }
+};
+
+// A cursor over a byte range. The bytes themselves live in shared storage
+// (either an owned vector or a file mapping), so copying a Buffer or taking a
+// slice of it never copies the underlying data; every view keeps the storage
+// alive through `_owner`.
 class Buffer {
 private:
-  std::vector<uint8_t> _data;
+  std::shared_ptr<const void> _owner;
+  uint8_t *_data = nullptr;
+  size_t _size = 0;
   size_t _index = 0;
   Endianness endian = Endianness::Big;
 
-  template <typename T>
-  [[nodiscard]]
-  T fromBigEndian(T v) {
-    if (endian == Endianness::Big)
-      return v;
-    constexpr size_t N = sizeof(T);
-    T res = 0;
-    if constexpr (N > 1) {
-      for (size_t i = 0; i < N; i++) {
-        res <<= 8;
-        res |= (v & 0xff);
-        v >>= 8;
-      }
-    } else {
-      res = v;
-    }
-    return res;
+  Buffer(std::shared_ptr<const void> owner, uint8_t *data, size_t size,
+         Endianness endian)
+      : _owner(std::move(owner)), _data(data), _size(size), endian(endian) {}
+
+  // Whether values stored in this buffer's byte order are reversed on the
+  // host.
+  [[nodiscard]] inline bool swapped() const {
+    return (endian == Endianness::Little) !=
+           (std::endian::native == std::endian::little);
+  }
+
+  template <typename T> [[nodiscard]] T toHost(T v) const {
+    return swapped() ? detail::byteswap(v) : v;
   }
 
 public:
   Buffer() = default;
 
-  template <typename It> Buffer(It begin, It end) : _data(begin, end) {}
+  template <typename It>
+  Buffer(It begin, It end)
+      : Buffer(std::vector<uint8_t>(begin, end)) {}
 
-  Buffer(std::vector<uint8_t> &&v) : _data(std::move(v)) {}
+  Buffer(std::vector<uint8_t> &&v) {
+    auto owned = std::make_shared<std::vector<uint8_t>>(std::move(v));
+    _data = owned->data();
+    _size = owned->size();
+    _owner = std::move(owned);
+  }
+
+  // Maps the file at `path` into memory. The mapping is released once the
+  // returned Buffer and every slice taken from it are gone.
+  [[nodiscard]] static Buffer map(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      int err = errno;
+      close(fd);
+      throw std::system_error(err, std::generic_category(), path);
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+      close(fd);
+      return Buffer();
+    }
+
+    void *addr =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    int err = errno;
+    close(fd);
+    if (addr == MAP_FAILED) {
+      throw std::system_error(err, std::generic_category(), path);
+    }
+
+    auto mapping = std::make_shared<Mapping>(addr, size);
+    return Buffer(mapping, mapping->data(), size, Endianness::Big);
+  }
 
   inline void setEndianness(Endianness e) { endian = e; }
 
+  [[nodiscard]] inline Endianness endianness() const { return endian; }
+
   template <typename T> [[nodiscard]] T pop() {
-    constexpr size_t N = sizeof(T);
-    assert(_data.size() >= N);
-    T value = 0;
-    for (size_t i = 0; i < N; ++i) {
-      value = (value << 8) | _data[i + _index];
-    }
-    skip(N);
-    return fromBigEndian(value);
+    T value = read<T>(_index);
+    skip(sizeof(T));
+    return value;
   }
 
   [[nodiscard]] inline uint8_t pop_u8() { return pop<uint8_t>(); }
   [[nodiscard]] inline uint16_t pop_u16() { return pop<uint16_t>(); }
   [[nodiscard]] inline uint32_t pop_u32() { return pop<uint32_t>(); }
-  [[nodiscard]] inline uint32_t pop_u64() { return pop<uint64_t>(); }
+  [[nodiscard]] inline uint64_t pop_u64() { return pop<uint64_t>(); }
 
   [[nodiscard]] inline std::string pop_null_string() {
     std::string str;
@@ -72,42 +228,147 @@ public:
     return str;
   }
 
+  // Cursor-free counterparts of pop<T>() and pop_null_string(). These never
+  // touch `_index`, so they are safe to call on a shared const Buffer.
+  template <typename T> [[nodiscard]] T read(size_t offset) const {
+    assert(offset + sizeof(T) <= _size);
+    T value;
+    std::memcpy(&value, _data + offset, sizeof(T));
+    return toHost(value);
+  }
+
+  [[nodiscard]] inline uint8_t read_u8(size_t offset) const {
+    return read<uint8_t>(offset);
+  }
+  [[nodiscard]] inline uint16_t read_u16(size_t offset) const {
+    return read<uint16_t>(offset);
+  }
+  [[nodiscard]] inline uint32_t read_u32(size_t offset) const {
+    return read<uint32_t>(offset);
+  }
+  [[nodiscard]] inline uint64_t read_u64(size_t offset) const {
+    return read<uint64_t>(offset);
+  }
+
+  // `out.size()` consecutive values starting at `offset`: one copy, then one
+  // (vectorized where possible) pass swapping them to host order.
+  template <typename T>
+  void read_array(size_t offset, std::span<T> out) const {
+    static_assert(std::is_integral_v<T>);
+    assert(offset + out.size_bytes() <= _size);
+    if (out.empty()) {
+      return;
+    }
+    std::memcpy(out.data(), _data + offset, out.size_bytes());
+    if (swapped()) {
+      detail::byteswapAll(out);
+    }
+  }
+
+  inline void read_u16_array(size_t offset, std::span<uint16_t> out) const {
+    read_array(offset, out);
+  }
+  inline void read_u32_array(size_t offset, std::span<uint32_t> out) const {
+    read_array(offset, out);
+  }
+  inline void read_u64_array(size_t offset, std::span<uint64_t> out) const {
+    read_array(offset, out);
+  }
+
+  [[nodiscard]] inline std::vector<uint32_t>
+  read_u32_array(size_t offset, size_t count) const {
+    std::vector<uint32_t> out(count);
+    read_array<uint32_t>(offset, out);
+    return out;
+  }
+  [[nodiscard]] inline std::vector<uint64_t>
+  read_u64_array(size_t offset, size_t count) const {
+    std::vector<uint64_t> out(count);
+    read_array<uint64_t>(offset, out);
+    return out;
+  }
+
+  // A fixed-layout record (an ELF header, a symbol table entry) in one copy.
+  // S must be trivially copyable, laid out exactly as stored, and have a
+  // `void byteswap()` that swaps each of its multi-byte fields; it is called
+  // when this buffer's byte order differs from the host's.
+  template <typename S> [[nodiscard]] S read_struct(size_t offset) const {
+    static_assert(std::is_trivially_copyable_v<S>);
+    assert(offset + sizeof(S) <= _size);
+    S record;
+    std::memcpy(&record, _data + offset, sizeof(S));
+    if (swapped()) {
+      record.byteswap();
+    }
+    return record;
+  }
+
+  template <typename S> [[nodiscard]] S pop_struct() {
+    S record = read_struct<S>(_index);
+    skip(sizeof(S));
+    return record;
+  }
+
+  [[nodiscard]] inline std::string_view string_at(size_t offset) const {
+    assert(offset < _size);
+    auto begin = reinterpret_cast<const char *>(_data + offset);
+    auto end = static_cast<const char *>(std::memchr(begin, 0, _size - offset));
+    return {begin, end ? static_cast<size_t>(end - begin) : _size - offset};
+  }
+
   inline void skip(size_t n) {
-    assert(_data.size() >= n);
+    assert(_index + n <= _size);
     _index += n;
   }
 
   inline void seek(size_t new_index) {
-    assert(_data.size() == 0 || new_index < _data.size());
+    assert(_size == 0 || new_index < _size);
     _index = new_index;
   }
 
   [[nodiscard]] inline size_t index() const { return _index; }
 
+  // Returns a view of [start, end) sharing this buffer's storage.
   [[nodiscard]] inline Buffer slice(size_t start, size_t end) const {
     if (start == end) {
-      return Buffer();
+      Buffer result;
+      result.setEndianness(endian);
+      return result;
     }
     assert(start < end);
-    assert(end <= _data.size());
-    auto result = Buffer(_data.begin() + start, _data.begin() + end);
-    result.setEndianness(endian);
-    return result;
+    assert(end <= _size);
+    return Buffer(_owner, _data + start, end - start, endian);
   }
 
-  [[nodiscard]] inline size_t size() const { return _data.size(); }
+  [[nodiscard]] inline std::span<const uint8_t> span() const {
+    return {_data, _size};
+  }
 
-  [[nodiscard]] inline bool empty() const { return _data.empty(); }
+  // Handle keeping the underlying storage alive, for callers that hold on to
+  // raw pointers or spans beyond the lifetime of this Buffer.
+  [[nodiscard]] inline const std::shared_ptr<const void> &owner() const {
+    return _owner;
+  }
+
+  [[nodiscard]] inline size_t size() const { return _size; }
 
-  [[nodiscard]] inline const uint8_t *data() const { return _data.data(); }
+  [[nodiscard]] inline bool empty() const { return _size == 0; }
 
-  [[nodiscard]] inline uint8_t *data() { return _data.data(); }
+  [[nodiscard]] inline const uint8_t *data() const { return _data; }
+
+  [[nodiscard]] inline uint8_t *data() { return _data; }
 
   [[nodiscard]] inline uint8_t operator[](size_t i) const {
-    return _data.at(i);
+    if (i >= _size)
+      throw std::out_of_range("Buffer index out of range");
+    return _data[i];
   }
 
-  [[nodiscard]] inline uint8_t &operator[](size_t i) { return _data.at(i); }
+  [[nodiscard]] inline uint8_t &operator[](size_t i) {
+    if (i >= _size)
+      throw std::out_of_range("Buffer index out of range");
+    return _data[i];
+  }
 };
 
 } // namespace riscy::buffer
@@ -0,0 +1,252 @@
+#include "cfg.h"
+
+#include <algorithm>
+
+#include "elf.h"
+
+namespace riscy::cfg {
+
+using risc::Op;
+
+namespace {
+
+constexpr uint8_t kRA = 1;
+
+// The bytes of [addr, addr + size) in the section holding them, or an empty
+// span if the range is not fully backed by one section.
+std::span<const uint8_t> readCode(const elf::ELF &elf, uint64_t addr,
+                                  uint64_t size) {
+  auto section = elf.getSectionContaining(addr);
+  if (!section || addr - section->virtAddr + size > section->size) {
+    return {};
+  }
+  return section->buffer.span().subspan(addr - section->virtAddr, size);
+}
+
+} // namespace
+
+int64_t FunctionCFG::indexOf(uint64_t addr) const {
+  if (addr < entry || addr - entry >= size) {
+    return -1;
+  }
+  auto it = std::lower_bound(offsets.begin(), offsets.end(), addr - entry);
+  if (it == offsets.end() || *it != addr - entry) {
+    return -1;
+  }
+  return it - offsets.begin();
+}
+
+int64_t FunctionCFG::blockAt(uint64_t addr) const {
+  if (addr < entry || addr - entry >= size) {
+    return -1;
+  }
+  auto it = std::upper_bound(
+      blocks.begin(), blocks.end(), addr,
+      [](uint64_t a, const BasicBlock &b) { return a < b.start; });
+  return (it - blocks.begin()) - 1;
+}
+
+FunctionCFG buildCFG(uint64_t entry, std::span<const uint8_t> bytes) {
+  FunctionCFG fn;
+  fn.entry = entry;
+  fn.size = bytes.size();
+
+  // Mostly 32-bit code needs a quarter as many slots as bytes.
+  fn.instrs.reserve(bytes.size() / 4);
+  fn.offsets.reserve(bytes.size() / 4);
+  for (size_t off = 0; off < bytes.size();) {
+    auto d = risc::decodeAt(bytes.subspan(off));
+    fn.instrs.push_back(d);
+    fn.offsets.push_back(static_cast<uint32_t>(off));
+    off += d.length;
+  }
+  const uint32_t n = static_cast<uint32_t>(fn.instrs.size());
+
+  auto targetOf = [&](uint32_t i) {
+    return fn.addressOf(i) + static_cast<int64_t>(fn.instrs[i].imm);
+  };
+
+  // Pass 1: mark block leaders.
+  std::vector<uint8_t> leader(n + 1, 0);
+  if (n) {
+    leader[0] = 1;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    const auto &d = fn.instrs[i];
+    switch (d.op) {
+    case Op::BEQ:
+    case Op::BNE:
+    case Op::BLT:
+    case Op::BGE:
+    case Op::BLTU:
+    case Op::BGEU:
+    case Op::JAL: {
+      int64_t t = fn.indexOf(targetOf(i));
+      if (t >= 0 && !(d.op == Op::JAL && d.rd != 0)) {
+        leader[t] = 1;
+      }
+      leader[i + 1] = 1;
+      break;
+    }
+    case Op::JALR:
+    case Op::FENCE_I:
+    case Op::EBREAK:
+    case Op::INVALID:
+      leader[i + 1] = 1;
+      break;
+    default:
+      break;
+    }
+  }
+
+  // Pass 2: carve blocks and classify their terminators.
+  std::vector<uint32_t> blockOf(n, 0);
+  for (uint32_t i = 0; i < n;) {
+    BasicBlock b{};
+    b.start = fn.addressOf(i);
+    b.firstInstr = i;
+    uint32_t j = i + 1;
+    while (j < n && !leader[j]) {
+      j++;
+    }
+    b.instrCount = j - i;
+    for (uint32_t k = i; k < j; k++) {
+      blockOf[k] = static_cast<uint32_t>(fn.blocks.size());
+    }
+
+    const auto &last = fn.instrs[j - 1];
+    switch (last.op) {
+    case Op::BEQ:
+    case Op::BNE:
+    case Op::BLT:
+    case Op::BGE:
+    case Op::BLTU:
+    case Op::BGEU:
+      b.terminator = Terminator::Branch;
+      break;
+    case Op::JAL:
+      b.terminator = last.rd != 0                       ? Terminator::Call
+                     : fn.indexOf(targetOf(j - 1)) >= 0 ? Terminator::Jump
+                                                       : Terminator::TailCall;
+      break;
+    case Op::JALR:
+      if (last.rd != 0) {
+        b.terminator = Terminator::Call;
+      } else if (last.rs1 == kRA && last.imm == 0) {
+        b.terminator = Terminator::Return;
+      } else if (j - 1 > i && fn.instrs[j - 2].op == Op::AUIPC &&
+                 fn.instrs[j - 2].rd == last.rs1) {
+        // auipc rX, hi; jalr x0, lo(rX) -- the `tail` pseudo-instruction.
+        b.terminator = Terminator::TailCall;
+      } else {
+        b.terminator = Terminator::IndirectJump;
+      }
+      break;
+    case Op::EBREAK:
+    case Op::INVALID:
+      b.terminator = Terminator::Invalid;
+      break;
+    default:
+      // Runs off the end of the function if it's the last block.
+      b.terminator = j < n ? Terminator::FallThrough : Terminator::Invalid;
+      break;
+    }
+    fn.blocks.push_back(b);
+    i = j;
+  }
+
+  // Pass 3: successor edges (CSR) and call sites.
+  const uint32_t nblocks = static_cast<uint32_t>(fn.blocks.size());
+  fn.succs.reserve(nblocks * 2);
+  for (uint32_t bi = 0; bi < nblocks; bi++) {
+    auto &b = fn.blocks[bi];
+    uint32_t lastIdx = b.firstInstr + b.instrCount - 1;
+    const auto &last = fn.instrs[lastIdx];
+    bool hasNext = bi + 1 < nblocks;
+    b.succBegin = static_cast<uint32_t>(fn.succs.size());
+
+    switch (b.terminator) {
+    case Terminator::Branch: {
+      int64_t t = fn.indexOf(targetOf(lastIdx));
+      if (t >= 0) {
+        fn.succs.push_back(blockOf[t]);
+      }
+      if (hasNext && !(t >= 0 && blockOf[t] == bi + 1)) {
+        fn.succs.push_back(bi + 1);
+      }
+      break;
+    }
+    case Terminator::Jump:
+      fn.succs.push_back(blockOf[fn.indexOf(targetOf(lastIdx))]);
+      break;
+    case Terminator::Call: {
+      uint64_t target = 0;
+      if (last.op == Op::JAL) {
+        target = targetOf(lastIdx);
+      } else if (lastIdx > b.firstInstr &&
+                 fn.instrs[lastIdx - 1].op == Op::AUIPC &&
+                 fn.instrs[lastIdx - 1].rd == last.rs1) {
+        // auipc rX, hi; jalr ra, lo(rX) -- the `call` pseudo-instruction.
+        target = fn.addressOf(lastIdx - 1) +
+                 static_cast<int64_t>(fn.instrs[lastIdx - 1].imm) +
+                 static_cast<int64_t>(last.imm);
+      }
+      fn.calls.push_back({bi, fn.addressOf(lastIdx), target});
+      if (hasNext) {
+        fn.succs.push_back(bi + 1);
+      }
+      break;
+    }
+    case Terminator::FallThrough:
+      fn.succs.push_back(bi + 1);
+      break;
+    case Terminator::Return:
+    case Terminator::IndirectJump:
+    case Terminator::TailCall:
+    case Terminator::Invalid:
+      break;
+    }
+    b.succCount = static_cast<uint32_t>(fn.succs.size()) - b.succBegin;
+  }
+
+  // Pass 4: predecessor edges, by counting sort over the successor lists.
+  for (auto &b : fn.blocks) {
+    b.predCount = 0;
+  }
+  for (uint32_t s : fn.succs) {
+    fn.blocks[s].predCount++;
+  }
+  uint32_t offset = 0;
+  for (auto &b : fn.blocks) {
+    b.predBegin = offset;
+    offset += b.predCount;
+    b.predCount = 0;
+  }
+  fn.preds.resize(fn.succs.size());
+  for (uint32_t bi = 0; bi < nblocks; bi++) {
+    for (uint32_t s : fn.successors(bi)) {
+      auto &target = fn.blocks[s];
+      fn.preds[target.predBegin + target.predCount++] = bi;
+    }
+  }
+
+  return fn;
+}
+
+std::vector<FunctionCFG> buildAllCFGs(const elf::ELF &elf) {
+  auto functions = elf.symbols().functions();
+
+  std::vector<FunctionCFG> cfgs;
+  cfgs.reserve(functions.size());
+  for (const auto *sym : functions) {
+    auto bytes = readCode(elf, sym->value, sym->size);
+    if (bytes.empty()) {
+      continue;
+    }
+    cfgs.push_back(buildCFG(sym->value, bytes));
+    cfgs.back().name = sym->name;
+  }
+  return cfgs;
+}
+
+} // namespace riscy::cfg
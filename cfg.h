@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "decode.h"
+
+namespace riscy::elf {
+struct ELF;
+}
+
+namespace riscy::cfg {
+
+// How control leaves a basic block.
+enum class Terminator : uint8_t {
+  // Falls into the next block (the next instruction is a branch target).
+  FallThrough,
+  // Conditional branch: successors are the taken target (if inside the
+  // function) and the fall-through block.
+  Branch,
+  // JAL x0 within the function.
+  Jump,
+  // JAL/JALR with a link register; continues at the next block.
+  Call,
+  // JALR x0, 0(ra).
+  Return,
+  // JALR x0 to a computed address; no successors are known.
+  IndirectJump,
+  // JAL x0 (or auipc+jalr x0) to a target outside the function.
+  TailCall,
+  // Undecodable instruction or the end of the function's bytes.
+  Invalid,
+};
+
+struct BasicBlock {
+  // Guest address of the first instruction.
+  uint64_t start;
+  // Range into FunctionCFG::instrs.
+  uint32_t firstInstr;
+  uint32_t instrCount;
+  // Ranges into FunctionCFG::succs / FunctionCFG::preds.
+  uint32_t succBegin;
+  uint32_t succCount;
+  uint32_t predBegin;
+  uint32_t predCount;
+  Terminator terminator;
+};
+
+struct CallSite {
+  // Block ending in the call instruction.
+  uint32_t block;
+  // Address of the call instruction.
+  uint64_t address;
+  // Callee entry, or 0 for an indirect call.
+  uint64_t target;
+};
+
+// Control-flow graph of one function, stored as flat arrays: blocks refer to
+// instructions and edges by index, and edges are kept in CSR form (each
+// block owns a contiguous range of `succs` and of `preds`).
+struct FunctionCFG {
+  std::string_view name;
+  uint64_t entry = 0;
+  uint64_t size = 0;
+
+  // instrs[i] is the instruction at entry + offsets[i]; with compressed
+  // instructions about, these are 2 or 4 bytes apart.
+  std::vector<risc::DecodedInstr> instrs;
+  std::vector<uint32_t> offsets;
+  std::vector<BasicBlock> blocks;
+  std::vector<uint32_t> succs;
+  std::vector<uint32_t> preds;
+  std::vector<CallSite> calls;
+
+  [[nodiscard]] inline std::span<const uint32_t>
+  successors(uint32_t block) const {
+    const auto &b = blocks[block];
+    return {succs.data() + b.succBegin, b.succCount};
+  }
+
+  [[nodiscard]] inline std::span<const uint32_t>
+  predecessors(uint32_t block) const {
+    const auto &b = blocks[block];
+    return {preds.data() + b.predBegin, b.predCount};
+  }
+
+  [[nodiscard]] inline uint64_t addressOf(uint32_t instr) const {
+    return entry + offsets[instr];
+  }
+
+  // Index of the instruction starting at `addr`, or -1 if no instruction of
+  // the function starts there.
+  [[nodiscard]] int64_t indexOf(uint64_t addr) const;
+
+  // Index of the block containing `addr`, or -1.
+  [[nodiscard]] int64_t blockAt(uint64_t addr) const;
+};
+
+// Builds the CFG of the function at `entry` whose code is `bytes`, a stream
+// of 16- and 32-bit instructions in guest (little-endian) byte order.
+[[nodiscard]] FunctionCFG buildCFG(uint64_t entry,
+                                   std::span<const uint8_t> bytes);
+
+// Builds the CFG of every sized, defined function symbol in `elf`, in
+// address order. Aliases (several symbols at one address) yield one CFG.
+[[nodiscard]] std::vector<FunctionCFG> buildAllCFGs(const elf::ELF &elf);
+
+} // namespace riscy::cfg
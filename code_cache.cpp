@@ -0,0 +1,73 @@
+#include "code_cache.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace riscy::vm {
+
+namespace {
+
+size_t pageSize() {
+  static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  return size;
+}
+
+} // namespace
+
+CodeCache::CodeCache(size_t capacity) {
+  capacity = (capacity + pageSize() - 1) & ~(pageSize() - 1);
+  void *addr = mmap(nullptr, capacity, PROT_READ | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to map JIT code cache");
+  }
+  _base = static_cast<uint8_t *>(addr);
+  _capacity = capacity;
+}
+
+CodeCache::~CodeCache() {
+  if (_base) {
+    munmap(_base, _capacity);
+  }
+}
+
+template <typename F>
+void CodeCache::unprotected(uint8_t *at, size_t n, F &&write) {
+  uintptr_t mask = ~uintptr_t(pageSize() - 1);
+  uintptr_t first = reinterpret_cast<uintptr_t>(at) & mask;
+  uintptr_t last =
+      (reinterpret_cast<uintptr_t>(at) + n + pageSize() - 1) & mask;
+  void *pages = reinterpret_cast<void *>(first);
+  if (mprotect(pages, last - first, PROT_READ | PROT_WRITE) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to unprotect JIT code");
+  }
+  write();
+  if (mprotect(pages, last - first, PROT_READ | PROT_EXEC) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to protect JIT code");
+  }
+}
+
+const uint8_t *CodeCache::add(std::span<const uint8_t> code) {
+  size_t offset = alignedUsed();
+  if (offset > _capacity || _capacity - offset < code.size()) {
+    return nullptr;
+  }
+  uint8_t *at = _base + offset;
+  unprotected(at, code.size(),
+              [&] { std::memcpy(at, code.data(), code.size()); });
+  _used = offset + code.size();
+  return at;
+}
+
+void CodeCache::patch(uint8_t *at, std::span<const uint8_t> bytes) {
+  unprotected(at, bytes.size(),
+              [&] { std::memcpy(at, bytes.data(), bytes.size()); });
+}
+
+} // namespace riscy::vm
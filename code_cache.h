@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace riscy::vm {
+
+// A fixed-size region of executable memory for generated code, kept W^X:
+// pages are executable and read-only except for the moment they are being
+// written through add() or patch().
+class CodeCache {
+public:
+  static constexpr size_t kAlign = 16;
+
+private:
+  uint8_t *_base = nullptr;
+  size_t _capacity = 0;
+  size_t _used = 0;
+
+  // Runs `write` with the pages spanning [at, at + n) made writable.
+  template <typename F> void unprotected(uint8_t *at, size_t n, F &&write);
+
+public:
+  explicit CodeCache(size_t capacity);
+  CodeCache(const CodeCache &) = delete;
+  CodeCache &operator=(const CodeCache &) = delete;
+  ~CodeCache();
+
+  // Address the next add() will place its code at; generated code that
+  // uses rel32 displacements to other code must be assembled against it.
+  [[nodiscard]] inline uint64_t next() const {
+    return reinterpret_cast<uint64_t>(_base) + alignedUsed();
+  }
+
+  [[nodiscard]] inline size_t alignedUsed() const {
+    return (_used + kAlign - 1) & ~(kAlign - 1);
+  }
+
+  [[nodiscard]] inline size_t used() const { return _used; }
+
+  // Copies `code` to next() and returns its executable address, or nullptr
+  // if the cache is full.
+  const uint8_t *add(std::span<const uint8_t> code);
+
+  // Overwrites already-added code at `at`.
+  void patch(uint8_t *at, std::span<const uint8_t> bytes);
+
+  // Discards everything after the first `keep` bytes.
+  inline void truncate(size_t keep) { _used = keep; }
+};
+
+} // namespace riscy::vm
@@ -0,0 +1,770 @@
+#include "codegen.h"
+
+#include <algorithm>
+#include <format>
+#include <iterator>
+#include <string_view>
+#include <vector>
+
+#include "liveness.h"
+
+namespace riscy::codegen {
+
+using cfg::RegSet;
+using risc::DecodedInstr;
+using risc::Op;
+
+namespace {
+
+constexpr uint8_t kRA = 1;
+
+// Cached C is only valid for the generator that wrote it; bump whenever the
+// emitted text changes.
+constexpr uint64_t kCodegenVersion = 3;
+
+// Registers a caller may read after a standard-ABI return: ra, sp, gp, tp,
+// s0-s11 and the a0/a1 return values.
+constexpr RegSet kReturnRegs = 0b0000'1111'1111'1100'0000'1111'0001'1110;
+
+// Registers a standard-ABI callee leaves as it found them: sp, gp, tp and
+// s0-s11.
+constexpr RegSet kCalleeSaved = 0b0000'1111'1111'1100'0000'0011'0001'1100;
+
+// Guest memory is little-endian and accessed with memcpy, so the emitted
+// code (like vm::Memory) assumes a little-endian host. Signed right shifts
+// and narrowing casts rely on the GCC/Clang definitions of those
+// implementation-defined operations.
+constexpr std::string_view kPrelude = R"(/* Generated by riscy. */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct riscy_machine {
+  uint64_t x[32];
+  /* Host address of guest address `base`; guest memory is the window
+     [base, base + size). */
+  uint8_t *mem;
+  uint64_t base;
+  uint64_t size;
+} riscy_machine;
+
+typedef uint64_t (*riscy_fn)(riscy_machine *m);
+
+typedef struct riscy_function {
+  uint64_t entry;
+  riscy_fn fn;
+} riscy_function;
+
+#define RISCY_SEXT32(v) ((uint64_t)(int64_t)(int32_t)(uint32_t)(v))
+
+static inline uint64_t riscy_ld8(const uint8_t *p) { return *p; }
+static inline uint64_t riscy_ld16(const uint8_t *p) { uint16_t v; memcpy(&v, p, 2); return v; }
+static inline uint64_t riscy_ld32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint64_t riscy_ld64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline void riscy_st8(uint8_t *p, uint64_t v) { *p = (uint8_t)v; }
+static inline void riscy_st16(uint8_t *p, uint64_t v) { uint16_t t = (uint16_t)v; memcpy(p, &t, 2); }
+static inline void riscy_st32(uint8_t *p, uint64_t v) { uint32_t t = (uint32_t)v; memcpy(p, &t, 4); }
+static inline void riscy_st64(uint8_t *p, uint64_t v) { memcpy(p, &v, 8); }
+
+/* Division with the RISC-V results for a zero divisor and overflow. */
+static inline uint64_t riscy_div(uint64_t a, uint64_t b) {
+  if (b == 0) return UINT64_MAX;
+  if (a == (uint64_t)INT64_MIN && b == UINT64_MAX) return a;
+  return (uint64_t)((int64_t)a / (int64_t)b);
+}
+static inline uint64_t riscy_rem(uint64_t a, uint64_t b) {
+  if (b == 0) return a;
+  if (a == (uint64_t)INT64_MIN && b == UINT64_MAX) return 0;
+  return (uint64_t)((int64_t)a % (int64_t)b);
+}
+static inline uint64_t riscy_divu(uint64_t a, uint64_t b) { return b == 0 ? UINT64_MAX : a / b; }
+static inline uint64_t riscy_remu(uint64_t a, uint64_t b) { return b == 0 ? a : a % b; }
+static inline uint64_t riscy_divw(uint64_t a, uint64_t b) {
+  int32_t x = (int32_t)a, y = (int32_t)b;
+  if (y == 0) return UINT64_MAX;
+  if (x == INT32_MIN && y == -1) return RISCY_SEXT32(x);
+  return RISCY_SEXT32(x / y);
+}
+static inline uint64_t riscy_remw(uint64_t a, uint64_t b) {
+  int32_t x = (int32_t)a, y = (int32_t)b;
+  if (y == 0) return RISCY_SEXT32(x);
+  if (x == INT32_MIN && y == -1) return 0;
+  return RISCY_SEXT32(x % y);
+}
+static inline uint64_t riscy_divuw(uint64_t a, uint64_t b) {
+  uint32_t x = (uint32_t)a, y = (uint32_t)b;
+  return y == 0 ? UINT64_MAX : RISCY_SEXT32(x / y);
+}
+static inline uint64_t riscy_remuw(uint64_t a, uint64_t b) {
+  uint32_t x = (uint32_t)a, y = (uint32_t)b;
+  return RISCY_SEXT32(y == 0 ? x : x % y);
+}
+)";
+
+inline std::string reg(uint8_t r) {
+  return r ? std::format("x{}", r) : "UINT64_C(0)";
+}
+
+// A sign-extended immediate as a uint64_t operand.
+inline std::string imm(int64_t v) {
+  return v < 0 ? std::format("(uint64_t){}", v) : std::format("{}", v);
+}
+
+inline std::string addr(uint64_t v) { return std::format("UINT64_C({:#x})", v); }
+
+class FunctionEmitter {
+private:
+  std::string &out;
+  const cfg::FunctionCFG &fn;
+  std::span<const uint64_t> translated;
+  const Options &options;
+
+  std::string body;
+  // labelled[i]: instruction i is the target of a branch or jump.
+  std::vector<uint8_t> labelled;
+  cfg::Liveness live;
+  // Registers read or written by the emitted code, and those it writes
+  // (which must be stored back to the machine on exit).
+  RegSet referenced = 0;
+  RegSet written = 0;
+  bool usesMemory = false;
+  bool usesNext = false;
+  bool usesOut = false;
+  bool usesRet = false;
+
+  template <typename... Args>
+  void line(std::format_string<Args...> fmt, Args &&...args) {
+    body += "  ";
+    std::format_to(std::back_inserter(body), fmt, std::forward<Args>(args)...);
+    body += '\n';
+  }
+
+  [[nodiscard]] bool isTranslated(uint64_t target) const {
+    return std::binary_search(translated.begin(), translated.end(), target);
+  }
+
+  void exitTo(const std::string &next) {
+    line("next = {};", next);
+    line("goto out;");
+    usesNext = usesOut = true;
+  }
+
+  [[nodiscard]] static bool isReturn(const DecodedInstr &d) {
+    return d.op == Op::JALR && d.rd == 0 && d.rs1 == kRA && d.imm == 0;
+  }
+
+  [[nodiscard]] bool isCall(const DecodedInstr &d, uint64_t pc) const {
+    if (d.rd != kRA) {
+      return false;
+    }
+    if (d.op == Op::JAL) {
+      return isTranslated(pc + d.imm);
+    }
+    return d.op == Op::JALR && isTranslated(callTarget(pc));
+  }
+
+  // Direct target of the auipc+jalr call at `pc`, or 0.
+  [[nodiscard]] uint64_t callTarget(uint64_t pc) const {
+    for (const auto &call : fn.calls) {
+      if (call.address == pc) {
+        return call.target;
+      }
+    }
+    return 0;
+  }
+
+  // Registers the machine state must hold if control leaves the function at
+  // instruction i, or 0 if it cannot.
+  [[nodiscard]] RegSet exitUses(uint32_t i) const {
+    const DecodedInstr &d = fn.instrs[i];
+    const uint64_t pc = fn.addressOf(i);
+    if (i + 1 == fn.instrs.size()) {
+      return cfg::kAllRegs;
+    }
+    switch (d.op) {
+    case Op::LB:
+    case Op::LH:
+    case Op::LW:
+    case Op::LD:
+    case Op::LBU:
+    case Op::LHU:
+    case Op::LWU:
+    case Op::SB:
+    case Op::SH:
+    case Op::SW:
+    case Op::SD:
+      return options.checkBounds ? cfg::kAllRegs : 0;
+    case Op::BEQ:
+    case Op::BNE:
+    case Op::BLT:
+    case Op::BGE:
+    case Op::BLTU:
+    case Op::BGEU:
+      return fn.indexOf(pc + d.imm) >= 0 ? 0 : cfg::kAllRegs;
+    case Op::JAL:
+      return d.rd == 0 && fn.indexOf(pc + d.imm) >= 0 ? 0 : cfg::kAllRegs;
+    case Op::JALR:
+      return isReturn(d) && options.assumeABI ? kReturnRegs : cfg::kAllRegs;
+    case Op::FENCE_I:
+    case Op::ECALL:
+    case Op::EBREAK:
+    case Op::INVALID:
+    case Op::_count:
+      return cfg::kAllRegs;
+    default:
+      return risc::isAtomic(d.op) ? cfg::kAllRegs : 0;
+    }
+  }
+
+  void analyze() {
+    const uint32_t n = static_cast<uint32_t>(fn.instrs.size());
+    if (options.optimize) {
+      std::vector<RegSet> exits(n);
+      for (uint32_t i = 0; i < n; i++) {
+        exits[i] = exitUses(i);
+      }
+      live = cfg::computeLiveness(fn, exits);
+    } else {
+      live.liveOut.assign(n, cfg::kAllRegs);
+      live.dead.assign(n, 0);
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+      const auto &d = fn.instrs[i];
+      if (live.dead[i]) {
+        continue;
+      }
+      RegSet def = cfg::defs(d);
+      if (!cfg::isPure(d) && d.op != Op::JAL && d.op != Op::JALR) {
+        // A load whose result is never read keeps only its bounds check.
+        def &= live.liveOut[i];
+      }
+      referenced |= cfg::uses(d) | def;
+      written |= def;
+
+      bool jumps = d.op == Op::JAL || d.op == Op::BEQ || d.op == Op::BNE ||
+                   d.op == Op::BLT || d.op == Op::BGE || d.op == Op::BLTU ||
+                   d.op == Op::BGEU;
+      if (jumps && !(d.op == Op::JAL && d.rd != 0)) {
+        if (int64_t t = fn.indexOf(fn.addressOf(i) + d.imm); t >= 0) {
+          labelled[t] = 1;
+        }
+      }
+    }
+    if (!options.optimize) {
+      written = referenced;
+    }
+  }
+
+  void spill(RegSet set) {
+    for (uint8_t r = 1; r < 32; r++) {
+      if (set & cfg::regBit(r)) {
+        line("m->x[{0}] = x{0};", r);
+      }
+    }
+  }
+
+  void reload(RegSet set) {
+    for (uint8_t r = 1; r < 32; r++) {
+      if (set & cfg::regBit(r)) {
+        line("x{0} = m->x[{0}];", r);
+      }
+    }
+  }
+
+  // ra has already been set to `ret`.
+  void callTranslated(uint32_t i, uint64_t target, uint64_t ret) {
+    spill(written);
+    line("next = {}(m);", functionName(target));
+    RegSet clobbered =
+        options.optimize && options.assumeABI ? ~kCalleeSaved : cfg::kAllRegs;
+    // A callee that stops elsewhere has left the whole state in m->x, which
+    // our locals, reloaded only where live, mustn't overwrite.
+    line("if (next != {}) return next;", addr(ret));
+    reload(live.liveOut[i] & referenced & clobbered);
+    usesNext = true;
+  }
+
+  void assign(uint8_t rd, const std::string &value) {
+    if (rd) {
+      line("x{} = {};", rd, value);
+    }
+  }
+
+  void load(uint32_t i, const DecodedInstr &d, uint64_t pc, unsigned bytes,
+            std::string_view cast) {
+    line("{{");
+    line("  uint64_t ea = {} + {};", reg(d.rs1), imm(d.imm));
+    if (options.checkBounds) {
+      line("  if (ea - base > size - {}) {{ next = {}; goto out; }}", bytes,
+           addr(pc));
+      usesNext = usesOut = true;
+    }
+    if (d.rd && (cfg::defs(d) & live.liveOut[i])) {
+      line("  x{} = {}riscy_ld{}(mem + (ea - base));", d.rd, cast, bytes * 8);
+    }
+    line("}}");
+    usesMemory = true;
+  }
+
+  void store(const DecodedInstr &d, uint64_t pc, unsigned bytes) {
+    line("{{");
+    line("  uint64_t ea = {} + {};", reg(d.rs1), imm(d.imm));
+    if (options.checkBounds) {
+      line("  if (ea - base > size - {}) {{ next = {}; goto out; }}", bytes,
+           addr(pc));
+      usesNext = usesOut = true;
+    }
+    line("  riscy_st{}(mem + (ea - base), {});", bytes * 8, reg(d.rs2));
+    line("}}");
+    usesMemory = true;
+  }
+
+  void branch(const DecodedInstr &d, uint64_t pc, std::string_view op,
+              bool isSigned) {
+    std::string a = reg(d.rs1), b = reg(d.rs2);
+    if (isSigned) {
+      a = std::format("(int64_t){}", a);
+      b = std::format("(int64_t){}", b);
+    }
+    uint64_t target = pc + d.imm;
+    if (fn.indexOf(target) >= 0) {
+      line("if ({} {} {}) goto L_{:x};", a, op, b, target);
+    } else {
+      line("if ({} {} {}) {{ next = {}; goto out; }}", a, op, b, addr(target));
+      usesNext = usesOut = true;
+    }
+  }
+
+  // Emits instruction i; returns false if control never falls through it.
+  bool instr(uint32_t i) {
+    const DecodedInstr &d = fn.instrs[i];
+    const uint64_t pc = fn.addressOf(i);
+    const uint64_t ret = pc + d.length;
+    const std::string a = reg(d.rs1), b = reg(d.rs2);
+    const std::string sh = std::format("{}", d.imm);
+
+    if (labelled[i]) {
+      body += std::format("L_{:x}:\n", pc);
+    }
+    if (live.dead[i]) {
+      line("/* {:#x}: {} (dead) */", pc, risc::mnemonic(d.op));
+      return true;
+    }
+    line("/* {:#x}: {} */", pc, risc::mnemonic(d.op));
+
+    switch (d.op) {
+    case Op::LUI:
+      assign(d.rd, addr(static_cast<uint64_t>(int64_t(d.imm))));
+      break;
+    case Op::AUIPC:
+      assign(d.rd, addr(pc + d.imm));
+      break;
+
+    case Op::JAL: {
+      uint64_t target = pc + d.imm;
+      assign(d.rd, addr(ret));
+      if (isCall(d, pc)) {
+        callTranslated(i, target, ret);
+        return true;
+      }
+      // Jumps with a link register leave the function even when the target
+      // is inside it, matching the CFG's view of them as calls.
+      if (d.rd == 0 && fn.indexOf(target) >= 0) {
+        line("goto L_{:x};", target);
+      } else {
+        exitTo(addr(target));
+      }
+      return false;
+    }
+    case Op::JALR: {
+      if (isCall(d, pc)) {
+        assign(d.rd, addr(ret));
+        callTranslated(i, callTarget(pc), ret);
+        return true;
+      }
+      bool toRet = options.optimize && options.assumeABI && isReturn(d);
+      line("{{");
+      line("  uint64_t target = ({} + {}) & ~UINT64_C(1);", a, imm(d.imm));
+      if (d.rd) {
+        line("  x{} = {};", d.rd, addr(ret));
+      }
+      line("  next = target;");
+      line("  goto {};", toRet ? "ret" : "out");
+      line("}}");
+      usesNext = true;
+      (toRet ? usesRet : usesOut) = true;
+      return false;
+    }
+
+    case Op::BEQ:
+      branch(d, pc, "==", false);
+      break;
+    case Op::BNE:
+      branch(d, pc, "!=", false);
+      break;
+    case Op::BLT:
+      branch(d, pc, "<", true);
+      break;
+    case Op::BGE:
+      branch(d, pc, ">=", true);
+      break;
+    case Op::BLTU:
+      branch(d, pc, "<", false);
+      break;
+    case Op::BGEU:
+      branch(d, pc, ">=", false);
+      break;
+
+    case Op::LB:
+      load(i, d, pc, 1, "(uint64_t)(int64_t)(int8_t)");
+      break;
+    case Op::LH:
+      load(i, d, pc, 2, "(uint64_t)(int64_t)(int16_t)");
+      break;
+    case Op::LW:
+      load(i, d, pc, 4, "(uint64_t)(int64_t)(int32_t)");
+      break;
+    case Op::LD:
+      load(i, d, pc, 8, "");
+      break;
+    case Op::LBU:
+      load(i, d, pc, 1, "");
+      break;
+    case Op::LHU:
+      load(i, d, pc, 2, "");
+      break;
+    case Op::LWU:
+      load(i, d, pc, 4, "");
+      break;
+
+    case Op::SB:
+      store(d, pc, 1);
+      break;
+    case Op::SH:
+      store(d, pc, 2);
+      break;
+    case Op::SW:
+      store(d, pc, 4);
+      break;
+    case Op::SD:
+      store(d, pc, 8);
+      break;
+
+    case Op::ADDI:
+      assign(d.rd, std::format("{} + {}", a, imm(d.imm)));
+      break;
+    case Op::SLTI:
+      assign(d.rd, std::format("(int64_t){} < {}", a, d.imm));
+      break;
+    case Op::SLTIU:
+      assign(d.rd, std::format("{} < {}", a, imm(d.imm)));
+      break;
+    case Op::XORI:
+      assign(d.rd, std::format("{} ^ {}", a, imm(d.imm)));
+      break;
+    case Op::ORI:
+      assign(d.rd, std::format("{} | {}", a, imm(d.imm)));
+      break;
+    case Op::ANDI:
+      assign(d.rd, std::format("{} & {}", a, imm(d.imm)));
+      break;
+    case Op::SLLI:
+      assign(d.rd, std::format("{} << {}", a, sh));
+      break;
+    case Op::SRLI:
+      assign(d.rd, std::format("{} >> {}", a, sh));
+      break;
+    case Op::SRAI:
+      assign(d.rd, std::format("(uint64_t)((int64_t){} >> {})", a, sh));
+      break;
+
+    case Op::ADD:
+      assign(d.rd, std::format("{} + {}", a, b));
+      break;
+    case Op::SUB:
+      assign(d.rd, std::format("{} - {}", a, b));
+      break;
+    case Op::SLL:
+      assign(d.rd, std::format("{} << ({} & 63)", a, b));
+      break;
+    case Op::SLT:
+      assign(d.rd, std::format("(int64_t){} < (int64_t){}", a, b));
+      break;
+    case Op::SLTU:
+      assign(d.rd, std::format("{} < {}", a, b));
+      break;
+    case Op::XOR:
+      assign(d.rd, std::format("{} ^ {}", a, b));
+      break;
+    case Op::SRL:
+      assign(d.rd, std::format("{} >> ({} & 63)", a, b));
+      break;
+    case Op::SRA:
+      assign(d.rd, std::format("(uint64_t)((int64_t){} >> ({} & 63))", a, b));
+      break;
+    case Op::OR:
+      assign(d.rd, std::format("{} | {}", a, b));
+      break;
+    case Op::AND:
+      assign(d.rd, std::format("{} & {}", a, b));
+      break;
+
+    case Op::ADDIW:
+      assign(d.rd, std::format("RISCY_SEXT32({} + {})", a, imm(d.imm)));
+      break;
+    case Op::SLLIW:
+      assign(d.rd, std::format("RISCY_SEXT32((uint32_t){} << {})", a, sh));
+      break;
+    case Op::SRLIW:
+      assign(d.rd, std::format("RISCY_SEXT32((uint32_t){} >> {})", a, sh));
+      break;
+    case Op::SRAIW:
+      assign(d.rd, std::format("RISCY_SEXT32((int32_t){} >> {})", a, sh));
+      break;
+    case Op::ADDW:
+      assign(d.rd, std::format("RISCY_SEXT32({} + {})", a, b));
+      break;
+    case Op::SUBW:
+      assign(d.rd, std::format("RISCY_SEXT32({} - {})", a, b));
+      break;
+    case Op::SLLW:
+      assign(d.rd, std::format("RISCY_SEXT32((uint32_t){} << ({} & 31))", a, b));
+      break;
+    case Op::SRLW:
+      assign(d.rd, std::format("RISCY_SEXT32((uint32_t){} >> ({} & 31))", a, b));
+      break;
+    case Op::SRAW:
+      assign(d.rd, std::format("RISCY_SEXT32((int32_t){} >> ({} & 31))", a, b));
+      break;
+
+    case Op::FENCE:
+      line("__atomic_thread_fence({});", risc::fenceOrdersStoreLoad(d.imm)
+                                             ? "__ATOMIC_SEQ_CST"
+                                             : "__ATOMIC_ACQ_REL");
+      break;
+    case Op::FENCE_I:
+      // Code after this point may have been rewritten; let the caller
+      // re-dispatch.
+      exitTo(addr(ret));
+      return false;
+
+    case Op::MUL:
+      assign(d.rd, std::format("{} * {}", a, b));
+      break;
+    case Op::MULH:
+      assign(d.rd, std::format("(uint64_t)(((__int128)(int64_t){} * "
+                               "(__int128)(int64_t){}) >> 64)",
+                               a, b));
+      break;
+    case Op::MULHSU:
+      assign(d.rd,
+             std::format("(uint64_t)(((__int128)(int64_t){} * (__int128){}) >> 64)",
+                         a, b));
+      break;
+    case Op::MULHU:
+      assign(d.rd, std::format("(uint64_t)(((unsigned __int128){} * "
+                               "(unsigned __int128){}) >> 64)",
+                               a, b));
+      break;
+    case Op::DIV:
+      assign(d.rd, std::format("riscy_div({}, {})", a, b));
+      break;
+    case Op::DIVU:
+      assign(d.rd, std::format("riscy_divu({}, {})", a, b));
+      break;
+    case Op::REM:
+      assign(d.rd, std::format("riscy_rem({}, {})", a, b));
+      break;
+    case Op::REMU:
+      assign(d.rd, std::format("riscy_remu({}, {})", a, b));
+      break;
+    case Op::MULW:
+      assign(d.rd, std::format("RISCY_SEXT32({} * {})", a, b));
+      break;
+    case Op::DIVW:
+      assign(d.rd, std::format("riscy_divw({}, {})", a, b));
+      break;
+    case Op::DIVUW:
+      assign(d.rd, std::format("riscy_divuw({}, {})", a, b));
+      break;
+    case Op::REMW:
+      assign(d.rd, std::format("riscy_remw({}, {})", a, b));
+      break;
+    case Op::REMUW:
+      assign(d.rd, std::format("riscy_remuw({}, {})", a, b));
+      break;
+
+    case Op::LR_W:
+    case Op::SC_W:
+    case Op::AMOSWAP_W:
+    case Op::AMOADD_W:
+    case Op::AMOXOR_W:
+    case Op::AMOAND_W:
+    case Op::AMOOR_W:
+    case Op::AMOMIN_W:
+    case Op::AMOMAX_W:
+    case Op::AMOMINU_W:
+    case Op::AMOMAXU_W:
+    case Op::LR_D:
+    case Op::SC_D:
+    case Op::AMOSWAP_D:
+    case Op::AMOADD_D:
+    case Op::AMOXOR_D:
+    case Op::AMOAND_D:
+    case Op::AMOOR_D:
+    case Op::AMOMIN_D:
+    case Op::AMOMAX_D:
+    case Op::AMOMINU_D:
+    case Op::AMOMAXU_D:
+    case Op::ECALL:
+    case Op::EBREAK:
+    case Op::INVALID:
+    case Op::_count:
+      // Left for the interpreter to service or report. Atomics go there too,
+      // as they need the hart's reservation.
+      exitTo(addr(pc));
+      return false;
+    }
+    return true;
+  }
+
+public:
+  FunctionEmitter(std::string &out, const cfg::FunctionCFG &fn,
+                  std::span<const uint64_t> translated, const Options &options)
+      : out(out), fn(fn), translated(translated), options(options),
+        labelled(fn.instrs.size(), 0) {}
+
+  void emit() {
+    const uint32_t n = static_cast<uint32_t>(fn.instrs.size());
+    analyze();
+
+    bool fallsThrough = true;
+    for (uint32_t i = 0; i < n; i++) {
+      fallsThrough = instr(i);
+    }
+    if (fallsThrough) {
+      // Ran off the end of the function's bytes.
+      exitTo(addr(fn.entry + fn.size));
+    }
+
+    if (!fn.name.empty()) {
+      std::format_to(std::back_inserter(out), "/* {} */\n", fn.name);
+    }
+    std::format_to(std::back_inserter(out), "uint64_t {}(riscy_machine *m) {{\n",
+                   functionName(fn.entry));
+    for (uint8_t r = 1; r < 32; r++) {
+      if (referenced & cfg::regBit(r)) {
+        std::format_to(std::back_inserter(out), "  uint64_t x{0} = m->x[{0}];\n",
+                       r);
+      }
+    }
+    if (usesMemory) {
+      out += "  uint8_t *const mem = m->mem;\n";
+      out += "  const uint64_t base = m->base;\n";
+      if (options.checkBounds) {
+        out += "  const uint64_t size = m->size;\n";
+      }
+    }
+    if (usesNext) {
+      out += "  uint64_t next;\n";
+    }
+    out += body;
+    if (usesOut) {
+      body.clear();
+      spill(written);
+      out += "out:\n";
+      out += body;
+      out += "  return next;\n";
+    }
+    if (usesRet) {
+      body.clear();
+      spill(written & kReturnRegs);
+      out += "ret:\n";
+      out += body;
+      out += "  return next;\n";
+    }
+    out += "}\n";
+  }
+};
+
+} // namespace
+
+std::string functionName(uint64_t entry) {
+  return std::format("riscy_fn_{:x}", entry);
+}
+
+void emitPrelude(std::string &out) { out += kPrelude; }
+
+void emitFunction(std::string &out, const cfg::FunctionCFG &fn,
+                  std::span<const uint64_t> translated,
+                  const Options &options) {
+  FunctionEmitter(out, fn, translated, options).emit();
+}
+
+void emitFunctionCached(std::string &out, cache::TranslationCache &cache,
+                        uint64_t binary, std::string_view name,
+                        uint64_t entry, std::span<const uint8_t> code,
+                        std::span<const uint64_t> translated,
+                        const Options &options) {
+  // Everything the emitted text depends on.
+  uint64_t input = cache::hashValue(options, kCodegenVersion);
+  input = cache::hash({reinterpret_cast<const uint8_t *>(name.data()),
+                       name.size()},
+                      input);
+  input = cache::hash({reinterpret_cast<const uint8_t *>(translated.data()),
+                       translated.size_bytes()},
+                      input);
+  input = cache::hash(code, input);
+
+  const cache::Key key{binary, cache::Kind::CFunction, entry};
+  if (auto hit = cache.load(key, input)) {
+    auto text = hit->span();
+    out.append(reinterpret_cast<const char *>(text.data()), text.size());
+    return;
+  }
+
+  cfg::FunctionCFG fn = cfg::buildCFG(entry, code);
+  fn.name = name;
+  size_t start = out.size();
+  emitFunction(out, fn, translated, options);
+  cache.store(key, input,
+              {reinterpret_cast<const uint8_t *>(out.data() + start),
+               out.size() - start});
+}
+
+std::string emitTranslationUnit(std::span<const cfg::FunctionCFG> fns,
+                                const Options &options) {
+  std::vector<uint64_t> entries;
+  entries.reserve(fns.size());
+  for (const auto &fn : fns) {
+    entries.push_back(fn.entry);
+  }
+  std::sort(entries.begin(), entries.end());
+  entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+
+  std::string out;
+  emitPrelude(out);
+  out += '\n';
+  for (uint64_t entry : entries) {
+    std::format_to(std::back_inserter(out), "uint64_t {}(riscy_machine *m);\n",
+                   functionName(entry));
+  }
+  for (const auto &fn : fns) {
+    out += '\n';
+    emitFunction(out, fn, entries, options);
+  }
+
+  // Sorted by entry, terminated by a null entry.
+  out += "\nconst riscy_function riscy_functions[] = {\n";
+  for (uint64_t entry : entries) {
+    std::format_to(std::back_inserter(out), "  {{{}, {}}},\n", addr(entry),
+                   functionName(entry));
+  }
+  out += "  {0, 0},\n};\n";
+  std::format_to(std::back_inserter(out),
+                 "const size_t riscy_function_count = {};\n", entries.size());
+  return out;
+}
+
+} // namespace riscy::codegen
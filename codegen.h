@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "cfg.h"
+#include "translation_cache.h"
+
+namespace riscy::codegen {
+
+// Ahead-of-time translation of guest functions to C.
+//
+// Every guest function becomes
+//
+//   uint64_t riscy_fn_<entry>(riscy_machine *m);
+//
+// operating on the simulated machine state declared by the prelude: the
+// integer registers and a flat guest memory window (the same layout as
+// vm::Memory). Registers live in `uint64_t` locals for the duration of the
+// call and are written back to `m->x` on every exit. The return value is the
+// guest pc at which execution continues -- the caller's return address after
+// a normal return, or the address of whatever the C code could not handle
+// itself (an indirect jump, a call into an untranslated function, an
+// illegal instruction or out-of-range memory access, which is left for the
+// interpreter to re-execute and report).
+struct Options {
+  // Check every guest memory access against the memory window. Without the
+  // checks an out-of-range access is undefined behaviour on the host.
+  bool checkBounds = true;
+  // Drop register writes that are never read, and store back (or reload
+  // around calls) only the registers that need it, using a liveness pass
+  // over the CFG.
+  bool optimize = true;
+  // Assume callers follow the standard calling convention, so that on a
+  // return only ra, sp, gp, tp, s0-s11, a0 and a1 need to reach the machine
+  // state. Temporaries then differ from what the interpreter would leave.
+  bool assumeABI = false;
+};
+
+// C identifier of the function emitted for the guest function at `entry`.
+[[nodiscard]] std::string functionName(uint64_t entry);
+
+// Includes, the riscy_machine type and the memory/arithmetic helpers used by
+// emitted functions.
+void emitPrelude(std::string &out);
+
+// Appends the definition of `fn`. Direct calls (through ra) to an entry in
+// `translated` (sorted) become C calls; any other call exits to the caller.
+void emitFunction(std::string &out, const cfg::FunctionCFG &fn,
+                  std::span<const uint64_t> translated,
+                  const Options &options = {});
+
+// emitFunction() for the guest function `name` at `entry` whose machine code
+// is `code`, going through `cache` (see translation_cache.h) under
+// `binary`, the hash of the file it came from. An entry stored for the same
+// code, name, `translated` set and options is appended as is, without
+// decoding anything; otherwise the function is translated and stored.
+void emitFunctionCached(std::string &out, cache::TranslationCache &cache,
+                        uint64_t binary, std::string_view name,
+                        uint64_t entry, std::span<const uint8_t> code,
+                        std::span<const uint64_t> translated,
+                        const Options &options = {});
+
+// A complete, self-contained C translation unit: the prelude, every function
+// in `fns`, and a table `riscy_functions` of {entry, function} pairs sorted
+// by entry.
+[[nodiscard]] std::string
+emitTranslationUnit(std::span<const cfg::FunctionCFG> fns,
+                    const Options &options = {});
+
+} // namespace riscy::codegen
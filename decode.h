@@ -0,0 +1,873 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <type_traits>
+
+namespace riscy::risc {
+
+// Major opcode, i.e. bits [6:2] of a 32-bit instruction.
+enum InstrType : int {
+  LOAD = 0,
+  LOAD_FP,
+  _custom_0,
+  MISC_MEM,
+  OP_IMM,
+  AUIPC,
+  OP_IMM_32,
+  _invalid_48b_1,
+  //
+  STORE,
+  STORE_FP,
+  _custom_1,
+  AMO,
+  OP,
+  LUI,
+  OP_32,
+  _invalid_64b,
+  //
+  MADD,
+  MSUB,
+  NMSUB,
+  NMADD,
+  OP_FP,
+  _reserved_10101,
+  _custom_2_rv128,
+  _invalid_48b_2,
+  //
+  BRANCH,
+  JALR,
+  _reserved_11010,
+  JAL,
+  SYSTEM,
+  _reserved_11101,
+  _custom_3_rv128,
+  _invalid_ge80b,
+};
+
+constexpr std::string_view InstrTypeNames[] = {
+    "LOAD",
+    "LOAD_FP",
+    "_custom_0",
+    "MISC_MEM",
+    "OP_IMM",
+    "AUIPC",
+    "OP_IMM_32",
+    "_invalid_48b_1",
+    //
+    "STORE",
+    "STORE_FP",
+    "_custom_1",
+    "AMO",
+    "OP",
+    "LUI",
+    "OP_32",
+    "_invalid_64b",
+    //
+    "MADD",
+    "MSUB",
+    "NMSUB",
+    "NMADD",
+    "OP_FP",
+    "_reserved_10101",
+    "_custom_2_rv128",
+    "_invalid_48b_2",
+    //
+    "BRANCH",
+    "JALR",
+    "_reserved_11010",
+    "JAL",
+    "SYSTEM",
+    "_reserved_11101",
+    "_custom_3_rv128",
+    "_invalid_ge80b",
+};
+
+enum class Format : uint8_t {
+  Invalid,
+  R,
+  I,
+  S,
+  B,
+  U,
+  J,
+};
+
+enum class Op : uint8_t {
+  INVALID = 0,
+  // RV32I/RV64I
+  LUI,
+  AUIPC,
+  JAL,
+  JALR,
+  BEQ,
+  BNE,
+  BLT,
+  BGE,
+  BLTU,
+  BGEU,
+  LB,
+  LH,
+  LW,
+  LD,
+  LBU,
+  LHU,
+  LWU,
+  SB,
+  SH,
+  SW,
+  SD,
+  ADDI,
+  SLTI,
+  SLTIU,
+  XORI,
+  ORI,
+  ANDI,
+  SLLI,
+  SRLI,
+  SRAI,
+  ADD,
+  SUB,
+  SLL,
+  SLT,
+  SLTU,
+  XOR,
+  SRL,
+  SRA,
+  OR,
+  AND,
+  ADDIW,
+  SLLIW,
+  SRLIW,
+  SRAIW,
+  ADDW,
+  SUBW,
+  SLLW,
+  SRLW,
+  SRAW,
+  FENCE,
+  FENCE_I,
+  // RV32M/RV64M
+  MUL,
+  MULH,
+  MULHSU,
+  MULHU,
+  DIV,
+  DIVU,
+  REM,
+  REMU,
+  MULW,
+  DIVW,
+  DIVUW,
+  REMW,
+  REMUW,
+  // RV32A/RV64A, in the same order for both widths
+  LR_W,
+  SC_W,
+  AMOSWAP_W,
+  AMOADD_W,
+  AMOXOR_W,
+  AMOAND_W,
+  AMOOR_W,
+  AMOMIN_W,
+  AMOMAX_W,
+  AMOMINU_W,
+  AMOMAXU_W,
+  LR_D,
+  SC_D,
+  AMOSWAP_D,
+  AMOADD_D,
+  AMOXOR_D,
+  AMOAND_D,
+  AMOOR_D,
+  AMOMIN_D,
+  AMOMAX_D,
+  AMOMINU_D,
+  AMOMAXU_D,
+  // Environment calls
+  ECALL,
+  EBREAK,
+  //
+  _count,
+};
+
+constexpr std::string_view OpNames[] = {
+    "<invalid>",
+    //
+    "lui",
+    "auipc",
+    "jal",
+    "jalr",
+    "beq",
+    "bne",
+    "blt",
+    "bge",
+    "bltu",
+    "bgeu",
+    "lb",
+    "lh",
+    "lw",
+    "ld",
+    "lbu",
+    "lhu",
+    "lwu",
+    "sb",
+    "sh",
+    "sw",
+    "sd",
+    "addi",
+    "slti",
+    "sltiu",
+    "xori",
+    "ori",
+    "andi",
+    "slli",
+    "srli",
+    "srai",
+    "add",
+    "sub",
+    "sll",
+    "slt",
+    "sltu",
+    "xor",
+    "srl",
+    "sra",
+    "or",
+    "and",
+    "addiw",
+    "slliw",
+    "srliw",
+    "sraiw",
+    "addw",
+    "subw",
+    "sllw",
+    "srlw",
+    "sraw",
+    "fence",
+    "fence.i",
+    //
+    "mul",
+    "mulh",
+    "mulhsu",
+    "mulhu",
+    "div",
+    "divu",
+    "rem",
+    "remu",
+    "mulw",
+    "divw",
+    "divuw",
+    "remw",
+    "remuw",
+    //
+    "lr.w",
+    "sc.w",
+    "amoswap.w",
+    "amoadd.w",
+    "amoxor.w",
+    "amoand.w",
+    "amoor.w",
+    "amomin.w",
+    "amomax.w",
+    "amominu.w",
+    "amomaxu.w",
+    "lr.d",
+    "sc.d",
+    "amoswap.d",
+    "amoadd.d",
+    "amoxor.d",
+    "amoand.d",
+    "amoor.d",
+    "amomin.d",
+    "amomax.d",
+    "amominu.d",
+    "amomaxu.d",
+    //
+    "ecall",
+    "ebreak",
+};
+
+static_assert(std::size(OpNames) == static_cast<size_t>(Op::_count));
+
+[[nodiscard]] constexpr std::string_view mnemonic(Op op) {
+  return OpNames[static_cast<size_t>(op)];
+}
+
+// Whether `op` is a jump or branch, i.e. may continue somewhere other than
+// the next instruction.
+[[nodiscard]] constexpr bool isControlTransfer(Op op) {
+  return op >= Op::JAL && op <= Op::BGEU;
+}
+
+// Whether `op` is one of the A extension's LR, SC or AMO instructions.
+// Their `imm` holds the aq/rl ordering bits (aq << 1 | rl).
+[[nodiscard]] constexpr bool isAtomic(Op op) {
+  return op >= Op::LR_W && op <= Op::AMOMAXU_D;
+}
+
+// Bytes an atomic instruction accesses.
+[[nodiscard]] constexpr unsigned atomicSize(Op op) {
+  return op >= Op::LR_D ? 8 : 4;
+}
+
+// Whether a FENCE with immediate `imm` (fm[11:8], then the predecessor and
+// successor sets, each I, O, R, W from the top bit) orders earlier stores
+// before later loads. That is the one ordering a TSO host doesn't give for
+// free; FENCE.TSO deliberately leaves it out.
+[[nodiscard]] constexpr bool fenceOrdersStoreLoad(int32_t imm) {
+  constexpr uint32_t kTso = 0b1000;
+  uint32_t fm = (uint32_t(imm) >> 8) & 0xF;
+  return fm != kTso && (imm & 0b0001'0000) && (imm & 0b0000'0010);
+}
+
+// The major opcode `op` is encoded under (as a 32-bit instruction; the
+// compressed forms expand to these). INVALID has none and maps to
+// _invalid_ge80b.
+[[nodiscard]] constexpr InstrType majorOpcode(Op op) {
+  switch (op) {
+  case Op::LUI:
+    return LUI;
+  case Op::AUIPC:
+    return AUIPC;
+  case Op::JAL:
+    return JAL;
+  case Op::JALR:
+    return JALR;
+  case Op::FENCE:
+  case Op::FENCE_I:
+    return MISC_MEM;
+  case Op::ECALL:
+  case Op::EBREAK:
+    return SYSTEM;
+  default:
+    break;
+  }
+  if (op >= Op::BEQ && op <= Op::BGEU)
+    return BRANCH;
+  if (op >= Op::LB && op <= Op::LWU)
+    return LOAD;
+  if (op >= Op::SB && op <= Op::SD)
+    return STORE;
+  if (op >= Op::ADDI && op <= Op::SRAI)
+    return OP_IMM;
+  if ((op >= Op::ADD && op <= Op::AND) || (op >= Op::MUL && op <= Op::REMU))
+    return OP;
+  if (op >= Op::ADDIW && op <= Op::SRAIW)
+    return OP_IMM_32;
+  if ((op >= Op::ADDW && op <= Op::SRAW) ||
+      (op >= Op::MULW && op <= Op::REMUW))
+    return OP_32;
+  if (isAtomic(op))
+    return AMO;
+  return _invalid_ge80b;
+}
+
+// A fully decoded instruction. Register fields a format does not have are
+// left as x0, and `imm` is already sign-extended (or, for shifts, reduced to
+// the shift amount; for atomics, see isAtomic()).
+struct DecodedInstr {
+  Op op = Op::INVALID;
+  Format format = Format::Invalid;
+  uint8_t rd = 0;
+  uint8_t rs1 = 0;
+  uint8_t rs2 = 0;
+  // Encoded size in bytes: 2 for compressed (RVC) instructions, else 4.
+  uint8_t length = 4;
+  int32_t imm = 0;
+
+  [[nodiscard]] constexpr bool valid() const { return op != Op::INVALID; }
+};
+
+static_assert(std::is_trivially_copyable_v<DecodedInstr>);
+
+namespace detail {
+
+// How the final Op is chosen among the candidates of a table entry.
+enum class Select : uint8_t {
+  None,
+  // funct7: 0b0000000 -> op, 0b0100000 -> alt, 0b0000001 -> mext
+  Funct7,
+  // RV64 shift-immediate, funct6 in bits [31:26]: 0 -> op, 0b010000 -> alt
+  Shift6,
+  // RV64 *W shift-immediate, funct7: 0 -> op, 0b0100000 -> alt
+  Shift5,
+  // SYSTEM with funct3 0, bits [31:7] must be 0 -> op or 1 << 13 -> alt
+  // (imm 0 and 1; rd and rs1 zero)
+  System,
+  // AMO, funct5 in bits [31:27] indexes kAmoOrder -> op + that
+  Amo,
+};
+
+// Position of each AMO funct5 in the LR, SC, AMOSWAP, ... AMOMAXU run of
+// Ops, or -1 if it is reserved.
+inline constexpr int8_t kAmoOrder[32] = {
+    3,  2,  0,  1,  4,  -1, -1, -1, 6,  -1, -1, -1, 5,  -1, -1, -1,
+    7,  -1, -1, -1, 8,  -1, -1, -1, 9,  -1, -1, -1, 10, -1, -1, -1,
+};
+
+struct DecodeEntry {
+  Format format = Format::Invalid;
+  Select select = Select::None;
+  Op op = Op::INVALID;
+  Op alt = Op::INVALID;
+  Op mext = Op::INVALID;
+};
+
+// Indexed by (major opcode << 3) | funct3.
+using DecodeTable = std::array<DecodeEntry, 32 * 8>;
+
+constexpr DecodeTable makeDecodeTable() {
+  DecodeTable t{};
+  auto at = [&t](InstrType type, int funct3) -> DecodeEntry & {
+    return t[(static_cast<int>(type) << 3) | funct3];
+  };
+  auto all = [&t](InstrType type, Format format, Op op) {
+    for (int f3 = 0; f3 < 8; f3++)
+      t[(static_cast<int>(type) << 3) | f3] = {format, Select::None, op};
+  };
+
+  all(LUI, Format::U, Op::LUI);
+  all(AUIPC, Format::U, Op::AUIPC);
+  all(JAL, Format::J, Op::JAL);
+  at(JALR, 0b000) = {Format::I, Select::None, Op::JALR};
+
+  const Op branches[8] = {Op::BEQ,     Op::BNE, Op::INVALID, Op::INVALID,
+                          Op::BLT,     Op::BGE, Op::BLTU,    Op::BGEU};
+  const Op loads[8] = {Op::LB,  Op::LH,  Op::LW,  Op::LD,
+                       Op::LBU, Op::LHU, Op::LWU, Op::INVALID};
+  const Op stores[8] = {Op::SB,      Op::SH,      Op::SW,      Op::SD,
+                        Op::INVALID, Op::INVALID, Op::INVALID, Op::INVALID};
+  for (int f3 = 0; f3 < 8; f3++) {
+    if (branches[f3] != Op::INVALID)
+      at(BRANCH, f3) = {Format::B, Select::None, branches[f3]};
+    if (loads[f3] != Op::INVALID)
+      at(LOAD, f3) = {Format::I, Select::None, loads[f3]};
+    if (stores[f3] != Op::INVALID)
+      at(STORE, f3) = {Format::S, Select::None, stores[f3]};
+  }
+
+  at(OP_IMM, 0b000) = {Format::I, Select::None, Op::ADDI};
+  at(OP_IMM, 0b001) = {Format::I, Select::Shift6, Op::SLLI};
+  at(OP_IMM, 0b010) = {Format::I, Select::None, Op::SLTI};
+  at(OP_IMM, 0b011) = {Format::I, Select::None, Op::SLTIU};
+  at(OP_IMM, 0b100) = {Format::I, Select::None, Op::XORI};
+  at(OP_IMM, 0b101) = {Format::I, Select::Shift6, Op::SRLI, Op::SRAI};
+  at(OP_IMM, 0b110) = {Format::I, Select::None, Op::ORI};
+  at(OP_IMM, 0b111) = {Format::I, Select::None, Op::ANDI};
+
+  at(OP_IMM_32, 0b000) = {Format::I, Select::None, Op::ADDIW};
+  at(OP_IMM_32, 0b001) = {Format::I, Select::Shift5, Op::SLLIW};
+  at(OP_IMM_32, 0b101) = {Format::I, Select::Shift5, Op::SRLIW, Op::SRAIW};
+
+  at(OP, 0b000) = {Format::R, Select::Funct7, Op::ADD, Op::SUB, Op::MUL};
+  at(OP, 0b001) = {Format::R, Select::Funct7, Op::SLL, Op::INVALID, Op::MULH};
+  at(OP, 0b010) = {Format::R, Select::Funct7, Op::SLT, Op::INVALID,
+                   Op::MULHSU};
+  at(OP, 0b011) = {Format::R, Select::Funct7, Op::SLTU, Op::INVALID,
+                   Op::MULHU};
+  at(OP, 0b100) = {Format::R, Select::Funct7, Op::XOR, Op::INVALID, Op::DIV};
+  at(OP, 0b101) = {Format::R, Select::Funct7, Op::SRL, Op::SRA, Op::DIVU};
+  at(OP, 0b110) = {Format::R, Select::Funct7, Op::OR, Op::INVALID, Op::REM};
+  at(OP, 0b111) = {Format::R, Select::Funct7, Op::AND, Op::INVALID, Op::REMU};
+
+  at(OP_32, 0b000) = {Format::R, Select::Funct7, Op::ADDW, Op::SUBW, Op::MULW};
+  at(OP_32, 0b001) = {Format::R, Select::Funct7, Op::SLLW};
+  at(OP_32, 0b100) = {Format::R, Select::Funct7, Op::INVALID, Op::INVALID,
+                      Op::DIVW};
+  at(OP_32, 0b101) = {Format::R, Select::Funct7, Op::SRLW, Op::SRAW,
+                      Op::DIVUW};
+  at(OP_32, 0b110) = {Format::R, Select::Funct7, Op::INVALID, Op::INVALID,
+                      Op::REMW};
+  at(OP_32, 0b111) = {Format::R, Select::Funct7, Op::INVALID, Op::INVALID,
+                      Op::REMUW};
+
+  at(MISC_MEM, 0b000) = {Format::I, Select::None, Op::FENCE};
+  at(MISC_MEM, 0b001) = {Format::I, Select::None, Op::FENCE_I};
+
+  at(SYSTEM, 0b000) = {Format::I, Select::System, Op::ECALL, Op::EBREAK};
+
+  at(AMO, 0b010) = {Format::R, Select::Amo, Op::LR_W};
+  at(AMO, 0b011) = {Format::R, Select::Amo, Op::LR_D};
+
+  return t;
+}
+
+inline constexpr DecodeTable kDecodeTable = makeDecodeTable();
+
+[[nodiscard]] constexpr int32_t signExtend(uint32_t v, int bits) {
+  uint32_t m = uint32_t(1) << (bits - 1);
+  return static_cast<int32_t>((v ^ m) - m);
+}
+
+// Picks the final Op for word `n` among the candidates of its table entry.
+[[nodiscard]] constexpr Op selectOp(const DecodeEntry &e, uint32_t n) {
+  switch (e.select) {
+  case Select::None:
+    return e.op;
+  case Select::Funct7: {
+    uint32_t funct7 = n >> 25;
+    return funct7 == 0b0000000   ? e.op
+           : funct7 == 0b0100000 ? e.alt
+           : funct7 == 0b0000001 ? e.mext
+                                 : Op::INVALID;
+  }
+  case Select::Shift6: {
+    uint32_t funct6 = n >> 26;
+    return funct6 == 0 ? e.op : funct6 == 0b010000 ? e.alt : Op::INVALID;
+  }
+  case Select::Shift5: {
+    uint32_t funct7 = n >> 25;
+    return funct7 == 0 ? e.op : funct7 == 0b0100000 ? e.alt : Op::INVALID;
+  }
+  case Select::System: {
+    uint32_t rest = n >> 7;
+    return rest == 0 ? e.op : rest == 1u << 13 ? e.alt : Op::INVALID;
+  }
+  case Select::Amo: {
+    int order = kAmoOrder[n >> 27];
+    // LR has no rs2; the field must be zero.
+    if (order < 0 || (order == 0 && ((n >> 20) & 0b11111))) {
+      return Op::INVALID;
+    }
+    return static_cast<Op>(static_cast<int>(e.op) + order);
+  }
+  }
+  return Op::INVALID;
+}
+
+} // namespace detail
+
+// Decodes a 32-bit instruction word without allocating. Unknown or
+// unsupported encodings decode to Op::INVALID.
+[[nodiscard, gnu::always_inline]] constexpr DecodedInstr decode(uint32_t n) {
+  using namespace detail;
+
+  if ((n & 0b11) != 0b11) {
+    return {};
+  }
+
+  uint32_t tag = (n >> 2) & 0b11111;
+  uint32_t funct3 = (n >> 12) & 0b111;
+  const DecodeEntry &e = kDecodeTable[(tag << 3) | funct3];
+
+  Op op = selectOp(e, n);
+  if (op == Op::INVALID) {
+    return {};
+  }
+
+  uint32_t rd = (n >> 7) & 0b11111;
+  uint32_t rs1 = (n >> 15) & 0b11111;
+  uint32_t rs2 = (n >> 20) & 0b11111;
+  int32_t imm = 0;
+
+  switch (e.format) {
+  case Format::R:
+    if (e.select == Select::Amo) {
+      imm = (n >> 25) & 0b11;
+    }
+    break;
+  case Format::I:
+    rs2 = 0;
+    if (e.select == Select::Shift6) {
+      imm = (n >> 20) & 0b111111;
+    } else if (e.select == Select::Shift5) {
+      imm = (n >> 20) & 0b11111;
+    } else {
+      imm = signExtend(n >> 20, 12);
+    }
+    // rd/rs1 of FENCE and FENCE.I are reserved and must be ignored.
+    if (op == Op::FENCE || op == Op::FENCE_I) {
+      rd = 0;
+      rs1 = 0;
+    }
+    break;
+  case Format::S:
+    // imm[11:5] | rs2 | rs1 | funct3 | imm[4:0] | opcode
+    imm = signExtend(((n >> 25) << 5) | rd, 12);
+    rd = 0;
+    break;
+  case Format::B:
+    // imm[12|10:5] | rs2 | rs1 | funct3 | imm[4:1|11] | opcode
+    imm = signExtend(((n >> 31) << 12) | (((n >> 7) & 1) << 11) |
+                         (((n >> 25) & 0b111111) << 5) |
+                         (((n >> 8) & 0b1111) << 1),
+                     13);
+    rd = 0;
+    break;
+  case Format::U:
+    imm = static_cast<int32_t>(n & 0xFFFFF000);
+    rs1 = rs2 = 0;
+    break;
+  case Format::J:
+    // imm[20|10:1|11|19:12] | rd | opcode
+    imm = signExtend(((n >> 31) << 20) | (n & 0x000FF000) |
+                         (((n >> 20) & 1) << 11) |
+                         (((n >> 21) & 0b1111111111) << 1),
+                     21);
+    rs1 = rs2 = 0;
+    break;
+  case Format::Invalid:
+    break;
+  }
+
+  // Built in one go rather than field by field, so that the result can be
+  // returned in registers without a partial-store stall.
+  return DecodedInstr{op, e.format, static_cast<uint8_t>(rd),
+                      static_cast<uint8_t>(rs1), static_cast<uint8_t>(rs2),
+                      4, imm};
+}
+
+namespace detail {
+
+[[nodiscard]] constexpr uint32_t bits(uint32_t v, int hi, int lo) {
+  return (v >> lo) & ((uint32_t(1) << (hi - lo + 1)) - 1);
+}
+
+[[nodiscard]] constexpr uint32_t encodeR(InstrType type, uint32_t funct3,
+                                         uint32_t funct7, uint32_t rd,
+                                         uint32_t rs1, uint32_t rs2) {
+  return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 |
+         uint32_t(type) << 2 | 0b11;
+}
+
+[[nodiscard]] constexpr uint32_t encodeI(InstrType type, uint32_t funct3,
+                                         uint32_t rd, uint32_t rs1,
+                                         int32_t imm) {
+  return (uint32_t(imm) & 0xFFF) << 20 | rs1 << 15 | funct3 << 12 | rd << 7 |
+         uint32_t(type) << 2 | 0b11;
+}
+
+[[nodiscard]] constexpr uint32_t encodeS(uint32_t funct3, uint32_t rs1,
+                                         uint32_t rs2, int32_t imm) {
+  uint32_t u = uint32_t(imm);
+  return bits(u, 11, 5) << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 |
+         bits(u, 4, 0) << 7 | uint32_t(STORE) << 2 | 0b11;
+}
+
+[[nodiscard]] constexpr uint32_t encodeB(uint32_t funct3, uint32_t rs1,
+                                         uint32_t rs2, int32_t imm) {
+  uint32_t u = uint32_t(imm);
+  return bits(u, 12, 12) << 31 | bits(u, 10, 5) << 25 | rs2 << 20 |
+         rs1 << 15 | funct3 << 12 | bits(u, 4, 1) << 8 |
+         bits(u, 11, 11) << 7 | uint32_t(BRANCH) << 2 | 0b11;
+}
+
+[[nodiscard]] constexpr uint32_t encodeJ(uint32_t rd, int32_t imm) {
+  uint32_t u = uint32_t(imm);
+  return bits(u, 20, 20) << 31 | bits(u, 10, 1) << 21 | bits(u, 11, 11) << 20 |
+         bits(u, 19, 12) << 12 | rd << 7 | uint32_t(JAL) << 2 | 0b11;
+}
+
+} // namespace detail
+
+// The 32-bit instruction that compressed instruction `c` (RV64C, without
+// the floating-point loads and stores) stands for, or 0 if `c` is illegal,
+// reserved or not compressed at all.
+[[nodiscard]] constexpr uint32_t expandCompressed(uint16_t c) {
+  using namespace detail;
+
+  const uint32_t n = c;
+  const uint32_t funct3 = bits(n, 15, 13);
+  // Full register fields, and the x8-x15 ones of the CIW/CL/CS/CA/CB formats.
+  const uint32_t rd = bits(n, 11, 7), rs2 = bits(n, 6, 2);
+  const uint32_t rdp = 8 + bits(n, 4, 2), rs1p = 8 + bits(n, 9, 7);
+  // The 6-bit immediate of the CI format, sign-extended and zero-extended.
+  const int32_t imm6 = signExtend(bits(n, 12, 12) << 5 | bits(n, 6, 2), 6);
+  const uint32_t shamt = bits(n, 12, 12) << 5 | bits(n, 6, 2);
+
+  switch (n & 0b11) {
+  case 0b00: {
+    const uint32_t lw = bits(n, 12, 10) << 3 | bits(n, 6, 6) << 2 |
+                        bits(n, 5, 5) << 6;
+    const uint32_t ld = bits(n, 12, 10) << 3 | bits(n, 6, 5) << 6;
+    switch (funct3) {
+    case 0b000: { // c.addi4spn
+      const uint32_t imm = bits(n, 12, 11) << 4 | bits(n, 10, 7) << 6 |
+                           bits(n, 6, 6) << 2 | bits(n, 5, 5) << 3;
+      return imm ? encodeI(OP_IMM, 0b000, rdp, 2, int32_t(imm)) : 0;
+    }
+    case 0b010: // c.lw
+      return encodeI(LOAD, 0b010, rdp, rs1p, int32_t(lw));
+    case 0b011: // c.ld
+      return encodeI(LOAD, 0b011, rdp, rs1p, int32_t(ld));
+    case 0b110: // c.sw
+      return encodeS(0b010, rs1p, rdp, int32_t(lw));
+    case 0b111: // c.sd
+      return encodeS(0b011, rs1p, rdp, int32_t(ld));
+    }
+    return 0;
+  }
+
+  case 0b01:
+    switch (funct3) {
+    case 0b000: // c.addi (c.nop for rd = x0)
+      return encodeI(OP_IMM, 0b000, rd, rd, imm6);
+    case 0b001: // c.addiw
+      return rd ? encodeI(OP_IMM_32, 0b000, rd, rd, imm6) : 0;
+    case 0b010: // c.li
+      return encodeI(OP_IMM, 0b000, rd, 0, imm6);
+    case 0b011:
+      if (rd == 2) { // c.addi16sp
+        const int32_t imm =
+            signExtend(bits(n, 12, 12) << 9 | bits(n, 6, 6) << 4 |
+                           bits(n, 5, 5) << 6 | bits(n, 4, 3) << 7 |
+                           bits(n, 2, 2) << 5,
+                       10);
+        return imm ? encodeI(OP_IMM, 0b000, 2, 2, imm) : 0;
+      }
+      // c.lui
+      return imm6 ? (uint32_t(imm6) << 12 | rd << 7 | uint32_t(LUI) << 2 |
+                     0b11)
+                  : 0;
+    case 0b100:
+      switch (bits(n, 11, 10)) {
+      case 0b00: // c.srli
+        return encodeI(OP_IMM, 0b101, rs1p, rs1p, int32_t(shamt));
+      case 0b01: // c.srai
+        return encodeI(OP_IMM, 0b101, rs1p, rs1p,
+                       int32_t(shamt | 0b0100000 << 5));
+      case 0b10: // c.andi
+        return encodeI(OP_IMM, 0b111, rs1p, rs1p, imm6);
+      default: {
+        // c.sub, c.xor, c.or, c.and, c.subw, c.addw
+        const uint32_t f = bits(n, 12, 12) << 2 | bits(n, 6, 5);
+        constexpr uint32_t funct3s[] = {0b000, 0b100, 0b110, 0b111,
+                                        0b000, 0b000};
+        constexpr uint32_t funct7s[] = {0b0100000, 0, 0, 0, 0b0100000, 0};
+        if (f >= 6) {
+          return 0;
+        }
+        return encodeR(f < 4 ? OP : OP_32, funct3s[f], funct7s[f], rs1p, rs1p,
+                       rdp);
+      }
+      }
+    case 0b101: // c.j
+      return encodeJ(0, signExtend(bits(n, 12, 12) << 11 | bits(n, 11, 11) << 4 |
+                                       bits(n, 10, 9) << 8 |
+                                       bits(n, 8, 8) << 10 |
+                                       bits(n, 7, 7) << 6 | bits(n, 6, 6) << 7 |
+                                       bits(n, 5, 3) << 1 | bits(n, 2, 2) << 5,
+                                   12));
+    default: { // c.beqz, c.bnez
+      const int32_t imm =
+          signExtend(bits(n, 12, 12) << 8 | bits(n, 11, 10) << 3 |
+                         bits(n, 6, 5) << 6 | bits(n, 4, 3) << 1 |
+                         bits(n, 2, 2) << 5,
+                     9);
+      return encodeB(funct3 & 1, rs1p, 0, imm);
+    }
+    }
+
+  case 0b10:
+    switch (funct3) {
+    case 0b000: // c.slli
+      return encodeI(OP_IMM, 0b001, rd, rd, int32_t(shamt));
+    case 0b010: // c.lwsp
+      return rd ? encodeI(LOAD, 0b010, rd, 2,
+                          int32_t(bits(n, 12, 12) << 5 | bits(n, 6, 4) << 2 |
+                                  bits(n, 3, 2) << 6))
+                : 0;
+    case 0b011: // c.ldsp
+      return rd ? encodeI(LOAD, 0b011, rd, 2,
+                          int32_t(bits(n, 12, 12) << 5 | bits(n, 6, 5) << 3 |
+                                  bits(n, 4, 2) << 6))
+                : 0;
+    case 0b100:
+      if (!bits(n, 12, 12)) {
+        if (rs2) { // c.mv
+          return encodeR(OP, 0b000, 0, rd, 0, rs2);
+        }
+        // c.jr
+        return rd ? encodeI(JALR, 0b000, 0, rd, 0) : 0;
+      }
+      if (rs2) { // c.add
+        return encodeR(OP, 0b000, 0, rd, rd, rs2);
+      }
+      // c.ebreak, c.jalr
+      return rd ? encodeI(JALR, 0b000, 1, rd, 0)
+                : encodeI(SYSTEM, 0b000, 0, 0, 1);
+    case 0b110: // c.swsp
+      return encodeS(0b010, 2, rs2,
+                     int32_t(bits(n, 12, 9) << 2 | bits(n, 8, 7) << 6));
+    case 0b111: // c.sdsp
+      return encodeS(0b011, 2, rs2,
+                     int32_t(bits(n, 12, 10) << 3 | bits(n, 9, 7) << 6));
+    }
+    return 0;
+  }
+  return 0;
+}
+
+namespace detail {
+
+using CompressedTable = std::array<DecodedInstr, 1 << 16>;
+
+// Every 16-bit pattern, decoded. Building it at compile time would exceed
+// the usual constexpr step limits, so it is built on first use instead.
+[[nodiscard]] inline const CompressedTable &compressedTable() {
+  static const CompressedTable table = [] {
+    CompressedTable t{};
+    for (uint32_t c = 0; c < t.size(); c++) {
+      if ((c & 0b11) != 0b11) {
+        t[c] = decode(expandCompressed(static_cast<uint16_t>(c)));
+      }
+      t[c].length = 2;
+    }
+    return t;
+  }();
+  return table;
+}
+
+} // namespace detail
+
+// Decodes a compressed instruction with a single table lookup. The result
+// has length 2 and is otherwise that of decoding its 32-bit expansion.
+[[nodiscard]] inline DecodedInstr decodeCompressed(uint16_t c) {
+  return detail::compressedTable()[c];
+}
+
+// Size in bytes of the instruction whose lowest halfword is `lo`. Encodings
+// longer than 32 bits are not supported and count as 32-bit.
+[[nodiscard]] constexpr unsigned instrLength(uint16_t lo) {
+  return (lo & 0b11) == 0b11 ? 4 : 2;
+}
+
+// The raw bits of the instruction at the start of `bytes`: a halfword for a
+// compressed instruction, a word otherwise, or 0 if `bytes` is too short.
+[[nodiscard]] inline uint32_t rawInstr(std::span<const uint8_t> bytes) {
+  if (bytes.size() < 2) {
+    return 0;
+  }
+  uint32_t lo = bytes[0] | uint32_t(bytes[1]) << 8;
+  if (instrLength(static_cast<uint16_t>(lo)) == 2) {
+    return lo;
+  }
+  if (bytes.size() < 4) {
+    return 0;
+  }
+  return lo | uint32_t(bytes[2]) << 16 | uint32_t(bytes[3]) << 24;
+}
+
+// Decodes the (16- or 32-bit) instruction at the start of a little-endian
+// instruction stream. An instruction cut off by the end of `bytes` decodes
+// as invalid, with a length covering what is left (at most 4).
+[[nodiscard]] inline DecodedInstr decodeAt(std::span<const uint8_t> bytes) {
+  if (bytes.size() >= 2) {
+    uint16_t lo = static_cast<uint16_t>(bytes[0] | bytes[1] << 8);
+    if (instrLength(lo) == 2) {
+      return decodeCompressed(lo);
+    }
+    if (bytes.size() >= 4) {
+      return decode(rawInstr(bytes));
+    }
+  }
+  DecodedInstr d;
+  d.length = static_cast<uint8_t>(std::min<size_t>(bytes.size(), 4));
+  return d;
+}
+
+} // namespace riscy::risc
@@ -0,0 +1,225 @@
+#include "decode_block.h"
+
+// SSE2 is part of the x86-64 baseline; AVX2 is detected at runtime.
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define RISCY_X86 1
+#endif
+
+namespace riscy::risc {
+
+namespace {
+
+constexpr size_t kLanes = 8;
+
+enum ImmSlot { kImmI, kImmS, kImmB, kImmU, kImmJ, kImmSlots };
+
+// Raw fields of kLanes consecutive words, before the decode table decides
+// which of them the instruction actually has.
+struct Lanes {
+  alignas(32) uint32_t key[kLanes];
+  alignas(32) uint32_t rd[kLanes];
+  alignas(32) uint32_t rs1[kLanes];
+  alignas(32) uint32_t rs2[kLanes];
+  alignas(32) int32_t imm[kImmSlots][kLanes];
+};
+
+// Which register fields and immediate each format uses.
+struct FormatInfo {
+  bool rd, rs1, rs2;
+  int immSlot; // -1 if no immediate
+};
+
+constexpr FormatInfo kFormatInfo[] = {
+    /* Invalid */ {false, false, false, -1},
+    /* R */ {true, true, true, -1},
+    /* I */ {true, true, false, kImmI},
+    /* S */ {false, true, true, kImmS},
+    /* B */ {false, true, true, kImmB},
+    /* U */ {true, false, false, kImmU},
+    /* J */ {true, false, false, kImmJ},
+};
+
+void extractScalar(const uint32_t *w, Lanes &l, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint32_t v = w[i];
+    int32_t s = static_cast<int32_t>(v);
+    l.key[i] = (((v >> 2) & 0b11111) << 3) | ((v >> 12) & 0b111);
+    l.rd[i] = (v >> 7) & 0b11111;
+    l.rs1[i] = (v >> 15) & 0b11111;
+    l.rs2[i] = (v >> 20) & 0b11111;
+    l.imm[kImmI][i] = s >> 20;
+    l.imm[kImmS][i] = ((s >> 25) << 5) | ((v >> 7) & 0b11111);
+    l.imm[kImmB][i] = ((s >> 31) << 12) | ((v << 4) & 0x800) |
+                      ((v >> 20) & 0x7E0) | ((v >> 7) & 0x1E);
+    l.imm[kImmU][i] = static_cast<int32_t>(v & 0xFFFFF000);
+    l.imm[kImmJ][i] = ((s >> 31) << 20) | (v & 0xFF000) | ((v >> 9) & 0x800) |
+                      ((v >> 20) & 0x7FE);
+  }
+}
+
+#ifdef RISCY_X86
+
+// Same computation as extractScalar(), four lanes per vector.
+void extractSSE2(const uint32_t *w, Lanes &l) {
+  const __m128i m5 = _mm_set1_epi32(0b11111);
+  for (size_t half = 0; half < kLanes; half += 4) {
+    __m128i n = _mm_loadu_si128(reinterpret_cast<const __m128i *>(w + half));
+    __m128i key =
+        _mm_or_si128(_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(n, 2), m5), 3),
+                     _mm_and_si128(_mm_srli_epi32(n, 12), _mm_set1_epi32(7)));
+    __m128i rd = _mm_and_si128(_mm_srli_epi32(n, 7), m5);
+    __m128i rs1 = _mm_and_si128(_mm_srli_epi32(n, 15), m5);
+    __m128i rs2 = _mm_and_si128(_mm_srli_epi32(n, 20), m5);
+    __m128i immI = _mm_srai_epi32(n, 20);
+    __m128i immS = _mm_or_si128(_mm_slli_epi32(_mm_srai_epi32(n, 25), 5), rd);
+    __m128i immB = _mm_or_si128(
+        _mm_or_si128(
+            _mm_slli_epi32(_mm_srai_epi32(n, 31), 12),
+            _mm_and_si128(_mm_slli_epi32(n, 4), _mm_set1_epi32(0x800))),
+        _mm_or_si128(
+            _mm_and_si128(_mm_srli_epi32(n, 20), _mm_set1_epi32(0x7E0)),
+            _mm_and_si128(_mm_srli_epi32(n, 7), _mm_set1_epi32(0x1E))));
+    __m128i immU = _mm_and_si128(n, _mm_set1_epi32(0xFFFFF000));
+    __m128i immJ = _mm_or_si128(
+        _mm_or_si128(_mm_slli_epi32(_mm_srai_epi32(n, 31), 20),
+                     _mm_and_si128(n, _mm_set1_epi32(0xFF000))),
+        _mm_or_si128(
+            _mm_and_si128(_mm_srli_epi32(n, 9), _mm_set1_epi32(0x800)),
+            _mm_and_si128(_mm_srli_epi32(n, 20), _mm_set1_epi32(0x7FE))));
+
+    auto store = [half](auto *dst, __m128i v) {
+      _mm_store_si128(reinterpret_cast<__m128i *>(dst + half), v);
+    };
+    store(l.key, key);
+    store(l.rd, rd);
+    store(l.rs1, rs1);
+    store(l.rs2, rs2);
+    store(l.imm[kImmI], immI);
+    store(l.imm[kImmS], immS);
+    store(l.imm[kImmB], immB);
+    store(l.imm[kImmU], immU);
+    store(l.imm[kImmJ], immJ);
+  }
+}
+
+// Same computation as extractScalar(), eight lanes per vector. Compiled for
+// AVX2 regardless of the global flags and only called after a CPUID check.
+__attribute__((target("avx2"))) void extractAVX2(const uint32_t *w, Lanes &l) {
+  const __m256i m5 = _mm256_set1_epi32(0b11111);
+  __m256i n = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(w));
+  __m256i key = _mm256_or_si256(
+      _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(n, 2), m5), 3),
+      _mm256_and_si256(_mm256_srli_epi32(n, 12), _mm256_set1_epi32(7)));
+  __m256i rd = _mm256_and_si256(_mm256_srli_epi32(n, 7), m5);
+  __m256i rs1 = _mm256_and_si256(_mm256_srli_epi32(n, 15), m5);
+  __m256i rs2 = _mm256_and_si256(_mm256_srli_epi32(n, 20), m5);
+  __m256i immI = _mm256_srai_epi32(n, 20);
+  __m256i immS =
+      _mm256_or_si256(_mm256_slli_epi32(_mm256_srai_epi32(n, 25), 5), rd);
+  __m256i immB = _mm256_or_si256(
+      _mm256_or_si256(
+          _mm256_slli_epi32(_mm256_srai_epi32(n, 31), 12),
+          _mm256_and_si256(_mm256_slli_epi32(n, 4), _mm256_set1_epi32(0x800))),
+      _mm256_or_si256(
+          _mm256_and_si256(_mm256_srli_epi32(n, 20), _mm256_set1_epi32(0x7E0)),
+          _mm256_and_si256(_mm256_srli_epi32(n, 7), _mm256_set1_epi32(0x1E))));
+  __m256i immU = _mm256_and_si256(n, _mm256_set1_epi32(0xFFFFF000));
+  __m256i immJ = _mm256_or_si256(
+      _mm256_or_si256(_mm256_slli_epi32(_mm256_srai_epi32(n, 31), 20),
+                      _mm256_and_si256(n, _mm256_set1_epi32(0xFF000))),
+      _mm256_or_si256(
+          _mm256_and_si256(_mm256_srli_epi32(n, 9), _mm256_set1_epi32(0x800)),
+          _mm256_and_si256(_mm256_srli_epi32(n, 20),
+                           _mm256_set1_epi32(0x7FE))));
+
+  // No helper lambda here: it would not inherit the avx2 target.
+  _mm256_store_si256(reinterpret_cast<__m256i *>(l.key), key);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(l.rd), rd);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(l.rs1), rs1);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(l.rs2), rs2);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(l.imm[kImmI]), immI);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(l.imm[kImmS]), immS);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(l.imm[kImmB]), immB);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(l.imm[kImmU]), immU);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(l.imm[kImmJ]), immJ);
+}
+
+#endif // RISCY_X86
+
+// Resolves the extracted fields of `n` lanes through the decode table and
+// writes them to the output columns starting at `base`.
+void resolve(const uint32_t *w, const Lanes &l, size_t n, DecodedBlock &out,
+             size_t base) {
+  for (size_t i = 0; i < n; i++) {
+    const detail::DecodeEntry &e = detail::kDecodeTable[l.key[i]];
+    Op op = (w[i] & 0b11) == 0b11 ? detail::selectOp(e, w[i]) : Op::INVALID;
+    Format format = op == Op::INVALID ? Format::Invalid : e.format;
+    const FormatInfo &info = kFormatInfo[static_cast<size_t>(format)];
+
+    int32_t imm = info.immSlot < 0 ? 0 : l.imm[info.immSlot][i];
+    if (e.select == detail::Select::Shift6) {
+      imm &= 0b111111;
+    } else if (e.select == detail::Select::Shift5) {
+      imm &= 0b11111;
+    } else if (e.select == detail::Select::Amo && op != Op::INVALID) {
+      // R format has no immediate; atomics keep aq/rl there.
+      imm = (w[i] >> 25) & 0b11;
+    }
+    bool fence = op == Op::FENCE || op == Op::FENCE_I;
+
+    size_t j = base + i;
+    out.op[j] = op;
+    out.format[j] = format;
+    out.rd[j] = info.rd && !fence ? l.rd[i] : 0;
+    out.rs1[j] = info.rs1 && !fence ? l.rs1[i] : 0;
+    out.rs2[j] = info.rs2 ? l.rs2[i] : 0;
+    out.imm[j] = imm;
+  }
+}
+
+} // namespace
+
+DecodeKernel bestDecodeKernel() {
+#ifdef RISCY_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return DecodeKernel::AVX2;
+  }
+  return DecodeKernel::SSE2;
+#else
+  return DecodeKernel::Scalar;
+#endif
+}
+
+void decode_range(std::span<const uint32_t> words, DecodedBlock &out,
+                  DecodeKernel kernel) {
+  out.resize(words.size());
+
+  Lanes lanes;
+  size_t i = 0;
+  for (; i + kLanes <= words.size(); i += kLanes) {
+    const uint32_t *w = words.data() + i;
+    switch (kernel) {
+#ifdef RISCY_X86
+    case DecodeKernel::AVX2:
+      extractAVX2(w, lanes);
+      break;
+    case DecodeKernel::SSE2:
+      extractSSE2(w, lanes);
+      break;
+#endif
+    default:
+      extractScalar(w, lanes, kLanes);
+      break;
+    }
+    resolve(w, lanes, kLanes, out, i);
+  }
+
+  size_t rest = words.size() - i;
+  if (rest) {
+    extractScalar(words.data() + i, lanes, rest);
+    resolve(words.data() + i, lanes, rest, out, i);
+  }
+}
+
+} // namespace riscy::risc
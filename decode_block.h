@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "decode.h"
+
+namespace riscy::risc {
+
+// Struct-of-arrays form of a run of decoded instructions: entry i of every
+// column describes words[i] of the decoded range.
+struct DecodedBlock {
+  std::vector<Op> op;
+  std::vector<Format> format;
+  std::vector<uint8_t> rd;
+  std::vector<uint8_t> rs1;
+  std::vector<uint8_t> rs2;
+  std::vector<int32_t> imm;
+
+  inline void resize(size_t n) {
+    op.resize(n);
+    format.resize(n);
+    rd.resize(n);
+    rs1.resize(n);
+    rs2.resize(n);
+    imm.resize(n);
+  }
+
+  [[nodiscard]] inline size_t size() const { return op.size(); }
+
+  [[nodiscard]] inline DecodedInstr operator[](size_t i) const {
+    DecodedInstr d;
+    d.op = op[i];
+    d.format = format[i];
+    d.rd = rd[i];
+    d.rs1 = rs1[i];
+    d.rs2 = rs2[i];
+    d.imm = imm[i];
+    return d;
+  }
+};
+
+// Field-extraction kernel used by decode_range(). All kernels produce
+// identical results; they only differ in how many words they split into
+// fields at once.
+enum class DecodeKernel {
+  Scalar,
+  SSE2,
+  AVX2,
+};
+
+// The widest kernel supported by both this build and the host CPU.
+[[nodiscard]] DecodeKernel bestDecodeKernel();
+
+// Decodes `words` (host byte order) into `out`, reusing its storage.
+// decode_range(words)[i] == decode(words[i]) for every i.
+void decode_range(std::span<const uint32_t> words, DecodedBlock &out,
+                  DecodeKernel kernel = bestDecodeKernel());
+
+[[nodiscard]] inline DecodedBlock
+decode_range(std::span<const uint32_t> words) {
+  DecodedBlock block;
+  decode_range(words, block);
+  return block;
+}
+
+} // namespace riscy::risc
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "risc.h"
+
+namespace riscy::risc {
+
+// Memoizes decode_instr() by raw instruction word. Real code repeats a small
+// set of words (prologue stores, `addi sp`, `ret`) over and over, so most
+// lookups can hand back an already built Instr instead of allocating one.
+//
+// The table is open-addressed with linear probing over a fixed number of
+// slots, sized from a memory budget up front; a word whose probe sequence is
+// full replaces the entry in its home slot. The budget covers the slots,
+// not the decoded Instrs they share.
+class DecodeCache {
+public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Misses that replaced a cached word.
+    uint64_t evictions = 0;
+
+    [[nodiscard]] inline double hitRate() const {
+      uint64_t lookups = hits + misses;
+      return lookups ? double(hits) / double(lookups) : 0.0;
+    }
+  };
+
+private:
+  static constexpr size_t kMaxProbe = 8;
+
+  struct Slot {
+    std::shared_ptr<const Instr> instr;
+    uint32_t word = 0;
+    bool used = false;
+  };
+
+  std::vector<Slot> slots;
+  unsigned shift;
+  Stats _stats;
+
+  // Fibonacci hashing: the top bits of word * 2^32/phi.
+  [[nodiscard]] inline size_t home(uint32_t word) const {
+    return static_cast<uint32_t>(word * 0x9E3779B9u) >> shift;
+  }
+
+public:
+  explicit DecodeCache(size_t budgetBytes = 64 << 10) {
+    size_t n = std::bit_floor(std::max(budgetBytes / sizeof(Slot), kMaxProbe));
+    n = std::min<size_t>(n, size_t(1) << 31);
+    slots.resize(n);
+    shift = 32 - std::countr_zero(n);
+  }
+
+  // decode_instr(word), from the cache if possible. The result is shared
+  // with every other lookup of the same word, hence const.
+  [[nodiscard]] inline std::shared_ptr<const Instr> decode(uint32_t word) {
+    const size_t mask = slots.size() - 1;
+    const size_t start = home(word);
+    for (size_t i = 0; i < kMaxProbe; i++) {
+      Slot &s = slots[(start + i) & mask];
+      if (!s.used) {
+        _stats.misses++;
+        s = {decode_instr(word), word, true};
+        return s.instr;
+      }
+      if (s.word == word) {
+        _stats.hits++;
+        return s.instr;
+      }
+    }
+    _stats.misses++;
+    _stats.evictions++;
+    Slot &s = slots[start];
+    s = {decode_instr(word), word, true};
+    return s.instr;
+  }
+
+  [[nodiscard]] inline const Stats &stats() const { return _stats; }
+  inline void resetStats() { _stats = {}; }
+
+  [[nodiscard]] inline size_t capacity() const { return slots.size(); }
+
+  // Drops every cached word (the counters are kept).
+  inline void clear() {
+    for (Slot &s : slots) {
+      s = {};
+    }
+  }
+};
+
+} // namespace riscy::risc
@@ -0,0 +1,509 @@
+#include "disasm.h"
+
+#include <algorithm>
+#include <format>
+#include <iterator>
+#include <vector>
+
+#include "elf.h"
+#include "parallel.h"
+
+namespace riscy::disasm {
+
+using risc::Format;
+using risc::Op;
+
+namespace {
+
+constexpr std::string_view kRegNames[32] = {
+    "zero", "ra", "sp", "gp", "tp",  "t0",  "t1", "t2", "s0", "s1", "a0",
+    "a1",   "a2", "a3", "a4", "a5",  "a6",  "a7", "s2", "s3", "s4", "s5",
+    "s6",   "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6",
+};
+
+// Column the pseudo-C of Style::PseudoC starts at, counted from the
+// mnemonic.
+constexpr size_t kPseudoColumn = 28;
+
+// Tasks formatted between two writes to the output, per thread.
+constexpr size_t kBatchPerThread = 64;
+
+void appendJSONString(std::string &out, std::string_view s) {
+  out += '"';
+  for (char c : s) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        output::append(out, "\\u{:04x}",
+                       static_cast<unsigned>(static_cast<unsigned char>(c)));
+      } else {
+        out += c;
+      }
+    }
+  }
+  out += '"';
+}
+
+// A contiguous run of instructions to disassemble as one task.
+struct Task {
+  // The run's bytes, within the section holding them.
+  std::span<const uint8_t> code;
+  uint64_t addr;
+  std::string_view name;
+  // Set on a function's first task, which prints its header.
+  bool first;
+};
+
+// Splits [addr, addr + size) into tasks of at most `chunk` instructions.
+// Ranges not fully backed by one section are skipped.
+void addTasks(const elf::ELF &elf, std::string_view name, uint64_t addr,
+              uint64_t size, size_t chunk, std::vector<Task> &tasks) {
+  auto section = elf.getSectionContaining(addr);
+  if (!section || addr - section->virtAddr + size > section->buffer.size()) {
+    return;
+  }
+  auto code = section->buffer.span().subspan(addr - section->virtAddr, size);
+  // Instructions are 2 or 4 bytes long, so finding where the chunks start
+  // only takes looking at the low bits of each one.
+  size_t begin = 0, count = 0;
+  for (size_t off = 0; off < code.size();
+       off += risc::instrLength(code[off])) {
+    if (count++ == chunk) {
+      tasks.push_back({code.subspan(begin, off - begin), addr + begin, name,
+                       begin == 0});
+      begin = off;
+      count = 1;
+    }
+  }
+  tasks.push_back({code.subspan(begin), addr + begin, name, begin == 0});
+}
+
+void run(const Task &task, Style style, std::string &out) {
+  if (task.first) {
+    appendHeader(out, style, task.name, task.addr);
+  }
+  for (size_t off = 0; off < task.code.size();
+       off += risc::instrLength(task.code[off])) {
+    appendLine(out, style, task.name, task.addr + off,
+               risc::rawInstr(task.code.subspan(off)));
+  }
+}
+
+} // namespace
+
+std::string_view regName(uint8_t r) { return kRegNames[r & 31]; }
+
+void appendInstr(std::string &out, const risc::DecodedInstr &d, uint64_t pc) {
+  auto name = risc::mnemonic(d.op);
+  auto rd = regName(d.rd), rs1 = regName(d.rs1), rs2 = regName(d.rs2);
+
+  switch (d.format) {
+  case Format::R:
+    if (risc::isAtomic(d.op)) {
+      constexpr std::string_view kOrdering[] = {"", ".rl", ".aq", ".aqrl"};
+      std::string_view ordering = kOrdering[d.imm & 3];
+      if (d.op == Op::LR_W || d.op == Op::LR_D) {
+        output::append(out, "{}{}\t{},({})", name, ordering, rd, rs1);
+      } else {
+        output::append(out, "{}{}\t{},{},({})", name, ordering, rd, rs2, rs1);
+      }
+      return;
+    }
+    output::append(out, "{}\t{},{},{}", name, rd, rs1, rs2);
+    return;
+  case Format::I:
+    switch (d.op) {
+    case Op::LB:
+    case Op::LH:
+    case Op::LW:
+    case Op::LD:
+    case Op::LBU:
+    case Op::LHU:
+    case Op::LWU:
+    case Op::JALR:
+      output::append(out, "{}\t{},{}({})", name, rd, d.imm, rs1);
+      return;
+    case Op::FENCE:
+      if (((d.imm >> 8) & 0xF) == 0b1000) {
+        out += "fence.tso";
+        return;
+      }
+      out += name;
+      // As in objdump, complete sets are left out.
+      if ((d.imm & 0xFF) != 0xFF) {
+        auto set = [](int bits) {
+          std::string s;
+          for (int i = 0; i < 4; i++) {
+            if (bits & (8 >> i)) {
+              s += "iorw"[i];
+            }
+          }
+          return s;
+        };
+        output::append(out, "\t{},{}", set(d.imm >> 4), set(d.imm));
+      }
+      return;
+    case Op::FENCE_I:
+    case Op::ECALL:
+    case Op::EBREAK:
+      out += name;
+      return;
+    default:
+      output::append(out, "{}\t{},{},{}", name, rd, rs1, d.imm);
+      return;
+    }
+  case Format::S:
+    output::append(out, "{}\t{},{}({})", name, rs2, d.imm, rs1);
+    return;
+  case Format::B:
+    output::append(out, "{}\t{},{},{:x}", name, rs1, rs2,
+                   pc + static_cast<int64_t>(d.imm));
+    return;
+  case Format::U:
+    output::append(out, "{}\t{},{:#x}", name, rd,
+                   static_cast<uint32_t>(d.imm) >> 12);
+    return;
+  case Format::J:
+    output::append(out, "{}\t{},{:x}", name, rd,
+                   pc + static_cast<int64_t>(d.imm));
+    return;
+  case Format::Invalid:
+    break;
+  }
+  out += name;
+}
+
+void appendPseudoC(std::string &out, const risc::DecodedInstr &d,
+                   uint64_t pc) {
+  unsigned rd = d.rd, a = d.rs1, b = d.rs2;
+  int32_t imm = d.imm;
+  uint64_t target = pc + static_cast<int64_t>(imm);
+
+  // x[rd] = x[a] op x[b], with both operands cast to `cast`.
+  auto reg = [&](std::string_view op, std::string_view cast = "") {
+    output::append(out, "x{} = {}x{} {} {}x{}", rd, cast, a, op, cast, b);
+  };
+  // The same, truncated to 32 bits and sign-extended.
+  auto regW = [&](std::string_view op, std::string_view cast = "") {
+    output::append(out, "x{} = (int32_t)({}x{} {} {}x{})", rd, cast, a, op,
+                   cast, b);
+  };
+  auto immediate = [&](std::string_view op, std::string_view cast = "") {
+    output::append(out, "x{} = {}x{} {} {}", rd, cast, a, op, imm);
+  };
+  auto load = [&](std::string_view type) {
+    output::append(out, "x{} = *({} *)(x{} + {})", rd, type, a, imm);
+  };
+  auto store = [&](std::string_view type) {
+    output::append(out, "*({} *)(x{} + {}) = x{}", type, a, imm, b);
+  };
+  auto branch = [&](std::string_view op, std::string_view cast = "") {
+    output::append(out, "if ({}x{} {} {}x{}) goto {:#x}", cast, a, op, cast, b,
+                   target);
+  };
+
+  switch (d.op) {
+  case Op::LUI:
+    output::append(out, "x{} = {:#x}", rd, static_cast<int64_t>(imm));
+    return;
+  case Op::AUIPC:
+    output::append(out, "x{} = {:#x}", rd, target);
+    return;
+  case Op::JAL:
+    if (rd != 0) {
+      output::append(out, "x{} = {:#x}; ", rd, pc + d.length);
+    }
+    output::append(out, "goto {:#x}", target);
+    return;
+  case Op::JALR:
+    if (rd == 0 && a == 1 && imm == 0) {
+      out += "return";
+      return;
+    }
+    if (rd != 0) {
+      output::append(out, "x{} = {:#x}; ", rd, pc + d.length);
+    }
+    output::append(out, "goto x{} + {}", a, imm);
+    return;
+  case Op::BEQ:
+    return branch("==");
+  case Op::BNE:
+    return branch("!=");
+  case Op::BLT:
+    return branch("<", "(int64_t)");
+  case Op::BGE:
+    return branch(">=", "(int64_t)");
+  case Op::BLTU:
+    return branch("<");
+  case Op::BGEU:
+    return branch(">=");
+  case Op::LB:
+    return load("int8_t");
+  case Op::LH:
+    return load("int16_t");
+  case Op::LW:
+    return load("int32_t");
+  case Op::LD:
+    return load("int64_t");
+  case Op::LBU:
+    return load("uint8_t");
+  case Op::LHU:
+    return load("uint16_t");
+  case Op::LWU:
+    return load("uint32_t");
+  case Op::SB:
+    return store("uint8_t");
+  case Op::SH:
+    return store("uint16_t");
+  case Op::SW:
+    return store("uint32_t");
+  case Op::SD:
+    return store("uint64_t");
+  case Op::ADDI:
+    return immediate("+");
+  case Op::SLTI:
+    return immediate("<", "(int64_t)");
+  case Op::SLTIU:
+    output::append(out, "x{} = x{} < (uint64_t){}", rd, a, imm);
+    return;
+  case Op::XORI:
+    return immediate("^");
+  case Op::ORI:
+    return immediate("|");
+  case Op::ANDI:
+    return immediate("&");
+  case Op::SLLI:
+    return immediate("<<");
+  case Op::SRLI:
+    return immediate(">>");
+  case Op::SRAI:
+    return immediate(">>", "(int64_t)");
+  case Op::ADD:
+    return reg("+");
+  case Op::SUB:
+    return reg("-");
+  case Op::SLL:
+    output::append(out, "x{} = x{} << (x{} & 63)", rd, a, b);
+    return;
+  case Op::SLT:
+    return reg("<", "(int64_t)");
+  case Op::SLTU:
+    return reg("<");
+  case Op::XOR:
+    return reg("^");
+  case Op::SRL:
+    output::append(out, "x{} = x{} >> (x{} & 63)", rd, a, b);
+    return;
+  case Op::SRA:
+    output::append(out, "x{} = (int64_t)x{} >> (x{} & 63)", rd, a, b);
+    return;
+  case Op::OR:
+    return reg("|");
+  case Op::AND:
+    return reg("&");
+  case Op::ADDIW:
+    output::append(out, "x{} = (int32_t)(x{} + {})", rd, a, imm);
+    return;
+  case Op::SLLIW:
+    output::append(out, "x{} = (int32_t)(x{} << {})", rd, a, imm);
+    return;
+  case Op::SRLIW:
+    output::append(out, "x{} = (int32_t)((uint32_t)x{} >> {})", rd, a, imm);
+    return;
+  case Op::SRAIW:
+    output::append(out, "x{} = (int32_t)x{} >> {}", rd, a, imm);
+    return;
+  case Op::ADDW:
+    return regW("+");
+  case Op::SUBW:
+    return regW("-");
+  case Op::SLLW:
+    output::append(out, "x{} = (int32_t)(x{} << (x{} & 31))", rd, a, b);
+    return;
+  case Op::SRLW:
+    output::append(out, "x{} = (int32_t)((uint32_t)x{} >> (x{} & 31))", rd, a,
+                   b);
+    return;
+  case Op::SRAW:
+    output::append(out, "x{} = (int32_t)x{} >> (x{} & 31)", rd, a, b);
+    return;
+  case Op::MUL:
+    return reg("*");
+  case Op::MULH:
+  case Op::MULHSU:
+  case Op::MULHU:
+    output::append(out, "x{} = {}(x{}, x{})", rd, risc::mnemonic(d.op), a, b);
+    return;
+  case Op::DIV:
+    return reg("/", "(int64_t)");
+  case Op::DIVU:
+    return reg("/");
+  case Op::REM:
+    return reg("%", "(int64_t)");
+  case Op::REMU:
+    return reg("%");
+  case Op::MULW:
+    return regW("*");
+  case Op::DIVW:
+    return regW("/", "(int32_t)");
+  case Op::DIVUW:
+    return regW("/", "(uint32_t)");
+  case Op::REMW:
+    return regW("%", "(int32_t)");
+  case Op::REMUW:
+    return regW("%", "(uint32_t)");
+  case Op::LR_W:
+    output::append(out, "x{} = {}((int32_t *)x{})", rd, risc::mnemonic(d.op),
+                   a);
+    return;
+  case Op::LR_D:
+    output::append(out, "x{} = {}((int64_t *)x{})", rd, risc::mnemonic(d.op),
+                   a);
+    return;
+  case Op::INVALID:
+    out += "???";
+    return;
+  default:
+    if (risc::isAtomic(d.op)) {
+      output::append(out, "x{} = {}(({} *)x{}, x{})", rd, risc::mnemonic(d.op),
+                     risc::atomicSize(d.op) == 8 ? "int64_t" : "int32_t", a,
+                     b);
+      return;
+    }
+    output::append(out, "{}()", risc::mnemonic(d.op));
+    return;
+  }
+}
+
+void appendHeader(std::string &out, Style style, std::string_view name,
+                  uint64_t addr) {
+  switch (style) {
+  case Style::Objdump:
+  case Style::PseudoC:
+    output::append(out, "\n{:016x} <{}>:\n", addr, name);
+    break;
+  case Style::JSONLines:
+    break;
+  }
+}
+
+void appendLine(std::string &out, Style style, std::string_view name,
+                uint64_t pc, uint32_t word) {
+  bool compressed = risc::instrLength(static_cast<uint16_t>(word)) == 2;
+  auto d = compressed ? risc::decodeCompressed(static_cast<uint16_t>(word))
+                      : risc::decode(word);
+  switch (style) {
+  case Style::Objdump:
+    if (compressed) {
+      output::append(out, "{:8x}:\t{:04x}              \t", pc, word);
+    } else {
+      output::append(out, "{:8x}:\t{:08x}          \t", pc, word);
+    }
+    appendInstr(out, d, pc);
+    break;
+  case Style::PseudoC: {
+    if (compressed) {
+      output::append(out, "{:8x}:\t{:04x}    \t", pc, word);
+    } else {
+      output::append(out, "{:8x}:\t{:08x}\t", pc, word);
+    }
+    size_t start = out.size();
+    appendInstr(out, d, pc);
+    // A space rather than a tab after the mnemonic, so the padding below
+    // lines the pseudo-C up.
+    std::replace(out.begin() + start, out.end(), '\t', ' ');
+    size_t width = out.size() - start;
+    out.append(width < kPseudoColumn ? kPseudoColumn - width : 1, ' ');
+    appendPseudoC(out, d, pc);
+    break;
+  }
+  case Style::JSONLines: {
+    out += "{\"function\":";
+    appendJSONString(out, name);
+    output::append(out, ",\"addr\":{},\"word\":{},\"op\":\"{}\",\"asm\":\"",
+                   pc, word, risc::mnemonic(d.op));
+    // Assembly and pseudo-C are plain ASCII apart from the tab after the
+    // mnemonic, so they can be formatted in place and patched up.
+    size_t start = out.size();
+    appendInstr(out, d, pc);
+    if (size_t tab = out.find('\t', start); tab != std::string::npos) {
+      out.replace(tab, 1, "\\t");
+    }
+    out += "\",\"c\":\"";
+    appendPseudoC(out, d, pc);
+    out += '"';
+    out += '}';
+    break;
+  }
+  }
+  out += '\n';
+}
+
+void disassembleFunction(output::Writer &out, Style style,
+                         std::string_view name, uint64_t addr,
+                         std::span<const uint8_t> code) {
+  appendHeader(out.buffer(), style, name, addr);
+  for (size_t off = 0; off < code.size();
+       off += risc::instrLength(code[off])) {
+    appendLine(out.buffer(), style, name, addr + off,
+               risc::rawInstr(code.subspan(off)));
+    out.done();
+  }
+}
+
+void disassemble(const elf::ELF &elf, output::Writer &out,
+                 const Options &options) {
+  size_t chunk = options.chunkInstrs ? options.chunkInstrs : 1;
+  unsigned threads =
+      options.threads ? options.threads : parallel::defaultThreads();
+
+  // Everything the workers touch is resolved up front; they only read
+  // section bytes through cursor-free accessors.
+  std::vector<Task> tasks;
+  auto functions = elf.symbols().functions();
+  for (const auto *sym : functions) {
+    addTasks(elf, sym->name, sym->value, sym->size, chunk, tasks);
+  }
+  if (functions.empty()) {
+    const auto &sections = elf.sectionHeaders();
+    for (size_t i = 0; i < sections.size(); i++) {
+      const auto &section = sections[i];
+      if ((section->flags & elf::SectionHeaderEntry::SHF_EXECINSTR) &&
+          section->type !=
+              elf::SectionHeaderEntry::Type::ProgramSpaceNoData) {
+        addTasks(elf, elf.sectionName(i), section->virtAddr, section->size,
+                 chunk, tasks);
+      }
+    }
+    std::stable_sort(
+        tasks.begin(), tasks.end(),
+        [](const Task &a, const Task &b) { return a.addr < b.addr; });
+  }
+
+  // Tasks are in address order, so writing each batch's output in index
+  // order gives the same listing however they were scheduled. The strings
+  // keep their capacity from batch to batch.
+  size_t batch = size_t(threads) * kBatchPerThread;
+  std::vector<std::string> outputs(std::min(batch, tasks.size()));
+  for (size_t begin = 0; begin < tasks.size(); begin += batch) {
+    size_t n = std::min(batch, tasks.size() - begin);
+    parallel::forEach(n, threads, [&](size_t i) {
+      outputs[i].clear();
+      run(tasks[begin + i], options.style, outputs[i]);
+    });
+    for (size_t i = 0; i < n; i++) {
+      out.write(outputs[i]);
+    }
+  }
+}
+
+} // namespace riscy::disasm
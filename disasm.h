@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "decode.h"
+#include "output.h"
+
+namespace riscy::elf {
+struct ELF;
+}
+
+namespace riscy::disasm {
+
+enum class Style : uint8_t {
+  // objdump -d: a header per function, then address, raw word, mnemonic and
+  // operands per instruction.
+  Objdump,
+  // One JSON object per instruction, with its function, address, raw word,
+  // mnemonic, assembly and pseudo-C.
+  JSONLines,
+  // Address, raw word and assembly, followed by a pseudo-C rendering.
+  PseudoC,
+};
+
+// ABI name of integer register `r`.
+[[nodiscard]] std::string_view regName(uint8_t r);
+
+// Appends `d`, located at `pc`, the way objdump prints it: mnemonic, a tab,
+// then operands with ABI register names and absolute branch/jump targets.
+void appendInstr(std::string &out, const risc::DecodedInstr &d, uint64_t pc);
+
+// Appends a C-like statement with the effect of `d` on registers x0-x31.
+void appendPseudoC(std::string &out, const risc::DecodedInstr &d,
+                   uint64_t pc);
+
+[[nodiscard]] inline std::string formatInstr(const risc::DecodedInstr &d,
+                                             uint64_t pc) {
+  std::string s;
+  appendInstr(s, d, pc);
+  return s;
+}
+
+// Appends what `style` prints before the instructions of function `name`.
+void appendHeader(std::string &out, Style style, std::string_view name,
+                  uint64_t addr);
+
+// Appends one line for the instruction `word` at `pc`, in function `name`.
+// A compressed instruction is passed as its halfword.
+void appendLine(std::string &out, Style style, std::string_view name,
+                uint64_t pc, uint32_t word);
+
+// Writes the listing of one function whose code is already at hand.
+void disassembleFunction(output::Writer &out, Style style,
+                         std::string_view name, uint64_t addr,
+                         std::span<const uint8_t> code);
+
+struct Options {
+  Style style = Style::Objdump;
+  // Worker threads; 0 uses one per hardware thread.
+  unsigned threads = 0;
+  // Functions longer than this many instructions are split into several
+  // tasks so that one huge function doesn't serialize the whole run.
+  size_t chunkInstrs = 4096;
+};
+
+// Writes a listing of every function symbol of `elf` (or, if there are
+// none, every executable section) to `out`, in address order. Batches of
+// tasks are formatted across threads and written as they complete, so the
+// output does not depend on the thread count and is never held in full.
+void disassemble(const elf::ELF &elf, output::Writer &out,
+                 const Options &options = {});
+
+} // namespace riscy::disasm
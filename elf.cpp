@@ -1,17 +1,79 @@
 #include "elf.h"
 
+#include <cstring>
 #include <iostream>
 
 namespace riscy::elf {
 
-std::shared_ptr<ELFHeader> readELFHeader(buffer::Buffer &buf) {
-  uint32_t magic = buf.pop_u32();
-  assert(magic == 0x7F454c46);
+namespace {
+
+// On-disk ELF64 records, read with Buffer::read_struct().
+
+struct RawHeader { // Elf64_Ehdr
+  uint8_t ident[16];
+  uint16_t type;
+  uint16_t machine;
+  uint32_t version;
+  uint64_t entry;
+  uint64_t phoff;
+  uint64_t shoff;
+  uint32_t flags;
+  uint16_t ehsize;
+  uint16_t phentsize;
+  uint16_t phnum;
+  uint16_t shentsize;
+  uint16_t shnum;
+  uint16_t shstrndx;
+
+  void byteswap() {
+    buffer::byteswapFields(type, machine, version, entry, phoff, shoff, flags,
+                           ehsize, phentsize, phnum, shentsize, shnum,
+                           shstrndx);
+  }
+};
+static_assert(sizeof(RawHeader) == 64);
+
+struct RawProgramHeader { // Elf64_Phdr
+  uint32_t type;
+  uint32_t flags;
+  uint64_t offset;
+  uint64_t vaddr;
+  uint64_t paddr;
+  uint64_t filesz;
+  uint64_t memsz;
+  uint64_t align;
+
+  void byteswap() {
+    buffer::byteswapFields(type, flags, offset, vaddr, paddr, filesz, memsz,
+                           align);
+  }
+};
+static_assert(sizeof(RawProgramHeader) == 56);
+
+struct RawSectionHeader { // Elf64_Shdr
+  uint32_t name;
+  uint32_t type;
+  uint64_t flags;
+  uint64_t addr;
+  uint64_t offset;
+  uint64_t size;
+  uint32_t link;
+  uint32_t info;
+  uint64_t addralign;
+  uint64_t entsize;
+
+  void byteswap() {
+    buffer::byteswapFields(name, type, flags, addr, offset, size, link, info,
+                           addralign, entsize);
+  }
+};
+static_assert(sizeof(RawSectionHeader) == 64);
 
-  uint8_t cls = buf.pop_u8();
-  assert(cls == 2); // 64-bit only
+} // namespace
 
-  uint8_t endian = buf.pop_u8();
+std::shared_ptr<ELFHeader> readELFHeader(buffer::Buffer &buf) {
+  // EI_DATA decides how the rest of the header is read.
+  uint8_t endian = buf.read_u8(buf.index() + 5);
   if (endian == (uint8_t)ELFHeader::Endianness::kBig)
     buf.setEndianness(buffer::Endianness::Big);
   else if (endian == (uint8_t)ELFHeader::Endianness::kLittle)
@@ -19,95 +81,194 @@ std::shared_ptr<ELFHeader> readELFHeader(buffer::Buffer &buf) {
   else
     assert(false);
 
-  uint8_t version = buf.pop_u8();
-  assert(version == 1);
+  auto raw = buf.pop_struct<RawHeader>();
+  assert(std::memcmp(raw.ident, "\x7f" "ELF", 4) == 0);
+  assert(raw.ident[4] == 2); // 64-bit only
+  assert(raw.ident[6] == 1); // EI_VERSION
+  assert(raw.version == 1);
 
-  uint8_t abi = buf.pop_u8();
-  uint8_t abiVersion = buf.pop_u8();
+  return std::make_shared<ELFHeader>(
+      (ELFHeader::Endianness)endian, (ELFHeader::ABI)raw.ident[7],
+      raw.ident[8], (ELFHeader::FileType)raw.type, (ELFHeader::ISA)raw.machine,
+      raw.entry, raw.phoff, raw.shoff, raw.flags, raw.ehsize, raw.phentsize,
+      raw.phnum, raw.shentsize, raw.shnum, raw.shstrndx);
+}
 
-  buf.skip(7); // padding
+std::shared_ptr<ProgramHeaderEntry>
+readProgramHeaderEntry(buffer::Buffer &buf) {
+  auto raw = buf.pop_struct<RawProgramHeader>();
+  return std::make_shared<ProgramHeaderEntry>(
+      (ProgramHeaderEntry::SegmentType)raw.type, raw.flags, raw.offset,
+      raw.vaddr, raw.paddr, raw.filesz, raw.memsz, raw.align);
+}
 
-  uint16_t type = buf.pop_u16();
-  uint16_t machine = buf.pop_u16();
+std::shared_ptr<SectionHeaderEntry>
+readSectionHeaderEntry(buffer::Buffer &buf) {
+  auto raw = buf.pop_struct<RawSectionHeader>();
+  auto type = (SectionHeaderEntry::Type)raw.type;
 
-  uint8_t version2 = buf.pop_u32();
-  assert(version2 == 1);
+  // SHT_NOBITS sections (.bss) occupy no space in the file.
+  auto sectionBuf = type == SectionHeaderEntry::Type::ProgramSpaceNoData
+                        ? buf.slice(0, 0)
+                        : buf.slice(raw.offset, raw.offset + raw.size);
 
-  uint64_t entry = buf.pop_u64();
-  uint64_t phoff = buf.pop_u64();
-  uint64_t shoff = buf.pop_u64();
-  uint32_t flags = buf.pop_u32();
-  uint16_t ehsize = buf.pop_u16();
-  uint16_t phentsize = buf.pop_u16();
-  uint16_t phnum = buf.pop_u16();
-  uint16_t shentsize = buf.pop_u16();
-  uint16_t shnum = buf.pop_u16();
-  uint16_t shstrndx = buf.pop_u16();
+  return std::make_shared<SectionHeaderEntry>(
+      raw.name, type, raw.flags, raw.addr, raw.offset, raw.size, raw.link,
+      raw.info, raw.addralign, raw.entsize, sectionBuf);
+}
 
-  return std::make_shared<ELFHeader>(
-      (ELFHeader::Endianness)endian, (ELFHeader::ABI)abi, abiVersion,
-      (ELFHeader::FileType)type, (ELFHeader::ISA)machine, entry, phoff, shoff,
-      flags, ehsize, phentsize, phnum, shentsize, shnum, shstrndx);
+const std::vector<std::shared_ptr<ProgramHeaderEntry>> &
+ELF::programHeaders() const {
+  std::call_once(programHeadersOnce, [&] {
+    buffer::Buffer buf = file;
+    _programHeaders.reserve(header->phEntryCount);
+    for (size_t i = 0; i < header->phEntryCount; i++) {
+      buf.seek(header->phOffset + header->phEntrySize * i);
+      _programHeaders.push_back(readProgramHeaderEntry(buf));
+    }
+  });
+  return _programHeaders;
 }
 
-std::shared_ptr<ProgramHeaderEntry>
-readProgramHeaderEntry(buffer::Buffer &buf) {
-  uint32_t type = buf.pop_u32();
+const std::vector<std::shared_ptr<SectionHeaderEntry>> &
+ELF::sectionHeaders() const {
+  std::call_once(sectionHeadersOnce, [&] {
+    buffer::Buffer buf = file;
+    _sectionHeaders.reserve(header->sectionEntryCount);
+    for (size_t i = 0; i < header->sectionEntryCount; i++) {
+      buf.seek(header->shOffset + header->sectionEntrySize * i);
+      _sectionHeaders.push_back(readSectionHeaderEntry(buf));
+    }
+  });
+  return _sectionHeaders;
+}
 
-  uint32_t flags = buf.pop_u32();
+void ELF::indexSectionNames() const {
+  const auto &sections = sectionHeaders();
+  _sectionNames.assign(sections.size(), std::string_view());
 
-  uint64_t fileOffset = buf.pop_u64();
-  uint64_t virtAddr = buf.pop_u64();
-  uint64_t physAddr = buf.pop_u64();
-  uint64_t size = buf.pop_u64();
-  uint64_t sizeInMemory = buf.pop_u64();
-  uint64_t alignment = buf.pop_u64();
+  auto stringTable = getStringTable();
+  if (!stringTable) {
+    return;
+  }
 
-  return std::make_shared<ProgramHeaderEntry>(
-      (ProgramHeaderEntry::SegmentType)type, flags, fileOffset, virtAddr,
-      physAddr, size, sizeInMemory, alignment);
+  const auto &names = stringTable->buffer;
+  sectionIndexByName.reserve(sections.size());
+  for (size_t i = 0; i < sections.size(); i++) {
+    uint32_t offset = sections[i]->nameOffset;
+    if (offset >= names.size()) {
+      continue;
+    }
+    _sectionNames[i] = names.string_at(offset);
+    // Keep the first section of a given name, as a linear scan would.
+    sectionIndexByName.emplace(_sectionNames[i], i);
+  }
+}
+
+std::string_view ELF::sectionName(size_t i) const {
+  std::call_once(sectionNamesOnce, [this] { indexSectionNames(); });
+  return i < _sectionNames.size() ? _sectionNames[i] : std::string_view();
 }
 
 std::shared_ptr<SectionHeaderEntry>
-readSectionHeaderEntry(buffer::Buffer &buf) {
-  uint32_t nameOffset = buf.pop_u32();
-  uint32_t type = buf.pop_u32();
-  uint64_t flags = buf.pop_u64();
-  uint64_t virtAddr = buf.pop_u64();
-  uint64_t fileOffset = buf.pop_u64();
-  uint64_t size = buf.pop_u64();
-  uint32_t linkIndex = buf.pop_u32();
-  uint32_t info = buf.pop_u32();
-  uint64_t alignment = buf.pop_u64();
-  uint64_t entrySize = buf.pop_u64();
-
-  auto sectionBuf = buf.slice(fileOffset, fileOffset + size);
+ELF::getSectionByName(std::string_view str) const {
+  std::call_once(sectionNamesOnce, [this] { indexSectionNames(); });
+  auto it = sectionIndexByName.find(str);
+  if (it == sectionIndexByName.end()) {
+    return nullptr;
+  }
+  return _sectionHeaders[it->second];
+}
 
-  return std::make_shared<SectionHeaderEntry>(
-      nameOffset, (SectionHeaderEntry::Type)type, flags, virtAddr, fileOffset,
-      size, linkIndex, info, alignment, entrySize, sectionBuf);
+const SymbolIndex &ELF::symbols() const {
+  std::call_once(symbolsOnce,
+                 [this] { symbolIndex = std::make_unique<SymbolIndex>(*this); });
+  return *symbolIndex;
 }
 
-std::shared_ptr<ELF> readELF(buffer::Buffer &buf) {
-  auto header = readELFHeader(buf);
-  assert(header);
+const SymbolIndex &ELF::dynamicSymbols() const {
+  std::call_once(dynamicSymbolsOnce, [this] {
+    dynamicSymbolIndex =
+        std::make_unique<SymbolIndex>(*this, getSectionByName(".dynsym"));
+  });
+  return *dynamicSymbolIndex;
+}
+
+const std::vector<DynamicEntry> &ELF::dynamic() const {
+  std::call_once(dynamicOnce, [this] {
+    for (const auto &ph : programHeaders()) {
+      if (ph->type != ProgramHeaderEntry::SegmentType::Dynamic) {
+        continue;
+      }
+      if (ph->fileOffset + ph->size > file.size()) {
+        throw std::runtime_error("Dynamic segment out of bounds");
+      }
+      auto words = file.read_u64_array(ph->fileOffset, ph->size / 16 * 2);
+      for (size_t i = 0; i + 1 < words.size(); i += 2) {
+        if (words[i] == DynamicEntry::DT_NULL) {
+          break;
+        }
+        _dynamic.push_back({int64_t(words[i]), words[i + 1]});
+      }
+      break;
+    }
+  });
+  return _dynamic;
+}
 
-  std::vector<std::shared_ptr<ProgramHeaderEntry>> programHeaders;
-  std::vector<std::shared_ptr<SectionHeaderEntry>> sectionHeaders;
+std::optional<uint64_t> ELF::dynamicValue(int64_t tag) const {
+  for (const auto &entry : dynamic()) {
+    if (entry.tag == tag) {
+      return entry.value;
+    }
+  }
+  return std::nullopt;
+}
 
-  programHeaders.reserve(header->phEntryCount);
-  for (int i = 0; i < header->phEntryCount; i++) {
-    buf.seek(header->phOffset + header->phEntrySize * i);
-    programHeaders.push_back(readProgramHeaderEntry(buf));
+std::optional<uint64_t> ELF::fileOffsetOf(uint64_t addr, uint64_t size) const {
+  for (const auto &ph : programHeaders()) {
+    if (ph->type == ProgramHeaderEntry::SegmentType::Loadable &&
+        addr >= ph->virtAddr && addr - ph->virtAddr <= ph->size &&
+        size <= ph->size - (addr - ph->virtAddr)) {
+      return ph->fileOffset + (addr - ph->virtAddr);
+    }
   }
+  return std::nullopt;
+}
 
-  sectionHeaders.reserve(header->sectionEntryCount);
-  for (int i = 0; i < header->sectionEntryCount; i++) {
-    buf.seek(header->shOffset + header->sectionEntrySize * i);
-    sectionHeaders.push_back(readSectionHeaderEntry(buf));
+std::string_view ELF::dynamicString(uint64_t offset) const {
+  auto strtab = dynamicValue(DynamicEntry::DT_STRTAB);
+  auto strsz = dynamicValue(DynamicEntry::DT_STRSZ);
+  if (!strtab || !strsz || offset >= *strsz) {
+    return {};
   }
+  auto start = fileOffsetOf(*strtab, *strsz);
+  if (!start || *start + *strsz > file.size()) {
+    return {};
+  }
+  return file.slice(*start, *start + *strsz).string_at(offset);
+}
 
-  return std::make_shared<ELF>(header, programHeaders, sectionHeaders);
+std::vector<Relocation> ELF::relocations(uint64_t addr, uint64_t size) const {
+  auto start = fileOffsetOf(addr, size);
+  if (!start || *start + size > file.size()) {
+    throw std::runtime_error("Relocation table out of bounds");
+  }
+  // r_offset | r_info | r_addend
+  auto words = file.read_u64_array(*start, size / 24 * 3);
+  std::vector<Relocation> relocs(words.size() / 3);
+  for (size_t i = 0; i < relocs.size(); i++) {
+    uint64_t info = words[3 * i + 1];
+    relocs[i] = {words[3 * i], uint32_t(info), uint32_t(info >> 32),
+                 int64_t(words[3 * i + 2])};
+  }
+  return relocs;
+}
+
+std::shared_ptr<ELF> readELF(buffer::Buffer &buf) {
+  auto header = readELFHeader(buf);
+  assert(header);
+  return std::make_shared<ELF>(header, buf.slice(0, buf.size()));
 }
 
 } // namespace riscy::elf
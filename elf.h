@@ -2,10 +2,16 @@
 
 #include <cstdint>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include "buffer.h"
+#include "symbols.h"
 
 namespace riscy::elf {
 
@@ -239,6 +245,7 @@ struct SectionHeaderEntry {
     SectionGroup = 0x11,
     ExtendedSectionIndices = 0x12,
     NumDefinedTypes = 0x13,
+    GNUHashTable = 0x6FFFFFF6,
   };
   Type type;
 
@@ -284,48 +291,85 @@ struct SymbolLocation {
   uint64_t size;
 };
 
+// An entry of the PT_DYNAMIC array (Elf64_Dyn).
+struct DynamicEntry {
+  enum Tag : int64_t {
+    DT_NULL = 0,
+    DT_NEEDED = 1,
+    DT_PLTRELSZ = 2,
+    DT_PLTGOT = 3,
+    DT_HASH = 4,
+    DT_STRTAB = 5,
+    DT_SYMTAB = 6,
+    DT_RELA = 7,
+    DT_RELASZ = 8,
+    DT_RELAENT = 9,
+    DT_STRSZ = 10,
+    DT_SYMENT = 11,
+    DT_SONAME = 14,
+    DT_PLTREL = 20,
+    DT_JMPREL = 23,
+    DT_BIND_NOW = 24,
+    DT_FLAGS = 30,
+    DT_GNU_HASH = 0x6FFFFEF5,
+    DT_RELACOUNT = 0x6FFFFFF9,
+  };
+
+  int64_t tag;
+  uint64_t value;
+};
+
+// A relocation with addend (Elf64_Rela), with r_info split up.
+struct Relocation {
+  // Link-time address of the place to relocate.
+  uint64_t offset;
+  uint32_t type;
+  // Index into the dynamic symbol table, 0 for none.
+  uint32_t symbol;
+  int64_t addend;
+};
+
+// A view of an ELF file. readELF() only parses the file header; the header
+// tables, section names and symbol index are each decoded the first time
+// something asks for them, so looking up one symbol costs the same in a
+// small file and a huge one. Every accessor is const and safe to call from
+// several threads at once.
 struct ELF {
   std::shared_ptr<ELFHeader> header;
-  std::vector<std::shared_ptr<ProgramHeaderEntry>> programHeaders;
-  std::vector<std::shared_ptr<SectionHeaderEntry>> sectionHeaders;
-
-  ELF(std::shared_ptr<ELFHeader> header,
-      std::vector<std::shared_ptr<ProgramHeaderEntry>> &programHeaders,
-      std::vector<std::shared_ptr<SectionHeaderEntry>> &sectionHeaders)
-      : header(header), programHeaders(programHeaders),
-        sectionHeaders(sectionHeaders) {}
-
-  [[nodiscard]] inline std::shared_ptr<SectionHeaderEntry> getStringTable() {
-    std::shared_ptr<SectionHeaderEntry> stringTable = nullptr;
-    for (auto &section : sectionHeaders) {
-      if (section->type == SectionHeaderEntry::Type::StringTable &&
-          section->flags == 0) {
-        if (stringTable) {
-          throw std::runtime_error("Multiple string tables found");
-        }
-        stringTable = section;
-      }
-    }
-    return stringTable;
-  }
 
+  // The whole input file, for data not covered by any section (e.g. the
+  // file image of PT_LOAD segments).
+  buffer::Buffer file;
+
+  ELF(std::shared_ptr<ELFHeader> header, buffer::Buffer file)
+      : header(std::move(header)), file(std::move(file)) {}
+
+  [[nodiscard]] const std::vector<std::shared_ptr<ProgramHeaderEntry>> &
+  programHeaders() const;
+
+  [[nodiscard]] const std::vector<std::shared_ptr<SectionHeaderEntry>> &
+  sectionHeaders() const;
+
+  // Name of sectionHeaders()[i], from the section header string table
+  // (empty if it has none). The view outlives the ELF.
+  [[nodiscard]] std::string_view sectionName(size_t i) const;
+
+  // e_shstrndx
   [[nodiscard]] inline std::shared_ptr<SectionHeaderEntry>
-  getSectionByName(const std::string &str) {
-    auto stringTable = getStringTable();
-    assert(stringTable);
-
-    for (auto &section : sectionHeaders) {
-      stringTable->buffer.seek(section->nameOffset);
-      std::string name = stringTable->buffer.pop_null_string();
-      if (name == str) {
-        return section;
-      }
+  getStringTable() const {
+    const auto &sections = sectionHeaders();
+    if (header->sectionNameEntryIndex == 0 ||
+        header->sectionNameEntryIndex >= sections.size()) {
+      return nullptr;
     }
-
-    return nullptr;
+    return sections[header->sectionNameEntryIndex];
   }
 
-  [[nodiscard]] inline std::shared_ptr<SectionHeaderEntry> getSymbolTable() {
+  [[nodiscard]] std::shared_ptr<SectionHeaderEntry>
+  getSectionByName(std::string_view str) const;
+
+  [[nodiscard]] inline std::shared_ptr<SectionHeaderEntry>
+  getSymbolTable() const {
     auto symt = getSectionByName(".symtab");
     if (!symt) {
       symt = getSectionByName(".dynsym");
@@ -333,55 +377,84 @@ struct ELF {
     return symt;
   }
 
+  // The allocated section with file contents that covers virtual address
+  // `addr`, or nullptr.
+  [[nodiscard]] inline std::shared_ptr<SectionHeaderEntry>
+  getSectionContaining(uint64_t addr) const {
+    for (auto &section : sectionHeaders()) {
+      if ((section->flags & SectionHeaderEntry::SHF_ALLOC) &&
+          section->type != SectionHeaderEntry::Type::ProgramSpaceNoData &&
+          addr >= section->virtAddr && addr - section->virtAddr < section->size) {
+        return section;
+      }
+    }
+    return nullptr;
+  }
+
+  // See SymbolIndex.
+  [[nodiscard]] const SymbolIndex &symbols() const;
+
+  // The index of .dynsym, which dynamic relocations refer to (empty if there
+  // is none).
+  [[nodiscard]] const SymbolIndex &dynamicSymbols() const;
+
+  // The PT_DYNAMIC array up to DT_NULL; empty for static files.
+  [[nodiscard]] const std::vector<DynamicEntry> &dynamic() const;
+
+  // Value of the first dynamic entry tagged `tag`.
+  [[nodiscard]] std::optional<uint64_t> dynamicValue(int64_t tag) const;
+
+  // File offset of the `size` bytes at virtual address `addr`, if some
+  // PT_LOAD segment's file image holds them all.
+  [[nodiscard]] std::optional<uint64_t> fileOffsetOf(uint64_t addr,
+                                                     uint64_t size) const;
+
+  // String `offset` of the dynamic string table (DT_STRTAB), as used by
+  // DT_NEEDED and DT_SONAME.
+  [[nodiscard]] std::string_view dynamicString(uint64_t offset) const;
+
+  // The Elf64_Rela table of `size` bytes at virtual address `addr`, read in
+  // one go.
+  [[nodiscard]] std::vector<Relocation> relocations(uint64_t addr,
+                                                    uint64_t size) const;
+
   [[nodiscard]] inline std::optional<SymbolLocation>
-  getSymbolLocation(const std::string &name) {
-    auto symt = getSymbolTable();
-    if (!symt) {
+  getSymbolLocation(std::string_view name) const {
+    const auto &index = symbols();
+    if (index.empty()) {
       throw std::runtime_error("Symbol table not found");
     }
 
-    // Determine the associated string table
-    auto stringTable = getSectionByName(
-        symt->type == SectionHeaderEntry::Type::SymbolTable ? ".strtab"
-                                                            : ".dynstr");
-    if (!stringTable) {
-      throw std::runtime_error("String table not found");
+    auto sym = index.lookup(name);
+    if (!sym) {
+      return std::nullopt;
     }
+    return SymbolLocation{sym->value, sym->size};
+  }
 
-    struct Symbol {
-      uint32_t nameOffset;
-      uint8_t info;
-      uint8_t other;
-      uint16_t sectionIndex;
-      uint64_t value;
-      uint64_t size;
-    };
-
-    if (symt->entrySize != sizeof(Symbol)) {
-      throw std::runtime_error("Unexpected symbol table entry size");
-    }
+private:
+  mutable std::once_flag programHeadersOnce;
+  mutable std::vector<std::shared_ptr<ProgramHeaderEntry>> _programHeaders;
 
-    size_t symbolCount = symt->size / sizeof(Symbol);
-    for (size_t i = 0; i < symbolCount; ++i) {
-      symt->buffer.seek(i * sizeof(Symbol));
-      Symbol sym;
-      sym.nameOffset = symt->buffer.pop_u32();
-      sym.info = symt->buffer.pop_u8();
-      sym.other = symt->buffer.pop_u8();
-      sym.sectionIndex = symt->buffer.pop_u16();
-      sym.value = symt->buffer.pop_u64();
-      sym.size = symt->buffer.pop_u64();
-
-      stringTable->buffer.seek(sym.nameOffset);
-      std::string symName = stringTable->buffer.pop_null_string();
-
-      if (symName == name) {
-        return SymbolLocation{sym.value, sym.size};
-      }
-    }
+  mutable std::once_flag sectionHeadersOnce;
+  mutable std::vector<std::shared_ptr<SectionHeaderEntry>> _sectionHeaders;
 
-    return std::nullopt;
-  }
+  // _sectionNames[i] names _sectionHeaders[i]; the views point into the
+  // string table's buffer.
+  mutable std::once_flag sectionNamesOnce;
+  mutable std::vector<std::string_view> _sectionNames;
+  mutable std::unordered_map<std::string_view, size_t> sectionIndexByName;
+
+  mutable std::once_flag symbolsOnce;
+  mutable std::unique_ptr<SymbolIndex> symbolIndex;
+
+  mutable std::once_flag dynamicSymbolsOnce;
+  mutable std::unique_ptr<SymbolIndex> dynamicSymbolIndex;
+
+  mutable std::once_flag dynamicOnce;
+  mutable std::vector<DynamicEntry> _dynamic;
+
+  void indexSectionNames() const;
 };
 
 [[nodiscard]] std::shared_ptr<ELFHeader> readELFHeader(buffer::Buffer &buf);
@@ -0,0 +1,503 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+#include "decode.h"
+#include "hart.h"
+#include "memory.h"
+
+namespace riscy::vm {
+
+enum class StopReason {
+  // Control reached kReturnAddress.
+  Returned,
+  StepLimit,
+  IllegalInstruction,
+  MisalignedFetch,
+  FetchFault,
+  LoadFault,
+  StoreFault,
+  // An ECALL at pc, left for the embedder to service (see syscalls.h).
+  EnvironmentCall,
+  Breakpoint,
+  // The guest process called exit (see syscalls.h).
+  Exited,
+};
+
+constexpr std::string_view StopReasonNames[] = {
+    "Returned",   "StepLimit", "IllegalInstruction", "MisalignedFetch",
+    "FetchFault", "LoadFault", "StoreFault",         "EnvironmentCall",
+    "Breakpoint", "Exited",
+};
+
+// Return address planted by Interpreter::call(). It is 4-byte aligned and
+// never backed by guest memory, so jumping to it ends the run with
+// StopReason::Returned instead of a fetch fault.
+constexpr uint64_t kReturnAddress = 0xFFFF'FFFF'FFFF'FFF0;
+
+namespace detail {
+
+inline int64_t sdiv(int64_t a, int64_t b) {
+  if (b == 0)
+    return -1;
+  if (a == INT64_MIN && b == -1)
+    return a;
+  return a / b;
+}
+
+inline int64_t srem(int64_t a, int64_t b) {
+  if (b == 0)
+    return a;
+  if (a == INT64_MIN && b == -1)
+    return 0;
+  return a % b;
+}
+
+inline int32_t sdivw(int32_t a, int32_t b) {
+  if (b == 0)
+    return -1;
+  if (a == INT32_MIN && b == -1)
+    return a;
+  return a / b;
+}
+
+inline int32_t sremw(int32_t a, int32_t b) {
+  if (b == 0)
+    return a;
+  if (a == INT32_MIN && b == -1)
+    return 0;
+  return a % b;
+}
+
+inline uint64_t sext32(uint64_t v) {
+  return static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(v)));
+}
+
+template <typename T>
+inline uint64_t atomicAs(Hart &hart, risc::Op op, uint64_t addr, uint8_t *p,
+                         uint64_t value) {
+  using risc::Op;
+  using S = std::make_signed_t<T>;
+  std::atomic_ref<T> m(*reinterpret_cast<T *>(p));
+  const T v = static_cast<T>(value);
+  auto update = [&](auto f) {
+    T old = m.load();
+    while (!m.compare_exchange_weak(old, f(old))) {
+    }
+    return old;
+  };
+
+  T old = 0;
+  switch (op) {
+  case Op::LR_W:
+  case Op::LR_D:
+    old = m.load();
+    hart.reservation = addr;
+    hart.reservedValue = old;
+    hart.reservedSize = sizeof(T);
+    break;
+  case Op::SC_W:
+  case Op::SC_D: {
+    T expected = static_cast<T>(hart.reservedValue);
+    bool ok = hart.reservation == addr && hart.reservedSize == sizeof(T) &&
+              m.compare_exchange_strong(expected, v);
+    hart.reservation = Hart::kNoReservation;
+    return ok ? 0 : 1;
+  }
+  case Op::AMOSWAP_W:
+  case Op::AMOSWAP_D:
+    old = m.exchange(v);
+    break;
+  case Op::AMOADD_W:
+  case Op::AMOADD_D:
+    old = m.fetch_add(v);
+    break;
+  case Op::AMOXOR_W:
+  case Op::AMOXOR_D:
+    old = m.fetch_xor(v);
+    break;
+  case Op::AMOAND_W:
+  case Op::AMOAND_D:
+    old = m.fetch_and(v);
+    break;
+  case Op::AMOOR_W:
+  case Op::AMOOR_D:
+    old = m.fetch_or(v);
+    break;
+  case Op::AMOMIN_W:
+  case Op::AMOMIN_D:
+    old = update([&](T o) { return S(o) < S(v) ? o : v; });
+    break;
+  case Op::AMOMAX_W:
+  case Op::AMOMAX_D:
+    old = update([&](T o) { return S(o) > S(v) ? o : v; });
+    break;
+  case Op::AMOMINU_W:
+  case Op::AMOMINU_D:
+    old = update([&](T o) { return o < v ? o : v; });
+    break;
+  case Op::AMOMAXU_W:
+  case Op::AMOMAXU_D:
+    old = update([&](T o) { return o > v ? o : v; });
+    break;
+  default:
+    break;
+  }
+  return sizeof(T) == 4 ? sext32(old) : old;
+}
+
+// Performs the atomic instruction `op` (see risc::isAtomic()) on the
+// naturally aligned guest address `addr`, found at host address `p`, with
+// rs2 value `value`; returns the value for rd. Every access is sequentially
+// consistent, which satisfies any combination of aq and rl, and maps to a
+// single locked instruction (or a compare-exchange loop for min/max) on the
+// host, so harts on other host threads see them atomically.
+inline uint64_t atomic(Hart &hart, risc::Op op, uint64_t addr, uint8_t *p,
+                       uint64_t value) {
+  return risc::atomicSize(op) == 8
+             ? atomicAs<uint64_t>(hart, op, addr, p, value)
+             : atomicAs<uint32_t>(hart, op, addr, p, value);
+}
+
+// A FENCE as a host barrier. An acquire-release fence orders everything
+// but earlier stores against later loads, which needs the full one.
+inline void fence(int32_t imm) {
+  std::atomic_thread_fence(risc::fenceOrdersStoreLoad(imm)
+                               ? std::memory_order_seq_cst
+                               : std::memory_order_acq_rel);
+}
+
+} // namespace detail
+
+// Executes one decoded instruction located at `pc` and advances `pc` to the
+// next one. On a trap, `pc` is left pointing at the offending instruction,
+// `stop` says why, and false is returned; architectural state is unchanged
+// in that case.
+[[nodiscard, gnu::always_inline]] inline bool execute(Hart &hart, Memory &mem,
+                                  const risc::DecodedInstr &d, uint64_t &pc,
+                                  StopReason &stop) {
+  using risc::Op;
+  using namespace detail;
+
+  auto &x = hart.x;
+  const uint64_t a = x[d.rs1];
+  const uint64_t b = x[d.rs2];
+  const int64_t sa = static_cast<int64_t>(a);
+  const int64_t sb = static_cast<int64_t>(b);
+  const int64_t imm = d.imm;
+  const uint64_t uimm = static_cast<uint64_t>(imm);
+  uint64_t next = pc + d.length;
+  uint64_t r = 0;
+
+  auto loadAs = [&]<typename T>(T) {
+    T v;
+    if (!mem.load(a + uimm, v)) {
+      stop = StopReason::LoadFault;
+      return false;
+    }
+    if constexpr (std::is_signed_v<T>) {
+      r = static_cast<uint64_t>(static_cast<int64_t>(v));
+    } else {
+      r = v;
+    }
+    return true;
+  };
+  auto storeAs = [&]<typename T>(T v) {
+    if (!mem.store(a + uimm, v)) {
+      stop = StopReason::StoreFault;
+      return false;
+    }
+    return true;
+  };
+  // LR, SC and AMOs address rs1 itself, which must be naturally aligned.
+  auto atomicAt = [&] {
+    const unsigned n = risc::atomicSize(d.op);
+    const bool reserve = d.op == Op::LR_W || d.op == Op::LR_D;
+    uint8_t *p = a & (n - 1) ? nullptr : mem.atomic(a, n, !reserve);
+    if (!p) {
+      stop = reserve ? StopReason::LoadFault : StopReason::StoreFault;
+      return false;
+    }
+    r = atomic(hart, d.op, a, p, b);
+    return true;
+  };
+
+  switch (d.op) {
+  case Op::LUI:
+    r = uimm;
+    break;
+  case Op::AUIPC:
+    r = pc + uimm;
+    break;
+  case Op::JAL:
+    r = next;
+    next = pc + uimm;
+    break;
+  case Op::JALR:
+    r = next;
+    next = (a + uimm) & ~uint64_t(1);
+    break;
+
+  case Op::BEQ:
+    if (a == b)
+      next = pc + uimm;
+    break;
+  case Op::BNE:
+    if (a != b)
+      next = pc + uimm;
+    break;
+  case Op::BLT:
+    if (sa < sb)
+      next = pc + uimm;
+    break;
+  case Op::BGE:
+    if (sa >= sb)
+      next = pc + uimm;
+    break;
+  case Op::BLTU:
+    if (a < b)
+      next = pc + uimm;
+    break;
+  case Op::BGEU:
+    if (a >= b)
+      next = pc + uimm;
+    break;
+
+  case Op::LB:
+    if (!loadAs(int8_t()))
+      return false;
+    break;
+  case Op::LH:
+    if (!loadAs(int16_t()))
+      return false;
+    break;
+  case Op::LW:
+    if (!loadAs(int32_t()))
+      return false;
+    break;
+  case Op::LD:
+    if (!loadAs(uint64_t()))
+      return false;
+    break;
+  case Op::LBU:
+    if (!loadAs(uint8_t()))
+      return false;
+    break;
+  case Op::LHU:
+    if (!loadAs(uint16_t()))
+      return false;
+    break;
+  case Op::LWU:
+    if (!loadAs(uint32_t()))
+      return false;
+    break;
+
+  case Op::SB:
+    if (!storeAs(static_cast<uint8_t>(b)))
+      return false;
+    break;
+  case Op::SH:
+    if (!storeAs(static_cast<uint16_t>(b)))
+      return false;
+    break;
+  case Op::SW:
+    if (!storeAs(static_cast<uint32_t>(b)))
+      return false;
+    break;
+  case Op::SD:
+    if (!storeAs(b))
+      return false;
+    break;
+
+  case Op::ADDI:
+    r = a + uimm;
+    break;
+  case Op::SLTI:
+    r = sa < imm;
+    break;
+  case Op::SLTIU:
+    r = a < uimm;
+    break;
+  case Op::XORI:
+    r = a ^ uimm;
+    break;
+  case Op::ORI:
+    r = a | uimm;
+    break;
+  case Op::ANDI:
+    r = a & uimm;
+    break;
+  case Op::SLLI:
+    r = a << (imm & 63);
+    break;
+  case Op::SRLI:
+    r = a >> (imm & 63);
+    break;
+  case Op::SRAI:
+    r = static_cast<uint64_t>(sa >> (imm & 63));
+    break;
+
+  case Op::ADD:
+    r = a + b;
+    break;
+  case Op::SUB:
+    r = a - b;
+    break;
+  case Op::SLL:
+    r = a << (b & 63);
+    break;
+  case Op::SLT:
+    r = sa < sb;
+    break;
+  case Op::SLTU:
+    r = a < b;
+    break;
+  case Op::XOR:
+    r = a ^ b;
+    break;
+  case Op::SRL:
+    r = a >> (b & 63);
+    break;
+  case Op::SRA:
+    r = static_cast<uint64_t>(sa >> (b & 63));
+    break;
+  case Op::OR:
+    r = a | b;
+    break;
+  case Op::AND:
+    r = a & b;
+    break;
+
+  case Op::ADDIW:
+    r = sext32(a + uimm);
+    break;
+  case Op::SLLIW:
+    r = sext32(static_cast<uint32_t>(a) << (imm & 31));
+    break;
+  case Op::SRLIW:
+    r = sext32(static_cast<uint32_t>(a) >> (imm & 31));
+    break;
+  case Op::SRAIW:
+    r = sext32(static_cast<uint32_t>(static_cast<int32_t>(a) >> (imm & 31)));
+    break;
+  case Op::ADDW:
+    r = sext32(a + b);
+    break;
+  case Op::SUBW:
+    r = sext32(a - b);
+    break;
+  case Op::SLLW:
+    r = sext32(static_cast<uint32_t>(a) << (b & 31));
+    break;
+  case Op::SRLW:
+    r = sext32(static_cast<uint32_t>(a) >> (b & 31));
+    break;
+  case Op::SRAW:
+    r = sext32(static_cast<uint32_t>(static_cast<int32_t>(a) >> (b & 31)));
+    break;
+
+  case Op::FENCE:
+    fence(d.imm);
+    break;
+  case Op::FENCE_I:
+    break;
+
+  case Op::MUL:
+    r = a * b;
+    break;
+  case Op::MULH:
+    r = static_cast<uint64_t>((__int128(sa) * __int128(sb)) >> 64);
+    break;
+  case Op::MULHSU:
+    r = static_cast<uint64_t>((__int128(sa) * __int128(b)) >> 64);
+    break;
+  case Op::MULHU:
+    r = static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(a) * static_cast<unsigned __int128>(b)) >>
+        64);
+    break;
+  case Op::DIV:
+    r = static_cast<uint64_t>(sdiv(sa, sb));
+    break;
+  case Op::DIVU:
+    r = b == 0 ? ~uint64_t(0) : a / b;
+    break;
+  case Op::REM:
+    r = static_cast<uint64_t>(srem(sa, sb));
+    break;
+  case Op::REMU:
+    r = b == 0 ? a : a % b;
+    break;
+  case Op::MULW:
+    r = sext32(a * b);
+    break;
+  case Op::DIVW:
+    r = sext32(static_cast<uint32_t>(
+        sdivw(static_cast<int32_t>(a), static_cast<int32_t>(b))));
+    break;
+  case Op::DIVUW: {
+    uint32_t ua = static_cast<uint32_t>(a), ub = static_cast<uint32_t>(b);
+    r = sext32(ub == 0 ? ~uint32_t(0) : ua / ub);
+    break;
+  }
+  case Op::REMW:
+    r = sext32(static_cast<uint32_t>(
+        sremw(static_cast<int32_t>(a), static_cast<int32_t>(b))));
+    break;
+  case Op::REMUW: {
+    uint32_t ua = static_cast<uint32_t>(a), ub = static_cast<uint32_t>(b);
+    r = sext32(ub == 0 ? ua : ua % ub);
+    break;
+  }
+
+  case Op::LR_W:
+  case Op::SC_W:
+  case Op::AMOSWAP_W:
+  case Op::AMOADD_W:
+  case Op::AMOXOR_W:
+  case Op::AMOAND_W:
+  case Op::AMOOR_W:
+  case Op::AMOMIN_W:
+  case Op::AMOMAX_W:
+  case Op::AMOMINU_W:
+  case Op::AMOMAXU_W:
+  case Op::LR_D:
+  case Op::SC_D:
+  case Op::AMOSWAP_D:
+  case Op::AMOADD_D:
+  case Op::AMOXOR_D:
+  case Op::AMOAND_D:
+  case Op::AMOOR_D:
+  case Op::AMOMIN_D:
+  case Op::AMOMAX_D:
+  case Op::AMOMINU_D:
+  case Op::AMOMAXU_D:
+    if (!atomicAt())
+      return false;
+    break;
+
+  case Op::ECALL:
+    stop = StopReason::EnvironmentCall;
+    return false;
+  case Op::EBREAK:
+    stop = StopReason::Breakpoint;
+    return false;
+
+  case Op::INVALID:
+  case Op::_count:
+    stop = StopReason::IllegalInstruction;
+    return false;
+  }
+
+  // Instructions without a destination decode with rd == x0, so the
+  // unconditional write-back below is harmless for them.
+  x[d.rd] = r;
+  x[0] = 0;
+  pc = next;
+  return true;
+}
+
+} // namespace riscy::vm
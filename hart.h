@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace riscy::vm {
+
+// Architectural state of one RISC-V hardware thread.
+struct Hart {
+  // x0 is hardwired to zero; writes to it are discarded after every
+  // instruction.
+  std::array<uint64_t, 32> x{};
+  uint64_t pc = 0;
+
+  // Instructions retired; backs the instret/cycle counters.
+  uint64_t instret = 0;
+
+  // LR/SC reservation: the address and size of the last LR, and the value
+  // it read. SC succeeds if memory still holds that value, checked and
+  // swapped in one host compare-and-exchange; kNoReservation once any SC
+  // has consumed it.
+  static constexpr uint64_t kNoReservation = ~uint64_t(0);
+  uint64_t reservation = kNoReservation;
+  uint64_t reservedValue = 0;
+  uint8_t reservedSize = 0;
+
+  // Control and status registers, indexed by their 12-bit address.
+  std::array<uint64_t, 4096> csr{};
+
+  enum CSR : uint16_t {
+    kCycle = 0xC00,
+    kTime = 0xC01,
+    kInstret = 0xC02,
+  };
+
+  // ABI register numbers
+  enum Reg : uint8_t {
+    kZero = 0,
+    kRA = 1,
+    kSP = 2,
+    kGP = 3,
+    kTP = 4,
+    kA0 = 10,
+    kA1 = 11,
+    kA2 = 12,
+    kA3 = 13,
+    kA4 = 14,
+    kA5 = 15,
+    kA6 = 16,
+    kA7 = 17,
+  };
+};
+
+} // namespace riscy::vm
@@ -0,0 +1,93 @@
+#include "interp.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace riscy::vm {
+
+template <typename P>
+RunResult Interpreter::runWith(P &profiler, uint64_t maxSteps) {
+  uint64_t pc = hart.pc;
+  uint64_t steps = 0;
+  StopReason reason = StopReason::StepLimit;
+
+  // The embedder may have written code pages since the last run (e.g. a
+  // read() into guest memory).
+  cache.sync(memory);
+
+  while (steps < maxSteps) {
+    Block *block = cache.lookup(pc, memory, reason);
+    if (!block) {
+      break;
+    }
+
+    const risc::DecodedInstr *first = block->instrs.data();
+    const risc::DecodedInstr *last =
+        first + std::min<uint64_t>(block->instrs.size(), maxSteps - steps);
+    const risc::DecodedInstr *it = first;
+    bool trapped = false;
+    for (; it != last; ++it) {
+      if (!execute(hart, memory, *it, pc, reason)) {
+        trapped = true;
+        break;
+      }
+    }
+    steps += it - first;
+    if constexpr (P::enabled) {
+      profiler.block(*block, it - first, pc);
+    }
+    if (trapped) {
+      break;
+    }
+
+    // Stores in this block may have hit pages we hold decoded copies of.
+    cache.sync(memory);
+  }
+
+  hart.pc = pc;
+  hart.instret += steps;
+  return {reason, pc, steps};
+}
+
+template RunResult Interpreter::runWith(NoProfiler &, uint64_t);
+template RunResult Interpreter::runWith(Profiler &, uint64_t);
+
+RunResult Interpreter::run(uint64_t maxSteps) {
+  NoProfiler none;
+  return runWith(none, maxSteps);
+}
+
+void prepareCall(Hart &hart, const Memory &memory, uint64_t entry,
+                 std::span<const uint64_t> args) {
+  if (args.size() > 8) {
+    throw std::invalid_argument("At most 8 register arguments supported");
+  }
+  for (size_t i = 0; i < args.size(); i++) {
+    hart.x[Hart::kA0 + i] = args[i];
+  }
+  hart.x[Hart::kRA] = kReturnAddress;
+  hart.x[Hart::kSP] = memory.stackTop();
+  hart.pc = entry;
+}
+
+RunResult Interpreter::call(uint64_t entry, std::span<const uint64_t> args,
+                            uint64_t maxSteps) {
+  prepareCall(hart, memory, entry, args);
+  return run(maxSteps);
+}
+
+template <typename P>
+RunResult Interpreter::callWith(P &profiler, uint64_t entry,
+                                std::span<const uint64_t> args,
+                                uint64_t maxSteps) {
+  prepareCall(hart, memory, entry, args);
+  profiler.enter(entry);
+  return runWith(profiler, maxSteps);
+}
+
+template RunResult Interpreter::callWith(NoProfiler &, uint64_t,
+                                         std::span<const uint64_t>, uint64_t);
+template RunResult Interpreter::callWith(Profiler &, uint64_t,
+                                         std::span<const uint64_t>, uint64_t);
+
+} // namespace riscy::vm
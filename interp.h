@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <span>
+
+#include "block_cache.h"
+#include "execute.h"
+#include "hart.h"
+#include "memory.h"
+#include "profile.h"
+
+namespace riscy::vm {
+
+struct RunResult {
+  StopReason reason;
+  // Address of the instruction that stopped the run (or kReturnAddress).
+  uint64_t pc;
+  uint64_t steps;
+};
+
+// Sets up `hart` to call the function at `entry` following the standard
+// calling convention: integer arguments in a0-a7, a fresh stack at
+// memory.stackTop(), and kReturnAddress as the return address.
+void prepareCall(Hart &hart, const Memory &memory, uint64_t entry,
+                 std::span<const uint64_t> args);
+
+// Executes a single hart out of a cache of pre-decoded basic blocks.
+class Interpreter {
+private:
+  Hart &hart;
+  Memory &memory;
+  BlockCache cache;
+
+public:
+  Interpreter(Hart &hart, Memory &memory) : hart(hart), memory(memory) {}
+
+  [[nodiscard]] inline BlockCache &blockCache() { return cache; }
+
+  // Runs from hart.pc until a trap, a return to kReturnAddress, or
+  // `maxSteps` retired instructions.
+  RunResult run(uint64_t maxSteps = std::numeric_limits<uint64_t>::max());
+
+  // Calls the function at `entry` (see prepareCall()) and runs it to
+  // completion. The return value is left in hart.x[Hart::kA0].
+  RunResult call(uint64_t entry, std::span<const uint64_t> args,
+                 uint64_t maxSteps = std::numeric_limits<uint64_t>::max());
+
+  // run() and call() reporting every executed block to `profiler` (see
+  // profile.h). Instantiated for NoProfiler and Profiler; the hooks are
+  // compiled out unless P::enabled.
+  template <typename P>
+  RunResult runWith(P &profiler,
+                    uint64_t maxSteps = std::numeric_limits<uint64_t>::max());
+
+  template <typename P>
+  RunResult callWith(P &profiler, uint64_t entry,
+                     std::span<const uint64_t> args,
+                     uint64_t maxSteps = std::numeric_limits<uint64_t>::max());
+};
+
+} // namespace riscy::vm
@@ -0,0 +1,748 @@
+#include "jit.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+#include "block_cache.h"
+#include "execute.h"
+#include "x86.h"
+
+namespace riscy::vm {
+
+using risc::DecodedInstr;
+using risc::Op;
+using namespace x86;
+
+namespace {
+
+// Host registers holding JitContext state while compiled code runs. All are
+// callee-saved, so helper calls leave them intact.
+constexpr Reg kCtx = RBP;
+constexpr Reg kRegs = RBX;
+constexpr Reg kMem = R12;
+constexpr Reg kBase = R13;
+constexpr Reg kLimit = R14;
+constexpr Reg kCodePages = R15;
+
+inline Mem ctxField(size_t offset) {
+  return {kCtx, kNoReg, static_cast<int32_t>(offset)};
+}
+
+inline Mem guestReg(uint8_t r) {
+  return {kRegs, kNoReg, static_cast<int32_t>(r * 8)};
+}
+
+// Division and remainder are called out of line: x86 traps where RISC-V
+// defines a result.
+uint64_t helperDiv(uint64_t a, uint64_t b) {
+  return static_cast<uint64_t>(
+      detail::sdiv(static_cast<int64_t>(a), static_cast<int64_t>(b)));
+}
+uint64_t helperDivu(uint64_t a, uint64_t b) {
+  return b == 0 ? ~uint64_t(0) : a / b;
+}
+uint64_t helperRem(uint64_t a, uint64_t b) {
+  return static_cast<uint64_t>(
+      detail::srem(static_cast<int64_t>(a), static_cast<int64_t>(b)));
+}
+uint64_t helperRemu(uint64_t a, uint64_t b) { return b == 0 ? a : a % b; }
+uint64_t helperDivw(uint64_t a, uint64_t b) {
+  return detail::sext32(static_cast<uint32_t>(
+      detail::sdivw(static_cast<int32_t>(a), static_cast<int32_t>(b))));
+}
+uint64_t helperDivuw(uint64_t a, uint64_t b) {
+  uint32_t ua = static_cast<uint32_t>(a), ub = static_cast<uint32_t>(b);
+  return detail::sext32(ub == 0 ? ~uint32_t(0) : ua / ub);
+}
+uint64_t helperRemw(uint64_t a, uint64_t b) {
+  return detail::sext32(static_cast<uint32_t>(
+      detail::sremw(static_cast<int32_t>(a), static_cast<int32_t>(b))));
+}
+uint64_t helperRemuw(uint64_t a, uint64_t b) {
+  uint32_t ua = static_cast<uint32_t>(a), ub = static_cast<uint32_t>(b);
+  return detail::sext32(ub == 0 ? ua : ua % ub);
+}
+
+// LR, SC and AMOs, as the interpreter runs them.
+uint64_t helperAtomic(Hart *hart, uint8_t *p, uint64_t addr, uint64_t value,
+                      uint64_t op) {
+  return detail::atomic(*hart, static_cast<Op>(op), addr, p, value);
+}
+
+// Translates one pre-decoded block. Guest registers are loaded from and
+// stored to hart.x around every instruction; rax, rcx, rdx and r8 are
+// scratch.
+class BlockCompiler {
+private:
+  struct Stub {
+    Label label;
+    JitExit exit;
+    uint64_t pc;
+    // Instructions of the block that did not run, for Interpret/Budget.
+    uint32_t refund;
+    // Offset of the chainable jump's rel32, for Chain.
+    size_t site;
+  };
+
+  Assembler as;
+  uint64_t origin;
+  const Block &block;
+  uint64_t epilogue;
+  std::vector<Stub> stubs;
+  uint32_t length;
+  // Guest address of the instruction being emitted.
+  uint64_t pc = 0;
+
+  void loadReg(Reg host, uint8_t r) {
+    if (r == 0) {
+      as.alu(kXor, host, host, false);
+    } else {
+      as.mov(host, guestReg(r));
+    }
+  }
+
+  void storeReg(uint8_t r, Reg host) {
+    if (r != 0) {
+      as.mov(guestReg(r), host);
+    }
+  }
+
+  // Leaves to the interpreter at instruction `index` (at `pc`) if `cond` holds (or
+  // unconditionally).
+  void bail(uint32_t index, std::optional<Cond> cond = std::nullopt) {
+    Label l = as.label();
+    if (cond) {
+      as.jcc(*cond, l);
+    } else {
+      as.jmp(l);
+    }
+    stubs.push_back({l, JitExit::Interpret, pc, length - index, 0});
+  }
+
+  // A jump to the guest address `target` that the dispatcher can later
+  // point straight at the target's compiled code.
+  void chain(uint64_t target) {
+    Label l = as.label();
+    as.jmp(l);
+    stubs.push_back({l, JitExit::Chain, target, 0, as.size() - 4});
+  }
+
+  // rax = guest address rs1 + imm, as an offset into guest memory; bails
+  // unless an 8-byte access there is in bounds.
+  void address(const DecodedInstr &d, uint32_t index) {
+    loadReg(RAX, d.rs1);
+    if (d.imm) {
+      as.alu(kAdd, RAX, d.imm);
+    }
+    as.alu(kSub, RAX, kBase);
+    as.alu(kCmp, RAX, kLimit);
+    bail(index, kAbove);
+  }
+
+  void load(const DecodedInstr &d, uint32_t index, unsigned bytes, bool sign) {
+    address(d, index);
+    as.load(RCX, {kMem, RAX}, bytes, sign);
+    storeReg(d.rd, RCX);
+  }
+
+  void store(const DecodedInstr &d, uint32_t index, unsigned bytes) {
+    address(d, index);
+    // Writes to pages holding decoded code go through the interpreter so
+    // that the block cache (and this code) gets invalidated.
+    as.mov(RDX, RAX);
+    as.shift(kShr, RDX, Memory::kPageShift);
+    as.cmpByte({kCodePages, RDX}, 0);
+    bail(index, kNotEqual);
+    as.lea(RDX, {RAX, kNoReg, static_cast<int32_t>(bytes - 1)});
+    as.shift(kShr, RDX, Memory::kPageShift);
+    as.cmpByte({kCodePages, RDX}, 0);
+    bail(index, kNotEqual);
+    loadReg(RCX, d.rs2);
+    as.store({kMem, RAX}, RCX, bytes);
+  }
+
+  // An LR, SC or AMO on the host address of rs1. Misaligned or out of
+  // bounds addresses bail so that the interpreter reports the fault, as do
+  // pages holding code, for the same reason as in store().
+  void atomic(const DecodedInstr &d, uint32_t index) {
+    loadReg(RDX, d.rs1);
+    as.alu(kAnd, RDX, static_cast<int32_t>(risc::atomicSize(d.op) - 1));
+    bail(index, kNotEqual);
+    loadReg(RAX, d.rs1);
+    as.alu(kSub, RAX, kBase);
+    as.alu(kCmp, RAX, kLimit);
+    bail(index, kAbove);
+    as.mov(RDX, RAX);
+    as.shift(kShr, RDX, Memory::kPageShift);
+    as.cmpByte({kCodePages, RDX}, 0);
+    bail(index, kNotEqual);
+
+    as.mov(RDI, ctxField(offsetof(JitContext, hart)));
+    as.lea(RSI, {kMem, RAX});
+    loadReg(RDX, d.rs1);
+    loadReg(RCX, d.rs2);
+    as.movImm(R8, static_cast<uint64_t>(d.op));
+    as.movImm(RAX, reinterpret_cast<uint64_t>(helperAtomic));
+    as.call(RAX);
+    storeReg(d.rd, RAX);
+  }
+
+  void immOp(const DecodedInstr &d, Alu op) {
+    loadReg(RAX, d.rs1);
+    as.alu(op, RAX, d.imm);
+    storeReg(d.rd, RAX);
+  }
+
+  void immShift(const DecodedInstr &d, Shift op, bool word) {
+    loadReg(RAX, d.rs1);
+    as.shift(op, RAX, static_cast<uint8_t>(d.imm & (word ? 31 : 63)), !word);
+    if (word) {
+      as.movsxd(RAX, RAX);
+    }
+    storeReg(d.rd, RAX);
+  }
+
+  void regOp(const DecodedInstr &d, Alu op, bool word) {
+    loadReg(RAX, d.rs1);
+    loadReg(RCX, d.rs2);
+    as.alu(op, RAX, RCX, !word);
+    if (word) {
+      as.movsxd(RAX, RAX);
+    }
+    storeReg(d.rd, RAX);
+  }
+
+  void regShift(const DecodedInstr &d, Shift op, bool word) {
+    loadReg(RAX, d.rs1);
+    loadReg(RCX, d.rs2);
+    as.shiftCl(op, RAX, !word);
+    if (word) {
+      as.movsxd(RAX, RAX);
+    }
+    storeReg(d.rd, RAX);
+  }
+
+  void compare(const DecodedInstr &d, Cond cond, bool immediate) {
+    loadReg(RAX, d.rs1);
+    if (immediate) {
+      as.alu(kCmp, RAX, d.imm);
+    } else {
+      loadReg(RCX, d.rs2);
+      as.alu(kCmp, RAX, RCX);
+    }
+    as.setcc(cond, RAX);
+    storeReg(d.rd, RAX);
+  }
+
+  void helper(const DecodedInstr &d, uint64_t (*fn)(uint64_t, uint64_t)) {
+    loadReg(RDI, d.rs1);
+    loadReg(RSI, d.rs2);
+    as.movImm(RAX, reinterpret_cast<uint64_t>(fn));
+    as.call(RAX);
+    storeReg(d.rd, RAX);
+  }
+
+  void branch(const DecodedInstr &d, Cond cond) {
+    loadReg(RAX, d.rs1);
+    loadReg(RCX, d.rs2);
+    as.alu(kCmp, RAX, RCX);
+    Label taken = as.label();
+    as.jcc(cond, taken);
+    chain(pc + d.length);
+    as.bind(taken);
+    chain(pc + static_cast<int64_t>(d.imm));
+  }
+
+  // Emits instruction `index`; returns false if it ends the block.
+  bool instr(uint32_t index) {
+    const DecodedInstr &d = block.instrs[index];
+
+    switch (d.op) {
+    case Op::LUI:
+      as.movImm(RAX, static_cast<uint64_t>(static_cast<int64_t>(d.imm)));
+      storeReg(d.rd, RAX);
+      break;
+    case Op::AUIPC:
+      as.movImm(RAX, pc + static_cast<int64_t>(d.imm));
+      storeReg(d.rd, RAX);
+      break;
+
+    case Op::JAL:
+      if (d.rd) {
+        as.movImm(RAX, pc + d.length);
+        storeReg(d.rd, RAX);
+      }
+      chain(pc + static_cast<int64_t>(d.imm));
+      return false;
+    case Op::JALR:
+      loadReg(RAX, d.rs1);
+      if (d.imm) {
+        as.alu(kAdd, RAX, d.imm);
+      }
+      as.alu(kAnd, RAX, -2);
+      if (d.rd) {
+        as.movImm(RCX, pc + d.length);
+        storeReg(d.rd, RCX);
+      }
+      as.mov(ctxField(offsetof(JitContext, pc)), RAX);
+      as.movImm(RAX, static_cast<uint32_t>(JitExit::Jump));
+      as.jmp(epilogue);
+      return false;
+
+    case Op::BEQ:
+      branch(d, kEqual);
+      return false;
+    case Op::BNE:
+      branch(d, kNotEqual);
+      return false;
+    case Op::BLT:
+      branch(d, kLess);
+      return false;
+    case Op::BGE:
+      branch(d, kGreaterEqual);
+      return false;
+    case Op::BLTU:
+      branch(d, kBelow);
+      return false;
+    case Op::BGEU:
+      branch(d, kAboveEqual);
+      return false;
+
+    case Op::LB:
+      load(d, index, 1, true);
+      break;
+    case Op::LH:
+      load(d, index, 2, true);
+      break;
+    case Op::LW:
+      load(d, index, 4, true);
+      break;
+    case Op::LD:
+      load(d, index, 8, false);
+      break;
+    case Op::LBU:
+      load(d, index, 1, false);
+      break;
+    case Op::LHU:
+      load(d, index, 2, false);
+      break;
+    case Op::LWU:
+      load(d, index, 4, false);
+      break;
+
+    case Op::SB:
+      store(d, index, 1);
+      break;
+    case Op::SH:
+      store(d, index, 2);
+      break;
+    case Op::SW:
+      store(d, index, 4);
+      break;
+    case Op::SD:
+      store(d, index, 8);
+      break;
+
+    case Op::ADDI:
+      immOp(d, kAdd);
+      break;
+    case Op::SLTI:
+      compare(d, kLess, true);
+      break;
+    case Op::SLTIU:
+      compare(d, kBelow, true);
+      break;
+    case Op::XORI:
+      immOp(d, kXor);
+      break;
+    case Op::ORI:
+      immOp(d, kOr);
+      break;
+    case Op::ANDI:
+      immOp(d, kAnd);
+      break;
+    case Op::SLLI:
+      immShift(d, kShl, false);
+      break;
+    case Op::SRLI:
+      immShift(d, kShr, false);
+      break;
+    case Op::SRAI:
+      immShift(d, kSar, false);
+      break;
+
+    case Op::ADD:
+      regOp(d, kAdd, false);
+      break;
+    case Op::SUB:
+      regOp(d, kSub, false);
+      break;
+    case Op::SLL:
+      regShift(d, kShl, false);
+      break;
+    case Op::SLT:
+      compare(d, kLess, false);
+      break;
+    case Op::SLTU:
+      compare(d, kBelow, false);
+      break;
+    case Op::XOR:
+      regOp(d, kXor, false);
+      break;
+    case Op::SRL:
+      regShift(d, kShr, false);
+      break;
+    case Op::SRA:
+      regShift(d, kSar, false);
+      break;
+    case Op::OR:
+      regOp(d, kOr, false);
+      break;
+    case Op::AND:
+      regOp(d, kAnd, false);
+      break;
+
+    case Op::ADDIW:
+      loadReg(RAX, d.rs1);
+      as.alu(kAdd, RAX, d.imm, false);
+      as.movsxd(RAX, RAX);
+      storeReg(d.rd, RAX);
+      break;
+    case Op::SLLIW:
+      immShift(d, kShl, true);
+      break;
+    case Op::SRLIW:
+      immShift(d, kShr, true);
+      break;
+    case Op::SRAIW:
+      immShift(d, kSar, true);
+      break;
+    case Op::ADDW:
+      regOp(d, kAdd, true);
+      break;
+    case Op::SUBW:
+      regOp(d, kSub, true);
+      break;
+    case Op::SLLW:
+      regShift(d, kShl, true);
+      break;
+    case Op::SRLW:
+      regShift(d, kShr, true);
+      break;
+    case Op::SRAW:
+      regShift(d, kSar, true);
+      break;
+
+    case Op::FENCE:
+      // x86 already keeps every other order.
+      if (risc::fenceOrdersStoreLoad(d.imm)) {
+        as.mfence();
+      }
+      break;
+
+    case Op::MUL:
+    case Op::MULW:
+      loadReg(RAX, d.rs1);
+      loadReg(RCX, d.rs2);
+      as.imul(RAX, RCX, d.op == Op::MUL);
+      if (d.op == Op::MULW) {
+        as.movsxd(RAX, RAX);
+      }
+      storeReg(d.rd, RAX);
+      break;
+    case Op::MULH:
+    case Op::MULHU:
+      loadReg(RAX, d.rs1);
+      loadReg(RCX, d.rs2);
+      as.mulWide(RCX, d.op == Op::MULH);
+      storeReg(d.rd, RDX);
+      break;
+    case Op::MULHSU:
+      // High half of the unsigned product, minus rs2 if rs1 is negative.
+      loadReg(RAX, d.rs1);
+      loadReg(RCX, d.rs2);
+      as.mov(R8, RAX);
+      as.mulWide(RCX, false);
+      as.shift(kSar, R8, 63);
+      as.alu(kAnd, R8, RCX);
+      as.alu(kSub, RDX, R8);
+      storeReg(d.rd, RDX);
+      break;
+    case Op::DIV:
+      helper(d, helperDiv);
+      break;
+    case Op::DIVU:
+      helper(d, helperDivu);
+      break;
+    case Op::REM:
+      helper(d, helperRem);
+      break;
+    case Op::REMU:
+      helper(d, helperRemu);
+      break;
+    case Op::DIVW:
+      helper(d, helperDivw);
+      break;
+    case Op::DIVUW:
+      helper(d, helperDivuw);
+      break;
+    case Op::REMW:
+      helper(d, helperRemw);
+      break;
+    case Op::REMUW:
+      helper(d, helperRemuw);
+      break;
+
+    case Op::LR_W:
+    case Op::SC_W:
+    case Op::AMOSWAP_W:
+    case Op::AMOADD_W:
+    case Op::AMOXOR_W:
+    case Op::AMOAND_W:
+    case Op::AMOOR_W:
+    case Op::AMOMIN_W:
+    case Op::AMOMAX_W:
+    case Op::AMOMINU_W:
+    case Op::AMOMAXU_W:
+    case Op::LR_D:
+    case Op::SC_D:
+    case Op::AMOSWAP_D:
+    case Op::AMOADD_D:
+    case Op::AMOXOR_D:
+    case Op::AMOAND_D:
+    case Op::AMOOR_D:
+    case Op::AMOMIN_D:
+    case Op::AMOMAX_D:
+    case Op::AMOMINU_D:
+    case Op::AMOMAXU_D:
+      atomic(d, index);
+      break;
+
+    case Op::FENCE_I:
+    case Op::ECALL:
+    case Op::EBREAK:
+    case Op::INVALID:
+    case Op::_count:
+      bail(index);
+      return false;
+    }
+    return true;
+  }
+
+  void exitTo(JitExit exit, uint64_t pc) {
+    as.movImm(RAX, pc);
+    as.mov(ctxField(offsetof(JitContext, pc)), RAX);
+    as.movImm(RAX, static_cast<uint32_t>(exit));
+    as.jmp(epilogue);
+  }
+
+public:
+  BlockCompiler(std::vector<uint8_t> &code, uint64_t origin,
+                const Block &block, uint64_t epilogue)
+      : as(code, origin), origin(origin), block(block), epilogue(epilogue),
+        length(static_cast<uint32_t>(block.instrs.size())) {}
+
+  void compile() {
+    Label budget = as.label();
+    as.alu(kSub, ctxField(offsetof(JitContext, budget)),
+           static_cast<int32_t>(length));
+    as.jcc(kSign, budget);
+    stubs.push_back({budget, JitExit::Budget, block.start, length, 0});
+
+    bool fallsThrough = true;
+    pc = block.start;
+    for (uint32_t i = 0; i < length && fallsThrough; i++) {
+      fallsThrough = instr(i);
+      pc += block.instrs[i].length;
+    }
+    if (fallsThrough) {
+      chain(block.end);
+    }
+
+    for (const Stub &stub : stubs) {
+      as.bind(stub.label);
+      if (stub.refund) {
+        as.alu(kAdd, ctxField(offsetof(JitContext, budget)),
+               static_cast<int32_t>(stub.refund));
+      }
+      if (stub.exit == JitExit::Chain) {
+        as.movImm(RAX, origin + stub.site);
+        as.mov(ctxField(offsetof(JitContext, patch)), RAX);
+      }
+      exitTo(stub.exit, stub.pc);
+    }
+    as.resolve();
+  }
+};
+
+} // namespace
+
+Jit::Jit(Hart &hart, Memory &memory, JitOptions options)
+    : hart(hart), memory(memory), options(options), interp(hart, memory),
+      cache(options.cacheSize) {
+  emitRuntime();
+  generation = interp.blockCache().generation();
+}
+
+// Entry trampoline and the shared epilogue every exit jumps to:
+//
+//   uint32_t enter(JitContext *ctx, const uint8_t *code)
+//
+// saves the callee-saved registers, loads the context into them, and jumps
+// to `code`; the exit code is returned in eax.
+void Jit::emitRuntime() {
+  std::vector<uint8_t> code;
+  Assembler as(code, cache.next());
+  const Reg saved[] = {RBX, RBP, R12, R13, R14, R15};
+  for (Reg r : saved) {
+    as.push(r);
+  }
+  // Keep rsp 16-byte aligned for helper calls.
+  as.alu(kSub, RSP, 8);
+  as.mov(kCtx, RDI);
+  as.mov(kRegs, ctxField(offsetof(JitContext, x)));
+  as.mov(kMem, ctxField(offsetof(JitContext, mem)));
+  as.mov(kBase, ctxField(offsetof(JitContext, base)));
+  as.mov(kLimit, ctxField(offsetof(JitContext, limit)));
+  as.mov(kCodePages, ctxField(offsetof(JitContext, codePages)));
+  as.jmp(RSI);
+
+  size_t epilogueOffset = as.size();
+  as.alu(kAdd, RSP, 8);
+  for (size_t i = std::size(saved); i-- > 0;) {
+    as.pop(saved[i]);
+  }
+  as.ret();
+
+  const uint8_t *at = cache.add(code);
+  if (!at) {
+    throw std::runtime_error("JIT code cache too small");
+  }
+  enter = reinterpret_cast<EntryFn>(const_cast<uint8_t *>(at));
+  epilogue = reinterpret_cast<uint64_t>(at) + epilogueOffset;
+  runtimeSize = cache.used();
+}
+
+void Jit::flush() {
+  natives.clear();
+  cache.truncate(runtimeSize);
+  generation = interp.blockCache().generation();
+}
+
+const uint8_t *Jit::nativeFor(uint64_t pc) {
+  NativeBlock &nb = natives[pc];
+  if (nb.code) {
+    return nb.code;
+  }
+  if (++nb.hits < options.hotThreshold) {
+    return nullptr;
+  }
+  nb.hits = 0;
+  return compile(pc);
+}
+
+const uint8_t *Jit::compile(uint64_t pc) {
+  StopReason ignored;
+  const Block *block = interp.blockCache().lookup(pc, memory, ignored);
+  if (!block) {
+    return nullptr;
+  }
+
+  std::vector<uint8_t> code;
+  for (int attempt = 0; attempt < 2; attempt++) {
+    code.clear();
+    uint64_t origin = cache.next();
+    BlockCompiler(code, origin, *block, epilogue).compile();
+    if (const uint8_t *at = cache.add(code)) {
+      natives[pc].code = at;
+      compiled++;
+      return at;
+    }
+    // Full: start over with an empty cache (and reassemble, since the code
+    // would now land elsewhere).
+    flush();
+  }
+  return nullptr;
+}
+
+void Jit::link(uint8_t *patch, uint64_t target) {
+  auto it = natives.find(target);
+  if (!patch || it == natives.end() || !it->second.code) {
+    return;
+  }
+  int32_t rel = static_cast<int32_t>(
+      reinterpret_cast<intptr_t>(it->second.code) -
+      reinterpret_cast<intptr_t>(patch + 4));
+  uint8_t bytes[4];
+  std::memcpy(bytes, &rel, 4);
+  cache.patch(patch, bytes);
+}
+
+RunResult Jit::run(uint64_t maxSteps) {
+  // Generated code addresses guest memory as one flat window.
+  if (!memory.isFlat() || memory.size() < 8) {
+    return interp.run(maxSteps);
+  }
+
+  JitContext ctx{};
+  ctx.x = hart.x.data();
+  ctx.mem = memory.translate(memory.base(), memory.size());
+  ctx.base = memory.base();
+  ctx.limit = memory.size() - 8;
+  ctx.codePages = memory.codePages();
+  ctx.hart = &hart;
+
+  uint64_t steps = 0;
+  StopReason reason = StopReason::StepLimit;
+  interp.blockCache().sync(memory);
+  while (steps < maxSteps) {
+    if (interp.blockCache().generation() != generation) {
+      flush();
+    }
+
+    if (const uint8_t *code = nativeFor(hart.pc)) {
+      int64_t budget = static_cast<int64_t>(std::min<uint64_t>(
+          maxSteps - steps, std::numeric_limits<int64_t>::max()));
+      ctx.budget = budget;
+      ctx.patch = nullptr;
+      auto exit = static_cast<JitExit>(enter(&ctx, code));
+      uint64_t ran = static_cast<uint64_t>(budget - ctx.budget);
+      steps += ran;
+      hart.instret += ran;
+      hart.pc = ctx.pc;
+      if (exit == JitExit::Chain) {
+        link(ctx.patch, ctx.pc);
+        continue;
+      }
+      if (exit == JitExit::Jump || steps >= maxSteps) {
+        continue;
+      }
+    }
+
+    // Run one block in the interpreter.
+    const Block *block = interp.blockCache().lookup(hart.pc, memory, reason);
+    if (!block) {
+      break;
+    }
+    RunResult r = interp.run(
+        std::min<uint64_t>(block->instrs.size(), maxSteps - steps));
+    steps += r.steps;
+    if (r.reason != StopReason::StepLimit) {
+      reason = r.reason;
+      break;
+    }
+  }
+  return {reason, hart.pc, steps};
+}
+
+RunResult Jit::call(uint64_t entry, std::span<const uint64_t> args,
+                    uint64_t maxSteps) {
+  prepareCall(hart, memory, entry, args);
+  return run(maxSteps);
+}
+
+} // namespace riscy::vm
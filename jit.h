@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <unordered_map>
+
+#include "code_cache.h"
+#include "hart.h"
+#include "interp.h"
+#include "memory.h"
+
+namespace riscy::vm {
+
+struct JitOptions {
+  // Times a block is dispatched through the interpreter before it is
+  // compiled.
+  uint32_t hotThreshold = 16;
+  // Bytes of executable memory; when it fills up, all compiled code is
+  // dropped and compilation starts over.
+  size_t cacheSize = 16 << 20;
+};
+
+// State shared between the dispatcher and generated code. Compiled blocks
+// address it through a fixed host register, so its layout is part of the
+// generated code's ABI.
+struct JitContext {
+  uint64_t *x;
+  // Host address of guest memory's first byte, its guest address, and the
+  // largest offset at which an 8-byte access still fits.
+  uint8_t *mem;
+  uint64_t base;
+  uint64_t limit;
+  const uint8_t *codePages;
+  // Instructions left to run; each compiled block subtracts its length on
+  // entry and gives back what it didn't execute on an early exit.
+  int64_t budget;
+  // Guest pc on exit.
+  uint64_t pc;
+  // For JitExit::Chain: the rel32 of the jump that took the exit, which the
+  // dispatcher retargets to the compiled successor.
+  uint8_t *patch;
+  // For LR/SC, which keep their reservation in the hart.
+  Hart *hart;
+};
+
+enum class JitExit : uint32_t {
+  // Left through an indirect jump to `pc`.
+  Jump,
+  // Left through a direct jump to `pc` that can be chained.
+  Chain,
+  // The instruction at `pc` must be run by the interpreter (a trap, a store
+  // to a page holding code, or an instruction the JIT doesn't translate).
+  Interpret,
+  // Not enough budget to run the block at `pc` in full.
+  Budget,
+};
+
+// Runs a hart by compiling hot basic blocks to x86-64 and interpreting the
+// rest. Guest registers stay in hart.x; compiled blocks jump to each other
+// directly once both exist, and return to the dispatcher only for indirect
+// jumps, uncompiled targets and anything they need the interpreter for.
+//
+// Compiled code is derived from the interpreter's block cache and is thrown
+// away whenever that cache drops a block (i.e. on self-modifying code).
+// Paged memory is not supported by generated code; with it, everything is
+// interpreted.
+class Jit {
+private:
+  using EntryFn = uint32_t (*)(JitContext *ctx, const uint8_t *code);
+
+  struct NativeBlock {
+    uint32_t hits = 0;
+    const uint8_t *code = nullptr;
+  };
+
+  Hart &hart;
+  Memory &memory;
+  JitOptions options;
+  Interpreter interp;
+  CodeCache cache;
+
+  EntryFn enter = nullptr;
+  uint64_t epilogue = 0;
+  size_t runtimeSize = 0;
+
+  std::unordered_map<uint64_t, NativeBlock> natives;
+  uint64_t generation = 0;
+  size_t compiled = 0;
+
+  void emitRuntime();
+  void flush();
+  [[nodiscard]] const uint8_t *nativeFor(uint64_t pc);
+  [[nodiscard]] const uint8_t *compile(uint64_t pc);
+  void link(uint8_t *patch, uint64_t target);
+
+public:
+  Jit(Hart &hart, Memory &memory, JitOptions options = {});
+
+  [[nodiscard]] inline Interpreter &interpreter() { return interp; }
+
+  // Blocks compiled since construction (including ones since flushed).
+  [[nodiscard]] inline size_t compiledBlocks() const { return compiled; }
+
+  // Same contract as Interpreter::run().
+  RunResult run(uint64_t maxSteps = std::numeric_limits<uint64_t>::max());
+
+  // Same contract as Interpreter::call().
+  RunResult call(uint64_t entry, std::span<const uint64_t> args,
+                 uint64_t maxSteps = std::numeric_limits<uint64_t>::max());
+};
+
+} // namespace riscy::vm
@@ -0,0 +1,81 @@
+#include "liveness.h"
+
+namespace riscy::cfg {
+
+using risc::Format;
+using risc::Op;
+
+bool isPure(const risc::DecodedInstr &d) {
+  switch (d.format) {
+  case Format::R:
+    return !risc::isAtomic(d.op);
+  case Format::U:
+    return true;
+  case Format::I:
+    switch (d.op) {
+    case Op::JALR:
+    case Op::LB:
+    case Op::LH:
+    case Op::LW:
+    case Op::LD:
+    case Op::LBU:
+    case Op::LHU:
+    case Op::LWU:
+    case Op::FENCE:
+    case Op::FENCE_I:
+    case Op::ECALL:
+    case Op::EBREAK:
+      return false;
+    default:
+      return true;
+    }
+  default:
+    return false;
+  }
+}
+
+Liveness computeLiveness(const FunctionCFG &fn,
+                         std::span<const RegSet> exitUses) {
+  const size_t n = fn.instrs.size();
+  const size_t nblocks = fn.blocks.size();
+
+  Liveness live;
+  live.liveOut.assign(n, 0);
+  live.dead.assign(n, 0);
+  std::vector<RegSet> blockIn(nblocks, 0);
+
+  // Live sets only grow, so iterating from empty sets converges on the
+  // smallest solution, in which a value is live only if some instruction
+  // that is itself needed reads it.
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t bi = nblocks; bi-- > 0;) {
+      const auto &b = fn.blocks[bi];
+      RegSet l = 0;
+      for (uint32_t s : fn.successors(static_cast<uint32_t>(bi))) {
+        l |= blockIn[s];
+      }
+      for (uint32_t i = b.firstInstr + b.instrCount; i-- > b.firstInstr;) {
+        const auto &d = fn.instrs[i];
+        live.liveOut[i] = l;
+        if (isPure(d) && !(defs(d) & l)) {
+          continue;
+        }
+        l = (l & ~defs(d)) | uses(d) | exitUses[i];
+      }
+      if (l != blockIn[bi]) {
+        blockIn[bi] = l;
+        changed = true;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    const auto &d = fn.instrs[i];
+    live.dead[i] = isPure(d) && !(defs(d) & live.liveOut[i]);
+  }
+  live.liveIn = nblocks ? blockIn[0] : 0;
+  return live;
+}
+
+} // namespace riscy::cfg
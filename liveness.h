@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include "cfg.h"
+#include "decode.h"
+
+namespace riscy::cfg {
+
+// Set of integer registers: bit i stands for x[i]. x0 is never a member.
+using RegSet = uint32_t;
+
+constexpr RegSet kAllRegs = ~RegSet(1);
+
+[[nodiscard]] inline RegSet regBit(uint8_t r) { return (RegSet(1) << r) & kAllRegs; }
+
+// Registers read by `d`. Unused register fields decode as x0, so they drop
+// out.
+[[nodiscard]] inline RegSet uses(const risc::DecodedInstr &d) {
+  return regBit(d.rs1) | regBit(d.rs2);
+}
+
+// Registers written by `d`.
+[[nodiscard]] inline RegSet defs(const risc::DecodedInstr &d) {
+  return regBit(d.rd);
+}
+
+// True if the only effect of `d` is writing its destination register, so it
+// can be dropped when that register is dead.
+[[nodiscard]] bool isPure(const risc::DecodedInstr &d);
+
+struct Liveness {
+  // liveOut[i]: registers whose current value may still be read after
+  // instruction i.
+  std::vector<RegSet> liveOut;
+  // dead[i]: instruction i is pure and its result is never read.
+  std::vector<uint8_t> dead;
+  // Registers live on entry to the function.
+  RegSet liveIn = 0;
+};
+
+// Backward liveness over the function's blocks. `exitUses[i]` holds the
+// registers observed when control may leave the function at instruction i
+// (an exit, a call or a trap); they are live before it. Uses by dead
+// instructions don't count, so chains of dead writes are removed together.
+[[nodiscard]] Liveness computeLiveness(const FunctionCFG &fn,
+                                       std::span<const RegSet> exitUses);
+
+} // namespace riscy::cfg
@@ -0,0 +1,320 @@
+#include "loader.h"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <stdexcept>
+
+#include "buffer.h"
+
+namespace riscy::vm {
+
+namespace {
+
+// RISC-V dynamic relocation types.
+enum : uint32_t {
+  R_RISCV_NONE = 0,
+  R_RISCV_64 = 2,
+  R_RISCV_RELATIVE = 3,
+  R_RISCV_JUMP_SLOT = 5,
+};
+
+constexpr uint64_t DF_BIND_NOW = 0x8;
+
+// st_shndx values that aren't sections.
+constexpr uint16_t SHN_UNDEF = 0;
+constexpr uint16_t SHN_ABS = 0xFFF1;
+
+inline uint64_t pageUp(uint64_t addr) {
+  return (addr + Memory::kPageSize - 1) & ~(Memory::kPageSize - 1);
+}
+
+} // namespace
+
+std::optional<uint64_t> LoadedObject::lookup(std::string_view name) const {
+  auto sym = elf->dynamicSymbols().lookup(name);
+  if (!sym || sym->sectionIndex == SHN_UNDEF ||
+      sym->binding == elf::Symbol::Binding::Local) {
+    return std::nullopt;
+  }
+  return sym->sectionIndex == SHN_ABS ? sym->value : sym->value + bias;
+}
+
+Loader::Loader(Memory &memory, uint64_t base, LoaderOptions options)
+    : memory(memory), options(std::move(options)), next(pageUp(base)) {}
+
+size_t Loader::load(std::shared_ptr<elf::ELF> elf, std::string name) {
+  using Segment = elf::ProgramHeaderEntry;
+  using FileType = elf::ELFHeader::FileType;
+
+  if (elf->header->isa != elf::ELFHeader::ISA::RISC_V) {
+    throw std::runtime_error("Not a RISC-V object: " + name);
+  }
+
+  uint64_t lo = UINT64_MAX, hi = 0, align = Memory::kPageSize;
+  for (const auto &ph : elf->programHeaders()) {
+    if (ph->type != Segment::SegmentType::Loadable) {
+      continue;
+    }
+    lo = std::min(lo, ph->virtAddr);
+    hi = std::max(hi, ph->virtAddr + ph->sizeInMemory);
+    align = std::max(align, ph->alignment);
+  }
+  if (lo > hi) {
+    throw std::runtime_error("No loadable segments: " + name);
+  }
+  if (align & (align - 1)) {
+    throw std::runtime_error("Bad segment alignment: " + name);
+  }
+  lo &= ~(Memory::kPageSize - 1);
+  hi = pageUp(hi);
+
+  auto object = std::make_unique<LoadedObject>();
+  if (elf->header->type != FileType::Executable) {
+    object->bias = ((next + align - 1) & ~(align - 1)) - lo;
+  }
+  object->start = lo + object->bias;
+  object->end = hi + object->bias;
+  memory.loadSegments(*elf, object->bias);
+  // Leave an unmapped page between objects.
+  next = std::max(next, object->end + Memory::kPageSize);
+
+  for (const auto &entry : elf->dynamic()) {
+    if (entry.tag == elf::DynamicEntry::DT_NEEDED) {
+      object->needed.emplace_back(elf->dynamicString(entry.value));
+    }
+  }
+  object->name = std::move(name);
+  object->elf = std::move(elf);
+  objects.push_back(std::move(object));
+  return objects.size() - 1;
+}
+
+size_t Loader::loadFile(const std::string &path) {
+  auto open = [&](const std::string &file, std::string name) {
+    auto buf = buffer::Buffer::map(file);
+    auto elf = elf::readELF(buf);
+    if (!elf) {
+      throw std::runtime_error("Failed to read ELF: " + file);
+    }
+    if (auto soname = elf->dynamicValue(elf::DynamicEntry::DT_SONAME)) {
+      name = elf->dynamicString(*soname);
+    }
+    return load(std::move(elf), std::move(name));
+  };
+  auto isLoaded = [&](std::string_view name) {
+    return std::any_of(objects.begin(), objects.end(),
+                       [&](const auto &o) { return o->name == name; });
+  };
+
+  size_t first = open(path, std::filesystem::path(path).filename());
+  std::deque<size_t> pending{first};
+  while (!pending.empty()) {
+    std::vector<std::string> needed = objects[pending.front()]->needed;
+    pending.pop_front();
+    for (const auto &name : needed) {
+      if (isLoaded(name)) {
+        continue;
+      }
+      auto dir = std::find_if(
+          options.searchPath.begin(), options.searchPath.end(),
+          [&](const auto &d) { return std::filesystem::exists(d + "/" + name); });
+      if (dir == options.searchPath.end()) {
+        throw std::runtime_error("Library not found: " + name);
+      }
+      pending.push_back(open(*dir + "/" + name, name));
+    }
+  }
+  return first;
+}
+
+std::optional<uint64_t> Loader::resolve(std::string_view name) {
+  std::string key(name);
+  if (auto it = resolved.find(key); it != resolved.end()) {
+    return it->second;
+  }
+  for (const auto &object : objects) {
+    if (auto addr = object->lookup(name)) {
+      resolved.emplace(std::move(key), *addr);
+      return addr;
+    }
+  }
+  return std::nullopt;
+}
+
+uint64_t Loader::symbolValue(const LoadedObject &object, uint32_t index) {
+  if (index == 0) {
+    return 0;
+  }
+  const auto &symbols = object.elf->dynamicSymbols();
+  if (index >= symbols.size()) {
+    throw std::runtime_error("Relocation symbol out of range in " +
+                             object.name);
+  }
+  elf::Symbol sym = symbols.symbolAt(index);
+  if (sym.binding == elf::Symbol::Binding::Local) {
+    return sym.value + object.bias;
+  }
+  if (auto addr = resolve(sym.name)) {
+    return *addr;
+  }
+  if (sym.binding == elf::Symbol::Binding::Weak) {
+    return 0;
+  }
+  throw std::runtime_error("Undefined symbol " + std::string(sym.name) +
+                           " in " + object.name);
+}
+
+void Loader::store(const LoadedObject &object, uint64_t addr,
+                   uint64_t value) {
+  uint8_t *p = addr >= object.start && object.end - addr >= 8
+                   ? memory.translate(addr, 8)
+                   : nullptr;
+  if (!p) {
+    throw std::runtime_error("Relocation outside its object in " +
+                             object.name);
+  }
+  std::memcpy(p, &value, 8);
+}
+
+void Loader::relocate(size_t index) {
+  using elf::DynamicEntry;
+  LoadedObject &object = *objects[index];
+  const elf::ELF &elf = *object.elf;
+  const uint64_t bias = object.bias;
+
+  // In flat memory the whole object is one host range, so relocations are
+  // plain stores into it; otherwise each goes through translate().
+  uint8_t *image = memory.translate(object.start, object.end - object.start);
+  auto put = [&](uint64_t offset, uint64_t value) {
+    uint64_t addr = offset + bias;
+    if (image && addr >= object.start && object.end - addr >= 8) {
+      std::memcpy(image + (addr - object.start), &value, 8);
+    } else {
+      store(object, addr, value);
+    }
+  };
+
+  auto rela = elf.dynamicValue(DynamicEntry::DT_RELA);
+  auto relaSize = elf.dynamicValue(DynamicEntry::DT_RELASZ);
+  if (rela && relaSize) {
+    auto relocs = elf.relocations(*rela, *relaSize);
+    // The linker sorts the R_RISCV_RELATIVE ones first and counts them.
+    size_t relative = std::min<size_t>(
+        elf.dynamicValue(DynamicEntry::DT_RELACOUNT).value_or(0),
+        relocs.size());
+    for (size_t i = 0; i < relative; i++) {
+      if (relocs[i].type != R_RISCV_RELATIVE) {
+        relative = i;
+        break;
+      }
+      put(relocs[i].offset, bias + relocs[i].addend);
+    }
+    for (size_t i = relative; i < relocs.size(); i++) {
+      const auto &r = relocs[i];
+      switch (r.type) {
+      case R_RISCV_NONE:
+        break;
+      case R_RISCV_RELATIVE:
+        put(r.offset, bias + r.addend);
+        break;
+      case R_RISCV_64:
+        put(r.offset, symbolValue(object, r.symbol) + r.addend);
+        break;
+      case R_RISCV_JUMP_SLOT:
+        put(r.offset, symbolValue(object, r.symbol));
+        break;
+      default:
+        throw std::runtime_error("Unsupported relocation type " +
+                                 std::to_string(r.type) + " in " +
+                                 object.name);
+      }
+    }
+  }
+
+  auto jmpRel = elf.dynamicValue(DynamicEntry::DT_JMPREL);
+  auto pltRelSize = elf.dynamicValue(DynamicEntry::DT_PLTRELSZ);
+  if (jmpRel && pltRelSize) {
+    object.pltRelocations = elf.relocations(*jmpRel, *pltRelSize);
+  }
+  if (auto pltGot = elf.dynamicValue(DynamicEntry::DT_PLTGOT)) {
+    object.pltGot = *pltGot + bias;
+  }
+  bool lazy = options.lazy && object.pltGot &&
+              !elf.dynamicValue(DynamicEntry::DT_BIND_NOW) &&
+              !(elf.dynamicValue(DynamicEntry::DT_FLAGS).value_or(0) &
+                DF_BIND_NOW);
+
+  for (const auto &r : object.pltRelocations) {
+    if (r.type != R_RISCV_JUMP_SLOT) {
+      throw std::runtime_error("Unsupported PLT relocation type " +
+                               std::to_string(r.type) + " in " + object.name);
+    }
+    if (!lazy) {
+      put(r.offset, symbolValue(object, r.symbol));
+      continue;
+    }
+    // Unbound slots hold the link-time address of the PLT header.
+    const uint8_t *slot = memory.translate(r.offset + bias, 8);
+    uint64_t header;
+    if (!slot) {
+      throw std::runtime_error("PLT slot outside its object in " +
+                               object.name);
+    }
+    std::memcpy(&header, slot, 8);
+    put(r.offset, header + bias);
+  }
+  if (lazy) {
+    // The PLT header jumps to GOT[0] with GOT[1] in t0.
+    store(object, object.pltGot, kLazyBindAddress);
+    store(object, object.pltGot + 8, index);
+  }
+
+  memory.noteHostWrite(object.start, object.end - object.start);
+  object.relocated = true;
+}
+
+void Loader::link() {
+  for (size_t i = 0; i < objects.size(); i++) {
+    if (!objects[i]->relocated) {
+      relocate(i);
+    }
+  }
+}
+
+void Loader::mapStack(size_t size) {
+  size = pageUp(size);
+  memory.mapStack(next, size);
+  next += size + Memory::kPageSize;
+}
+
+bool Loader::bind(Hart &hart) {
+  constexpr uint8_t kT0 = 5, kT1 = 6;
+  if (hart.pc != kLazyBindAddress || hart.x[kT0] >= objects.size()) {
+    return false;
+  }
+  const LoadedObject &object = *objects[hart.x[kT0]];
+
+  // t1 is the offset of the slot past the two reserved GOT words.
+  uint64_t slot = object.pltGot + 16 + hart.x[kT1];
+  const auto &relocs = object.pltRelocations;
+  size_t n = hart.x[kT1] / 8;
+  if (n >= relocs.size() || relocs[n].offset + object.bias != slot) {
+    auto it = std::find_if(relocs.begin(), relocs.end(), [&](const auto &r) {
+      return r.offset + object.bias == slot;
+    });
+    if (it == relocs.end()) {
+      return false;
+    }
+    n = it - relocs.begin();
+  }
+
+  uint64_t target = symbolValue(object, relocs[n].symbol);
+  store(object, slot, target);
+  hart.pc = target;
+  lazyBinds++;
+  return true;
+}
+
+} // namespace riscy::vm
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "elf.h"
+#include "execute.h"
+#include "hart.h"
+#include "interp.h"
+#include "memory.h"
+
+namespace riscy::vm {
+
+// Resolver address planted in GOT[0] of each lazily bound object. Like
+// kReturnAddress it is never backed by guest memory, so the first call
+// through an unbound PLT entry stops the run with a FetchFault here, for
+// Loader::bind() to service.
+constexpr uint64_t kLazyBindAddress = 0xFFFF'FFFF'FFFF'FFE0;
+
+// An ELF object mapped into guest memory.
+struct LoadedObject {
+  std::string name;
+  std::shared_ptr<elf::ELF> elf;
+  // Load address minus link-time address (0 for executables).
+  uint64_t bias = 0;
+  // Mapped range, page-aligned.
+  uint64_t start = 0, end = 0;
+  // DT_NEEDED names.
+  std::vector<std::string> needed;
+  // DT_PLTGOT, relocated; 0 if the object has no PLT.
+  uint64_t pltGot = 0;
+  // .rela.plt, read when the object was relocated; lazy binds index it.
+  std::vector<elf::Relocation> pltRelocations;
+  bool relocated = false;
+
+  // Guest address of the object's own definition of `name`, if it exports
+  // one.
+  [[nodiscard]] std::optional<uint64_t> lookup(std::string_view name) const;
+};
+
+struct LoaderOptions {
+  // Bind PLT entries on first call rather than in link().
+  bool lazy = true;
+  // Directories searched for DT_NEEDED libraries by loadFile().
+  std::vector<std::string> searchPath;
+};
+
+// Maps ELF objects into one address space and links them the way ld.so
+// does: shared objects go at increasing page-aligned bases from `base`
+// (executables at their own addresses), their R_RISCV_RELATIVE, _64 and
+// _JUMP_SLOT relocations are applied table by table, and symbol imports
+// resolve to the first object, in load order, whose dynamic symbol index
+// defines them.
+//
+// With lazy binding, .got.plt slots initially lead to kLazyBindAddress (see
+// runLinked()), and each import is resolved only when first called.
+class Loader {
+private:
+  Memory &memory;
+  LoaderOptions options;
+  std::vector<std::unique_ptr<LoadedObject>> objects;
+  uint64_t next;
+
+  // Import name -> address, so that each symbol is searched for once.
+  std::unordered_map<std::string, uint64_t> resolved;
+  uint64_t lazyBinds = 0;
+
+  // Address the symbol table entry `index` of `object` refers to.
+  [[nodiscard]] uint64_t symbolValue(const LoadedObject &object,
+                                     uint32_t index);
+  void relocate(size_t index);
+  void store(const LoadedObject &object, uint64_t addr, uint64_t value);
+
+public:
+  Loader(Memory &memory, uint64_t base, LoaderOptions options = {});
+
+  // Maps `elf` and returns its index. It is relocated by the next link().
+  size_t load(std::shared_ptr<elf::ELF> elf, std::string name);
+
+  // Maps the file at `path`, then, breadth first, every DT_NEEDED library
+  // not loaded yet, found in options.searchPath. Returns the index of
+  // `path`'s object.
+  size_t loadFile(const std::string &path);
+
+  // Applies the relocations of every object loaded since the last call.
+  // Throws if an import is defined nowhere (weak ones resolve to 0).
+  void link();
+
+  // Maps a stack of `size` bytes above everything loaded so far (past an
+  // unmapped guard page) and makes it memory.stackTop().
+  void mapStack(size_t size);
+
+  // Address of the first definition of `name` in load order.
+  [[nodiscard]] std::optional<uint64_t> resolve(std::string_view name);
+
+  // Services a stop at kLazyBindAddress: binds the .got.plt slot of the PLT
+  // entry that led there and continues at its target. Returns false if the
+  // hart is not stopped at a lazy bind.
+  bool bind(Hart &hart);
+
+  [[nodiscard]] inline size_t size() const { return objects.size(); }
+  [[nodiscard]] inline const LoadedObject &object(size_t i) const {
+    return *objects[i];
+  }
+  // Imports resolved by bind() so far.
+  [[nodiscard]] inline uint64_t lazyBindCount() const { return lazyBinds; }
+};
+
+// Runs `engine` (an Interpreter or a Jit) from hart.pc, binding PLT entries
+// through `loader` as they are first called, until any other stop or
+// `maxSteps` retired instructions.
+template <typename Engine>
+RunResult runLinked(Engine &engine, Hart &hart, Loader &loader,
+                    uint64_t maxSteps = std::numeric_limits<uint64_t>::max()) {
+  uint64_t steps = 0;
+  for (;;) {
+    RunResult r = engine.run(maxSteps - steps);
+    steps += r.steps;
+    if (r.reason != StopReason::FetchFault || r.pc != kLazyBindAddress ||
+        !loader.bind(hart)) {
+      return {r.reason, r.pc, steps};
+    }
+  }
+}
+
+} // namespace riscy::vm
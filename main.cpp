@@ -1,26 +1,81 @@
+#include <cassert>
 #include <cstdint>
-#include <fstream>
-#include <iomanip>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <optional>
+#include <string>
 #include <vector>
 
 #include "buffer.h"
+#include "cfg.h"
+#include "codegen.h"
+#include "disasm.h"
 #include "elf.h"
-#include "risc.h"
+#include "interp.h"
+#include "jit.h"
+#include "memory.h"
+#include "output.h"
+#include "syscalls.h"
+#include "thread_group.h"
+#include "translation_cache.h"
 
-int main() {
-  std::ifstream is("examples/quad.so", std::ios_base::binary | std::ios::ate);
-  assert(is.is_open());
+extern char **environ;
 
-  std::streamsize ss = is.tellg();
-  is.seekg(0, std::ios::beg);
+namespace {
 
-  std::vector<uint8_t> vec(static_cast<size_t>(ss));
-  if (!is.read(reinterpret_cast<char *>(vec.data()), ss)) {
-    throw std::ios_base::failure("failed to read");
+// Runs the static RV64 Linux executable argv[0] with the given arguments and
+// the host's environment; returns its exit status. RISCY_STRACE=1 traces
+// its system calls to stderr, and RISCY_CACHE=<dir> keeps its decoded
+// blocks there for the next run. Guest threads run on host threads.
+int runExecutable(int argc, char **argv) {
+  auto buf = riscy::buffer::Buffer::map(argv[0]);
+  auto elf = riscy::elf::readELF(buf);
+  if (!elf) {
+    std::cerr << "Failed to read ELF!" << std::endl;
+    return 1;
   }
 
-  riscy::buffer::Buffer buf(std::move(vec));
+  auto memory = riscy::vm::Memory::fromELF(*elf, 8 << 20,
+                                           riscy::vm::Memory::Mode::Flat,
+                                           256 << 20);
+  riscy::vm::Linux os(memory, std::getenv("RISCY_STRACE") ? stderr : nullptr);
+  riscy::vm::ThreadGroup<riscy::vm::Jit> process(memory, os);
+  std::vector<std::string> args(argv, argv + argc), env;
+  for (char **e = environ; *e; e++) {
+    env.emplace_back(*e);
+  }
+  riscy::vm::prepareProcess(process.mainHart(), memory, *elf, args, env);
+
+  // Threads the guest starts get caches of their own, in memory only.
+  auto &blocks = process.mainEngine().interpreter().blockCache();
+  std::optional<riscy::cache::TranslationCache> cache;
+  if (const char *dir = std::getenv("RISCY_CACHE")) {
+    cache.emplace(dir);
+    blocks.attach(&*cache, riscy::cache::hash(buf.span()));
+  }
+  auto result = process.run();
+  if (cache) {
+    blocks.persist(memory);
+  }
+  if (result.reason != riscy::vm::StopReason::Exited) {
+    std::cerr << argv[0] << " stopped: "
+              << riscy::vm::StopReasonNames[(int)result.reason] << " at 0x"
+              << std::hex << result.pc << std::endl;
+    return 128;
+  }
+  return os.exitCode();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  // ./riscy <executable> [args...]
+  if (argc > 1) {
+    return runExecutable(argc - 1, argv + 1);
+  }
+
+  auto buf = riscy::buffer::Buffer::map("examples/quad.so");
 
   auto elf = riscy::elf::readELF(buf);
   if (!elf) {
@@ -28,29 +83,86 @@ int main() {
     return 1;
   }
 
-  std::cout << "Read ELF file OK.\n";
-
-  std::cout << std::dec;
+  riscy::output::Writer out;
+  out.print("Read ELF file OK.\n");
 
   auto text = elf->getSectionByName(".text");
-  std::cout << "Found .text section: " << text->size << " bytes\n";
+  out.print("Found .text section: {} bytes\n", text->size);
 
   auto symt = elf->getSymbolTable();
-  std::cout << "Found symbol table: " << symt->size << " bytes\n";
+  out.print("Found symbol table: {} bytes\n", symt->size);
+
+  out.print("Disassembly:");
+  riscy::disasm::disassemble(*elf, out);
+  out.print("\n");
 
   auto pos = elf->getSymbolLocation("quad").value();
-  std::cout << "Found symbol 'quad' at position " << pos.value << " with size "
-            << pos.size << std::endl;
-
-  buf.seek(pos.value);
-  for (int i = 0; i < pos.size; i += 4) {
-    auto instr_int = buf.pop_u32();
-    std::cout << std::hex << std::setfill('0') << std::setw(8) << instr_int
-              << " " << std::dec;
-    auto instr = riscy::risc::decode_instr(instr_int);
-    std::cout << "\t";
-    instr->operator<<(std::cout) << "\n";
-    std::cout << "\t" << instr->to_string() << "\n";
-    // std::cout << (uint32_t)buf.pop_u8() << " ";
+  out.print("Found symbol 'quad' at position {} with size {}\n", pos.value,
+            pos.size);
+
+  auto section = elf->getSectionContaining(pos.value);
+  assert(section);
+  auto code = section->buffer.span().subspan(pos.value - section->virtAddr,
+                                             pos.size);
+  riscy::disasm::disassembleFunction(out, riscy::disasm::Style::PseudoC,
+                                     "quad", pos.value, code);
+
+  auto cfg = riscy::cfg::buildCFG(pos.value, code);
+  cfg.name = "quad";
+  out.print("CFG: {} blocks, {} edges, {} calls\n", cfg.blocks.size(),
+            cfg.succs.size(), cfg.calls.size());
+  for (uint32_t i = 0; i < cfg.blocks.size(); i++) {
+    out.print("  block {} @ {:#x} ({} instrs) ->", i, cfg.blocks[i].start,
+              cfg.blocks[i].instrCount);
+    for (uint32_t s : cfg.successors(i)) {
+      out.print(" {}", s);
+    }
+    out.print("\n");
+  }
+
+  // RISCY_CACHE=<dir> keeps translations there between runs (see
+  // translation_cache.h).
+  const char *cacheDir = std::getenv("RISCY_CACHE");
+  std::string c;
+  if (cacheDir) {
+    riscy::cache::TranslationCache cache(cacheDir);
+    riscy::codegen::emitFunctionCached(c, cache, riscy::cache::hash(buf.span()),
+                                       "quad", pos.value, code, {});
+  } else {
+    riscy::codegen::emitFunction(c, cfg, {});
+  }
+  out.write(c);
+
+  auto memory = riscy::vm::Memory::fromELF(*elf);
+  riscy::vm::Hart hart;
+  riscy::vm::Interpreter interp(hart, memory);
+  const uint64_t args[] = {5};
+  auto result = interp.call(pos.value, args);
+  if (result.reason != riscy::vm::StopReason::Returned) {
+    out.flush();
+    std::cerr << "quad(5) stopped: "
+              << riscy::vm::StopReasonNames[(int)result.reason] << " at 0x"
+              << std::hex << result.pc << std::endl;
+    return 1;
+  }
+  out.print("quad(5) = {} ({} instructions)\n",
+            (int64_t)hart.x[riscy::vm::Hart::kA0], result.steps);
+
+  // RISCY_PROFILE=<file> reruns the call under the profiler and writes its
+  // samples there as folded stacks (e.g. for flamegraph.pl).
+  if (const char *path = std::getenv("RISCY_PROFILE")) {
+    riscy::vm::Profiler profiler({.samplePeriod = 1});
+    interp.callWith(profiler, pos.value, args);
+    std::FILE *file = std::fopen(path, "w");
+    if (!file) {
+      std::perror(path);
+      return 1;
+    }
+    {
+      riscy::output::Writer folded(file);
+      profiler.writeSamples(folded, &elf->symbols());
+      folded.flush();
+    }
+    std::fclose(file);
   }
 }
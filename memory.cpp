@@ -0,0 +1,400 @@
+#include "memory.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <system_error>
+
+#include "elf.h"
+
+namespace riscy::vm {
+
+void Memory::Unmap::operator()(uint8_t *p) const { munmap(p, size); }
+
+Memory::Memory(uint64_t base, size_t size)
+    : _mode(Mode::Flat), _base(base), _size(size),
+      _code((size + kPageSize - 1) >> kPageShift, 0) {
+  if (size == 0) {
+    return;
+  }
+  // Pages the guest never touches are never committed.
+  void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (addr == MAP_FAILED) {
+    throw std::system_error(errno, std::generic_category(),
+                            "Failed to reserve guest memory");
+  }
+  _flat = {static_cast<uint8_t *>(addr), Unmap{size}};
+}
+
+Memory Memory::fromELF(const elf::ELF &elf, size_t stackSize, Mode mode,
+                       size_t heapSize) {
+  using Segment = elf::ProgramHeaderEntry;
+
+  uint64_t lo = UINT64_MAX, hi = 0;
+  for (const auto &ph : elf.programHeaders()) {
+    if (ph->type != Segment::SegmentType::Loadable) {
+      continue;
+    }
+    lo = std::min(lo, ph->virtAddr);
+    hi = std::max(hi, ph->virtAddr + ph->sizeInMemory);
+  }
+  if (lo > hi) {
+    throw std::runtime_error("No loadable segments");
+  }
+
+  lo &= ~(kPageSize - 1);
+  hi = (hi + kPageSize - 1) & ~(kPageSize - 1);
+  heapSize = (heapSize + kPageSize - 1) & ~(kPageSize - 1);
+
+  Memory mem(mode);
+  uint64_t stackBase = hi + heapSize;
+  if (mode == Mode::Flat) {
+    mem = Memory(lo, stackBase - lo + stackSize);
+  } else {
+    stackBase += kPageSize;
+  }
+  mem.mapStack(stackBase, stackSize);
+  mem.loadSegments(elf);
+  mem._heapBase = hi;
+  mem._heapEnd = hi + heapSize;
+  return mem;
+}
+
+void Memory::loadSegments(const elf::ELF &elf, uint64_t bias) {
+  using Segment = elf::ProgramHeaderEntry;
+
+  for (const auto &ph : elf.programHeaders()) {
+    if (ph->type != Segment::SegmentType::Loadable) {
+      continue;
+    }
+    if (ph->size > ph->sizeInMemory ||
+        ph->fileOffset + ph->size > elf.file.size()) {
+      throw std::runtime_error("Loadable segment out of bounds");
+    }
+    uint8_t perms = (ph->flags & Segment::PF_R ? kRead : 0) |
+                    (ph->flags & Segment::PF_W ? kWrite : 0) |
+                    (ph->flags & Segment::PF_X ? kExec : 0);
+    uint64_t addr = ph->virtAddr + bias;
+    map(addr, ph->sizeInMemory, perms);
+    if (!poke(addr, elf.file.span().subspan(ph->fileOffset, ph->size))) {
+      throw std::runtime_error("Loadable segment out of bounds");
+    }
+  }
+}
+
+void Memory::mapStack(uint64_t base, size_t size) {
+  map(base, size, kRead | kWrite);
+  _stackTop = (base + size) & ~uint64_t(15);
+}
+
+Memory::PageEntry *Memory::entry(uint64_t vpn) const {
+  if (vpn >= kMaxAddress >> kPageShift) {
+    return nullptr;
+  }
+  const auto &middle = _root[vpn >> (2 * kLevelBits)];
+  if (!middle) {
+    return nullptr;
+  }
+  const auto &leaf = (*middle)[(vpn >> kLevelBits) & ((1 << kLevelBits) - 1)];
+  if (!leaf) {
+    return nullptr;
+  }
+  return &(*leaf)[vpn & ((1 << kLevelBits) - 1)];
+}
+
+Memory::PageEntry &Memory::createEntry(uint64_t vpn) {
+  auto &middle = _root[vpn >> (2 * kLevelBits)];
+  if (!middle) {
+    middle = std::make_unique<Middle>();
+  }
+  auto &leaf = (*middle)[(vpn >> kLevelBits) & ((1 << kLevelBits) - 1)];
+  if (!leaf) {
+    leaf = std::make_unique<Leaf>();
+  }
+  return (*leaf)[vpn & ((1 << kLevelBits) - 1)];
+}
+
+void Memory::flushTlb() { _tlb.fill(TlbEntry{}); }
+
+void Memory::map(uint64_t addr, size_t size, uint8_t perms) {
+  if (size == 0) {
+    return;
+  }
+  uint64_t first = addr & ~(kPageSize - 1);
+  uint64_t last = (addr + size + kPageSize - 1) & ~(kPageSize - 1);
+  if (last < first || last > kMaxAddress) {
+    throw std::out_of_range("Mapping outside the guest address space");
+  }
+
+  if (isFlat()) {
+    if (first < _base || last - _base > _size) {
+      throw std::out_of_range("Mapping outside the flat reservation");
+    }
+    return;
+  }
+
+  // Back the whole range with one allocation; pages that are already
+  // mapped keep their storage and leave a hole in it.
+  size_t bytes = last - first;
+  auto chunk = std::make_unique<uint8_t[]>(bytes);
+  for (uint64_t page = first; page < last; page += kPageSize) {
+    PageEntry &e = createEntry(page >> kPageShift);
+    if (!e.host) {
+      e.host = chunk.get() + (page - first);
+    }
+    e.perms |= perms;
+  }
+  _chunks.push_back(std::move(chunk));
+
+  if (_size == 0) {
+    _base = first;
+    _size = last - first;
+  } else {
+    uint64_t hi = std::max(_base + _size, last);
+    _base = std::min(_base, first);
+    _size = hi - _base;
+  }
+  flushTlb();
+}
+
+bool Memory::check(Access access, uint64_t addr, size_t n) const {
+  static constexpr uint8_t kNeeded[] = {kRead, kWrite, kExec};
+  if (n == 0) {
+    return true;
+  }
+  uint64_t end = addr + n;
+  if (end < addr) {
+    return false;
+  }
+  for (uint64_t page = addr & ~(kPageSize - 1); page < end;
+       page += kPageSize) {
+    uint64_t vpn = page >> kPageShift;
+    const PageEntry *e = entry(vpn);
+    if (!e || !e->host || !(e->perms & kNeeded[access])) {
+      return false;
+    }
+    TlbEntry &t = _tlb[vpn & (kTlbSize - 1)];
+    uint64_t addend = reinterpret_cast<uint64_t>(e->host) - page;
+    if (t.addend != addend) {
+      t = TlbEntry{};
+      t.addend = addend;
+    }
+    if (access != kStore || !e->code) {
+      t.tag[access] = vpn;
+    }
+  }
+  return true;
+}
+
+void Memory::copyOut(uint64_t addr, std::span<uint8_t> out) const {
+  while (!out.empty()) {
+    uint64_t inPage = kPageSize - (addr & (kPageSize - 1));
+    size_t n = std::min<uint64_t>(inPage, out.size());
+    const PageEntry *e = entry(addr >> kPageShift);
+    std::memcpy(out.data(), e->host + (addr & (kPageSize - 1)), n);
+    addr += n;
+    out = out.subspan(n);
+  }
+}
+
+void Memory::copyIn(uint64_t addr, std::span<const uint8_t> bytes) {
+  while (!bytes.empty()) {
+    uint64_t inPage = kPageSize - (addr & (kPageSize - 1));
+    size_t n = std::min<uint64_t>(inPage, bytes.size());
+    PageEntry *e = entry(addr >> kPageShift);
+    std::memcpy(e->host + (addr & (kPageSize - 1)), bytes.data(), n);
+    if (e->code) {
+      e->code = false;
+      logCodeWrite(addr & ~(kPageSize - 1));
+    }
+    addr += n;
+    bytes = bytes.subspan(n);
+  }
+}
+
+bool Memory::poke(uint64_t addr, std::span<const uint8_t> bytes) {
+  if (isFlat()) {
+    uint8_t *p = flat(addr, bytes.size());
+    if (!p) {
+      return false;
+    }
+    std::memcpy(p, bytes.data(), bytes.size());
+    noteWrite(p - _flat.get(), bytes.size());
+    return true;
+  }
+  uint64_t end = addr + bytes.size();
+  for (uint64_t page = addr & ~(kPageSize - 1); page < end;
+       page += kPageSize) {
+    const PageEntry *e = entry(page >> kPageShift);
+    if (!e || !e->host) {
+      return false;
+    }
+  }
+  copyIn(addr, bytes);
+  return true;
+}
+
+uint8_t *Memory::translate(uint64_t addr, size_t n) {
+  if (isFlat()) {
+    return flat(addr, n);
+  }
+  if (uint8_t *p = cached(kLoad, addr, n)) {
+    return p;
+  }
+  const PageEntry *first = entry(addr >> kPageShift);
+  if (!first || !first->host) {
+    return nullptr;
+  }
+  uint8_t *host = first->host + (addr & (kPageSize - 1));
+  uint64_t end = addr + n;
+  if (end < addr) {
+    return nullptr;
+  }
+  for (uint64_t page = (addr & ~(kPageSize - 1)) + kPageSize; page < end;
+       page += kPageSize) {
+    const PageEntry *e = entry(page >> kPageShift);
+    if (!e || e->host != host + (page - addr)) {
+      return nullptr;
+    }
+  }
+  return host;
+}
+
+bool Memory::permits(uint64_t addr, size_t n, uint8_t perms) const {
+  if (isFlat()) {
+    return flat(addr, n) != nullptr;
+  }
+  uint64_t end = addr + n;
+  if (end < addr) {
+    return false;
+  }
+  for (uint64_t page = addr & ~(kPageSize - 1); page < end;
+       page += kPageSize) {
+    const PageEntry *e = entry(page >> kPageShift);
+    if (!e || !e->host || (e->perms & perms) != perms) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Memory::noteHostWrite(uint64_t addr, size_t n) {
+  if (isFlat()) {
+    if (flat(addr, n)) {
+      noteWrite(addr - _base, n);
+    }
+    return;
+  }
+  uint64_t end = addr + n;
+  for (uint64_t page = addr & ~(kPageSize - 1); page < end;
+       page += kPageSize) {
+    PageEntry *e = entry(page >> kPageShift);
+    if (e && e->code) {
+      e->code = false;
+      logCodeWrite(page);
+    }
+  }
+}
+
+uint8_t *Memory::atomic(uint64_t addr, size_t n, bool write) {
+  uint8_t *p;
+  if (isFlat()) {
+    p = flat(addr, n);
+    if (p && write) {
+      noteWrite(p - _flat.get(), n);
+    }
+  } else {
+    Access access = write ? kStore : kLoad;
+    p = cached(access, addr, n);
+    if (!p && check(access, addr, n)) {
+      if (write) {
+        noteHostWrite(addr, n);
+      }
+      p = translate(addr, n);
+    }
+  }
+  // Host atomics need the natural alignment too.
+  if (!p || ((addr | reinterpret_cast<uintptr_t>(p)) & (n - 1))) {
+    return nullptr;
+  }
+  return p;
+}
+
+void Memory::logCodeWrite(uint64_t pageAddr) {
+  std::lock_guard guard(_dirty->lock);
+  auto &pages = _dirty->pages;
+  if (pages.size() == kDirtyLogSize) {
+    pages.erase(pages.begin(), pages.begin() + kDirtyLogSize / 2);
+    _dirty->dropped += kDirtyLogSize / 2;
+  }
+  pages.push_back(pageAddr);
+  _dirty->count.store(_dirty->dropped + pages.size(),
+                      std::memory_order_release);
+}
+
+std::optional<std::vector<uint64_t>>
+Memory::dirtyCodeSince(uint64_t &seen) const {
+  std::lock_guard guard(_dirty->lock);
+  const auto &pages = _dirty->pages;
+  uint64_t from = seen;
+  seen = _dirty->dropped + pages.size();
+  if (from < _dirty->dropped) {
+    return std::nullopt;
+  }
+  return std::vector<uint64_t>(pages.begin() + (from - _dirty->dropped),
+                               pages.end());
+}
+
+bool Memory::read(uint64_t addr, std::span<uint8_t> out) const {
+  if (isFlat()) {
+    const uint8_t *p = flat(addr, out.size());
+    if (!p) {
+      return false;
+    }
+    std::memcpy(out.data(), p, out.size());
+    return true;
+  }
+  if (!check(kLoad, addr, out.size())) {
+    return false;
+  }
+  copyOut(addr, out);
+  return true;
+}
+
+bool Memory::write(uint64_t addr, std::span<const uint8_t> bytes) {
+  if (isFlat()) {
+    return poke(addr, bytes);
+  }
+  // Check every page before writing any, so that a faulting store leaves
+  // memory unchanged.
+  if (!check(kStore, addr, bytes.size())) {
+    return false;
+  }
+  copyIn(addr, bytes);
+  return true;
+}
+
+void Memory::markCode(uint64_t addr) {
+  if (isFlat()) {
+    uint64_t off = addr - _base;
+    if (off < _size) {
+      codeFlag(off >> kPageShift).store(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+  uint64_t vpn = addr >> kPageShift;
+  PageEntry *e = entry(vpn);
+  if (!e || !e->host) {
+    return;
+  }
+  e->code = true;
+  // Send further stores to the page through the slow path.
+  TlbEntry &t = _tlb[vpn & (kTlbSize - 1)];
+  if (t.tag[kStore] == vpn) {
+    t.tag[kStore] = kNoTag;
+  }
+}
+
+} // namespace riscy::vm
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace riscy::elf {
+struct ELF;
+}
+
+namespace riscy::vm {
+
+// RISC-V is little-endian; guest values are copied to and from host memory
+// verbatim.
+static_assert(std::endian::native == std::endian::little,
+              "guest memory access assumes a little-endian host");
+
+// A guest address space. Accesses to unmapped (or, in paged mode,
+// insufficiently permitted) addresses fail rather than trap, leaving it to
+// the caller to report the fault.
+//
+// A flat address space may be shared by harts on several host threads (see
+// ThreadGroup): guest accesses and code tracking are safe to run
+// concurrently, though map() is not. Paged mode keeps a single TLB and is
+// for one thread only.
+class Memory {
+public:
+  static constexpr uint64_t kPageShift = 12;
+  static constexpr uint64_t kPageSize = uint64_t(1) << kPageShift;
+
+  // Page permissions, as in ELF segment flags but named for guest accesses.
+  enum Perm : uint8_t {
+    kRead = 1,
+    kWrite = 2,
+    kExec = 4,
+  };
+
+  enum class Mode : uint8_t {
+    // One host reservation backs all of [base, base + size): translating an
+    // address is a bounds check and an add. Page permissions are not
+    // enforced.
+    Flat,
+    // Pages are mapped individually through a page table with per-page
+    // permissions; a software TLB caches recent translations.
+    Paged,
+  };
+
+private:
+  // Index into TlbEntry::tag.
+  enum Access : uint8_t { kLoad, kStore, kFetch };
+
+  struct PageEntry {
+    uint8_t *host = nullptr;
+    uint8_t perms = 0;
+    // Set while some pre-decoded copy of the page's instructions exists
+    // (see BlockCache).
+    bool code = false;
+  };
+
+  // The page table mirrors Sv39: three levels of 512 entries over 39-bit
+  // guest addresses. Higher addresses are never mapped.
+  static constexpr unsigned kLevelBits = 9;
+  static constexpr uint64_t kMaxAddress = uint64_t(1)
+                                          << (kPageShift + 3 * kLevelBits);
+  using Leaf = std::array<PageEntry, 1 << kLevelBits>;
+  using Middle = std::array<std::unique_ptr<Leaf>, 1 << kLevelBits>;
+
+  // Direct-mapped TLB, indexed by the low bits of the guest page number.
+  static constexpr size_t kTlbSize = 256;
+  static constexpr uint64_t kNoTag = ~uint64_t(0);
+
+  struct TlbEntry {
+    // Guest page number this entry translates for each kind of access, or
+    // kNoTag if that access has to take the slow path (it isn't permitted,
+    // or it is a store to a code page).
+    std::array<uint64_t, 3> tag{kNoTag, kNoTag, kNoTag};
+    // Host address minus guest address, for the page.
+    uint64_t addend = 0;
+  };
+
+  struct Unmap {
+    size_t size;
+    void operator()(uint8_t *p) const;
+  };
+
+  Mode _mode = Mode::Flat;
+  uint64_t _base = 0;
+  uint64_t _size = 0;
+  uint64_t _stackTop = 0;
+  uint64_t _heapBase = 0;
+  uint64_t _heapEnd = 0;
+
+  // Flat mode.
+  std::unique_ptr<uint8_t[], Unmap> _flat;
+  // One flag per page, as PageEntry::code.
+  std::vector<uint8_t> _code;
+
+  // Paged mode.
+  std::array<std::unique_ptr<Middle>, 1 << kLevelBits> _root;
+  std::vector<std::unique_ptr<uint8_t[]>> _chunks;
+  mutable std::array<TlbEntry, kTlbSize> _tlb;
+
+  // Code-page writes, oldest first, for every BlockCache to catch up on at
+  // its own pace. Only the last kDirtyLogSize are kept.
+  static constexpr size_t kDirtyLogSize = 1024;
+  struct DirtyLog {
+    std::mutex lock;
+    std::vector<uint64_t> pages;
+    // Writes recorded before pages.front().
+    uint64_t dropped = 0;
+    // dropped + pages.size(), readable without the lock.
+    std::atomic<uint64_t> count{0};
+  };
+  std::unique_ptr<DirtyLog> _dirty = std::make_unique<DirtyLog>();
+
+  // The code flag of flat-mode page `page`, which other harts may be
+  // setting or clearing.
+  [[nodiscard]] inline std::atomic_ref<uint8_t> codeFlag(uint64_t page) {
+    return std::atomic_ref<uint8_t>(_code[page]);
+  }
+
+  void logCodeWrite(uint64_t pageAddr);
+
+  [[nodiscard]] inline uint8_t *flat(uint64_t addr, size_t n) const {
+    uint64_t off = addr - _base;
+    if (off > _size || _size - off < n) {
+      return nullptr;
+    }
+    return _flat.get() + off;
+  }
+
+  // Host pointer for an access of `n` bytes that the TLB already covers;
+  // nullptr on a miss or if the access crosses a page boundary.
+  [[nodiscard]] inline uint8_t *cached(Access access, uint64_t addr,
+                                       size_t n) const {
+    uint64_t vpn = addr >> kPageShift;
+    const TlbEntry &e = _tlb[vpn & (kTlbSize - 1)];
+    if (e.tag[access] != vpn || (addr & (kPageSize - 1)) + n > kPageSize) {
+      return nullptr;
+    }
+    return reinterpret_cast<uint8_t *>(addr + e.addend);
+  }
+
+  inline void noteWrite(uint64_t off, size_t n) {
+    if (n == 0) {
+      return;
+    }
+    uint64_t first = off >> kPageShift, last = (off + n - 1) >> kPageShift;
+    // Guest stores span at most two pages; bulk writes check every page.
+    if (last - first <= 1 &&
+        !(codeFlag(first).load(std::memory_order_relaxed) |
+          codeFlag(last).load(std::memory_order_relaxed))) [[likely]] {
+      return;
+    }
+    for (uint64_t page = first; page <= last; page++) {
+      if (codeFlag(page).exchange(0, std::memory_order_relaxed)) {
+        logCodeWrite(_base + (page << kPageShift));
+      }
+    }
+  }
+
+  [[nodiscard]] PageEntry *entry(uint64_t vpn) const;
+  [[nodiscard]] PageEntry &createEntry(uint64_t vpn);
+  void flushTlb();
+
+  // Paged-mode slow path: checks `access` on every page of [addr, addr + n)
+  // and fills the TLB. Returns false if any of them is denied.
+  [[nodiscard]] bool check(Access access, uint64_t addr, size_t n) const;
+
+  // Paged-mode copies between guest and host memory, page by page. Callers
+  // must have check()ed the range.
+  void copyOut(uint64_t addr, std::span<uint8_t> out) const;
+  void copyIn(uint64_t addr, std::span<const uint8_t> bytes);
+
+  // Writes to mapped memory regardless of permissions (for loading images).
+  [[nodiscard]] bool poke(uint64_t addr, std::span<const uint8_t> bytes);
+
+public:
+  // An empty address space.
+  explicit Memory(Mode mode = Mode::Flat) : _mode(mode) {}
+
+  // A flat address space backing [base, base + size) with zeroed memory.
+  Memory(uint64_t base, size_t size);
+
+  Memory(Memory &&) = default;
+  Memory &operator=(Memory &&) = default;
+
+  // Lays out every PT_LOAD segment of `elf` at its virtual address, followed
+  // by `heapSize` bytes of room for brk()/mmap() (see heapBase()) and a
+  // zeroed stack of `stackSize` bytes. In paged mode each segment gets the
+  // permissions of its flags, heap pages are left for the caller to map,
+  // and the stack sits above an unmapped guard page.
+  [[nodiscard]] static Memory fromELF(const elf::ELF &elf,
+                                      size_t stackSize = 1 << 20,
+                                      Mode mode = Mode::Flat,
+                                      size_t heapSize = 0);
+
+  // Maps every PT_LOAD segment of `elf` at its virtual address plus `bias`,
+  // with the permissions of its flags, and copies in its file image.
+  void loadSegments(const elf::ELF &elf, uint64_t bias = 0);
+
+  // Maps a zeroed read/write stack over [base, base + size) and makes its
+  // top the stackTop().
+  void mapStack(uint64_t base, size_t size);
+
+  [[nodiscard]] inline Mode mode() const { return _mode; }
+  [[nodiscard]] inline bool isFlat() const { return _mode == Mode::Flat; }
+
+  // Lowest mapped address and the size of the span up to the highest one.
+  [[nodiscard]] inline uint64_t base() const { return _base; }
+  [[nodiscard]] inline size_t size() const { return _size; }
+
+  // Initial (16-byte aligned) stack pointer for code run in this memory.
+  [[nodiscard]] inline uint64_t stackTop() const { return _stackTop; }
+
+  // The page-aligned range fromELF() set aside between the image and the
+  // stack; empty unless it was given a heap size.
+  [[nodiscard]] inline uint64_t heapBase() const { return _heapBase; }
+  [[nodiscard]] inline uint64_t heapEnd() const { return _heapEnd; }
+
+  // Maps the pages covering [addr, addr + size) with `perms` (zeroed, or
+  // keeping their contents and gaining `perms` if already mapped). In flat
+  // mode the range must lie inside the reservation and permissions are
+  // ignored.
+  void map(uint64_t addr, size_t size, uint8_t perms);
+
+  // Host pointer to guest range [addr, addr + n), or nullptr if any part of
+  // it is unmapped or (in paged mode) not contiguous on the host. Accesses
+  // through it bypass permissions and code tracking.
+  [[nodiscard]] uint8_t *translate(uint64_t addr, size_t n);
+
+  [[nodiscard]] inline const uint8_t *translate(uint64_t addr,
+                                                size_t n) const {
+    return const_cast<Memory *>(this)->translate(addr, n);
+  }
+
+  // Whether every page of [addr, addr + n) is mapped with all of `perms`
+  // (in flat mode: lies inside the reservation), for host calls that reach
+  // guest memory through translate().
+  [[nodiscard]] bool permits(uint64_t addr, size_t n, uint8_t perms) const;
+
+  // Reports a write made through translate(), so that pre-decoded copies of
+  // any code in the range are dropped.
+  void noteHostWrite(uint64_t addr, size_t n);
+
+  // Host pointer for an atomic access of `n` bytes (4 or 8) at `addr`,
+  // which must be naturally aligned, readable and, if `write`, writable; the
+  // write is reported as by noteHostWrite(). nullptr if any of that fails.
+  [[nodiscard]] uint8_t *atomic(uint64_t addr, size_t n, bool write);
+
+  [[nodiscard]] bool read(uint64_t addr, std::span<uint8_t> out) const;
+  [[nodiscard]] bool write(uint64_t addr, std::span<const uint8_t> bytes);
+
+  template <typename T>
+  [[nodiscard]] inline bool load(uint64_t addr, T &out) const {
+    const uint8_t *p =
+        isFlat() ? flat(addr, sizeof(T)) : cached(kLoad, addr, sizeof(T));
+    if (!p) [[unlikely]] {
+      return !isFlat() &&
+             read(addr, {reinterpret_cast<uint8_t *>(&out), sizeof(T)});
+    }
+    std::memcpy(&out, p, sizeof(T));
+    return true;
+  }
+
+  template <typename T> [[nodiscard]] inline bool store(uint64_t addr, T v) {
+    if (isFlat()) {
+      uint8_t *p = flat(addr, sizeof(T));
+      if (!p) {
+        return false;
+      }
+      std::memcpy(p, &v, sizeof(T));
+      noteWrite(p - _flat.get(), sizeof(T));
+      return true;
+    }
+    // Stores to code pages always miss, so the hit path needn't track them.
+    if (uint8_t *p = cached(kStore, addr, sizeof(T))) [[likely]] {
+      std::memcpy(p, &v, sizeof(T));
+      return true;
+    }
+    return write(addr, {reinterpret_cast<const uint8_t *>(&v), sizeof(T)});
+  }
+
+  // Reads instruction bits (a halfword or a word), which requires execute
+  // permission.
+  template <typename T>
+  [[nodiscard]] inline bool fetch(uint64_t addr, T &bits) const {
+    if (isFlat()) {
+      return load(addr, bits);
+    }
+    const uint8_t *p = cached(kFetch, addr, sizeof(T));
+    if (!p) {
+      if (!check(kFetch, addr, sizeof(T))) {
+        return false;
+      }
+      copyOut(addr, {reinterpret_cast<uint8_t *>(&bits), sizeof(T)});
+      return true;
+    }
+    std::memcpy(&bits, p, sizeof(T));
+    return true;
+  }
+
+  // Flags the page containing `addr` as holding pre-decoded code, so that
+  // the next write to it is reported by takeDirtyCode().
+  void markCode(uint64_t addr);
+
+  // Number of code-page writes recorded so far.
+  [[nodiscard]] inline uint64_t codeWrites() const {
+    return _dirty->count.load(std::memory_order_acquire);
+  }
+
+  // The per-page code flags set by markCode(), for generated code that
+  // checks them inline before a store. Flat mode only.
+  [[nodiscard]] inline const uint8_t *codePages() const { return _code.data(); }
+
+  // Base addresses of the code pages written after the first `seen` writes
+  // recorded, and sets `seen` to the number recorded now. nullopt if some
+  // of them have been forgotten; the caller must then assume that every
+  // page changed.
+  [[nodiscard]] std::optional<std::vector<uint64_t>>
+  dirtyCodeSince(uint64_t &seen) const;
+};
+
+} // namespace riscy::vm
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <format>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+namespace riscy::output {
+
+// Appends formatted text to `out`. Formatting through a back_inserter
+// appends a character at a time, so short results are formatted on the
+// stack and appended in one go.
+template <typename... Args>
+inline void append(std::string &out,
+                   std::format_string<const Args &...> fmt,
+                   const Args &...args) {
+  char buf[128];
+  auto result = std::format_to_n(buf, sizeof(buf), fmt, args...);
+  if (result.size <= static_cast<std::ptrdiff_t>(sizeof(buf))) {
+    out.append(buf, result.out);
+  } else {
+    std::format_to(std::back_inserter(out), fmt, args...);
+  }
+}
+
+// Text output that is formatted straight into one reusable buffer and
+// handed to a stdio stream in large chunks, instead of going through an
+// ostream an operand at a time.
+class Writer {
+private:
+  std::FILE *file;
+  std::string buf;
+  size_t chunk;
+
+public:
+  explicit Writer(std::FILE *file = stdout, size_t chunk = 1 << 20)
+      : file(file), chunk(chunk) {
+    buf.reserve(chunk + chunk / 4);
+  }
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+
+  // Output still buffered when the Writer goes away is flushed, but errors
+  // are lost; call flush() first to see them.
+  ~Writer() {
+    try {
+      flush();
+    } catch (const std::system_error &) {
+    }
+  }
+
+  // The pending output, for formatters that append to it directly. Call
+  // done() afterwards so that a full buffer gets flushed.
+  [[nodiscard]] inline std::string &buffer() { return buf; }
+
+  inline void done() {
+    if (buf.size() >= chunk) {
+      flush();
+    }
+  }
+
+  template <typename... Args>
+  inline void print(std::format_string<const Args &...> fmt,
+                    const Args &...args) {
+    append(buf, fmt, args...);
+    done();
+  }
+
+  inline void write(std::string_view s) {
+    buf += s;
+    done();
+  }
+
+  inline void flush() {
+    if (buf.empty()) {
+      return;
+    }
+    size_t size = buf.size();
+    size_t n = std::fwrite(buf.data(), 1, size, file);
+    buf.clear();
+    if (n != size || std::fflush(file) != 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "Failed to write output");
+    }
+  }
+};
+
+} // namespace riscy::output
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace riscy::parallel {
+
+[[nodiscard]] inline unsigned defaultThreads() {
+  unsigned n = std::thread::hardware_concurrency();
+  return n ? n : 1;
+}
+
+namespace detail {
+
+// The indices [begin, end) a worker has yet to run. The owner takes from
+// the front; thieves split off the back half.
+struct alignas(64) Range {
+  std::mutex lock;
+  size_t begin = 0;
+  size_t end = 0;
+
+  [[nodiscard]] inline bool take(size_t &index) {
+    std::lock_guard guard(lock);
+    if (begin == end) {
+      return false;
+    }
+    index = begin++;
+    return true;
+  }
+
+  [[nodiscard]] inline bool split(size_t &from, size_t &to) {
+    std::lock_guard guard(lock);
+    if (begin == end) {
+      return false;
+    }
+    from = begin + (end - begin) / 2;
+    to = end;
+    end = from;
+    return true;
+  }
+};
+
+} // namespace detail
+
+// Calls body(i) for every i in [0, count) across up to `threads` threads
+// (0: one per hardware thread), the calling thread included. Each worker
+// starts on a contiguous share of the indices and, once it runs out, steals
+// half of whatever another worker has left, so uneven task costs still
+// balance out. The first exception thrown by `body` is rethrown once every
+// worker has stopped.
+template <typename F>
+void forEach(size_t count, unsigned threads, F &&body) {
+  if (threads == 0) {
+    threads = defaultThreads();
+  }
+  threads = static_cast<unsigned>(std::min<size_t>(threads, count));
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      body(i);
+    }
+    return;
+  }
+
+  std::vector<detail::Range> ranges(threads);
+  for (unsigned t = 0; t < threads; t++) {
+    ranges[t].begin = count * t / threads;
+    ranges[t].end = count * (t + 1) / threads;
+  }
+
+  std::mutex errorLock;
+  std::exception_ptr error;
+
+  auto work = [&](unsigned self) {
+    detail::Range &own = ranges[self];
+    for (;;) {
+      size_t index;
+      while (own.take(index)) {
+        try {
+          body(index);
+        } catch (...) {
+          std::lock_guard guard(errorLock);
+          if (!error) {
+            error = std::current_exception();
+          }
+        }
+      }
+
+      // Ranges only ever shrink, so one pass finding nothing to steal
+      // means every remaining index already has a worker.
+      bool stole = false;
+      for (unsigned i = 1; i < threads && !stole; i++) {
+        size_t from, to;
+        if (ranges[(self + i) % threads].split(from, to)) {
+          std::lock_guard guard(own.lock);
+          own.begin = from;
+          own.end = to;
+          stole = true;
+        }
+      }
+      if (!stole) {
+        return;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  workers.reserve(threads - 1);
+  for (unsigned t = 1; t < threads; t++) {
+    workers.emplace_back(work, t);
+  }
+  work(0);
+  for (auto &w : workers) {
+    w.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+} // namespace riscy::parallel
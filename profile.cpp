@@ -0,0 +1,94 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <string>
+
+namespace riscy::vm {
+
+namespace {
+
+// `addr` as "symbol" or "symbol+0x1c", or "0x1234" outside any symbol.
+void appendFrame(std::string &out, uint64_t addr,
+                 const elf::SymbolIndex *symbols) {
+  const elf::Symbol *sym = symbols ? symbols->findByAddress(addr) : nullptr;
+  if (!sym || sym->name.empty()) {
+    output::append(out, "{:#x}", addr);
+  } else if (addr == sym->value) {
+    out.append(sym->name);
+  } else {
+    output::append(out, "{}+{:#x}", sym->name, addr - sym->value);
+  }
+}
+
+// Start address of the function containing `addr`, as far as the symbols
+// tell.
+uint64_t functionOf(uint64_t addr, const elf::SymbolIndex *symbols) {
+  const elf::Symbol *sym = symbols ? symbols->findByAddress(addr) : nullptr;
+  return sym ? sym->value : addr;
+}
+
+} // namespace
+
+void Profiler::sample(const Block &block, size_t index) {
+  uint64_t pc = block.start;
+  for (size_t i = 0; i < index; i++) {
+    pc += block.instrs[i].length;
+  }
+  std::vector<uint64_t> key = stack;
+  key.push_back(pc);
+  samples[std::move(key)]++;
+}
+
+void Profiler::writeSamples(output::Writer &out,
+                            const elf::SymbolIndex *symbols) const {
+  for (const auto &[frames, count] : samples) {
+    std::string &buf = out.buffer();
+    for (size_t i = 0; i < frames.size(); i++) {
+      if (i) {
+        buf.push_back(';');
+      }
+      appendFrame(buf, frames[i], symbols);
+    }
+    output::append(buf, " {}\n", count);
+    out.done();
+  }
+}
+
+void Profiler::writeBlocks(output::Writer &out,
+                           const elf::SymbolIndex *symbols) const {
+  // Sorted by address, so that the output does not depend on hashing.
+  std::vector<std::pair<uint64_t, BlockCount>> sorted(blocks.begin(),
+                                                      blocks.end());
+  std::sort(sorted.begin(), sorted.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+  for (const auto &[start, count] : sorted) {
+    std::string &buf = out.buffer();
+    appendFrame(buf, functionOf(start, symbols), symbols);
+    buf.push_back(';');
+    appendFrame(buf, start, symbols);
+    output::append(buf, " {}\n", count.instrs);
+    out.done();
+  }
+}
+
+void Profiler::writeOps(output::Writer &out) const {
+  for (size_t i = 0; i < ops.size(); i++) {
+    if (ops[i] == 0) {
+      continue;
+    }
+    auto op = static_cast<risc::Op>(i);
+    out.print("{};{} {}\n", risc::InstrTypeNames[risc::majorOpcode(op)],
+              risc::mnemonic(op), ops[i]);
+  }
+}
+
+void Profiler::clear() {
+  blocks.clear();
+  ops.fill(0);
+  stack.clear();
+  untracked = 0;
+  samples.clear();
+  untilSample = options.samplePeriod;
+}
+
+} // namespace riscy::vm
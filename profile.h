@@ -0,0 +1,156 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include "block_cache.h"
+#include "decode.h"
+#include "output.h"
+#include "symbols.h"
+
+namespace riscy::vm {
+
+// Profiler for Interpreter::runWith() that does nothing. The interpreter
+// only calls profiler hooks when `enabled` is set, so running with this one
+// compiles to the same loop as plain run().
+struct NoProfiler {
+  static constexpr bool enabled = false;
+
+  inline void enter(uint64_t) {}
+  inline void block(const Block &, size_t, uint64_t) {}
+};
+
+struct ProfileOptions {
+  // Retired instructions between stack samples; 0 disables sampling.
+  uint64_t samplePeriod = 1000;
+  // Deepest shadow call stack tracked. Calls beyond it are counted but not
+  // recorded, so their returns still pair up.
+  size_t maxDepth = 1024;
+};
+
+// Guest profile of interpreted execution: per-block entry and instruction
+// counts, a per-Op histogram, and (call stack, pc) samples taken every
+// samplePeriod instructions.
+//
+// Call stacks come from a shadow stack of function entry addresses: a jal or
+// jalr linking through ra or t0 pushes its target, a jalr through ra or t0
+// that discards the link pops. Tail calls therefore show up as the caller.
+class Profiler {
+public:
+  static constexpr bool enabled = true;
+
+  struct BlockCount {
+    // Times control entered the block, and instructions retired in it.
+    uint64_t entries = 0;
+    uint64_t instrs = 0;
+  };
+
+private:
+  ProfileOptions options;
+  std::unordered_map<uint64_t, BlockCount> blocks;
+  std::array<uint64_t, static_cast<size_t>(risc::Op::_count)> ops{};
+
+  // Function entries, outermost first, and calls made beyond maxDepth.
+  std::vector<uint64_t> stack;
+  size_t untracked = 0;
+
+  // Call stack with the sampled pc appended -> samples.
+  std::map<std::vector<uint64_t>, uint64_t> samples;
+  // Instructions left until the next sample, at least 1 while sampling.
+  uint64_t untilSample;
+
+  void sample(const Block &block, size_t index);
+
+public:
+  explicit Profiler(ProfileOptions options = {})
+      : options(options), untilSample(options.samplePeriod) {}
+
+  // A new call to `entry` starts; the shadow stack is reset to it alone.
+  inline void enter(uint64_t entry) {
+    stack.assign(1, entry);
+    untracked = 0;
+  }
+
+  // The first `executed` instructions of `b` retired and execution goes on
+  // at `pc`.
+  inline void block(const Block &b, size_t executed, uint64_t pc) {
+    if (executed == 0) {
+      return;
+    }
+    if (stack.empty()) {
+      stack.push_back(b.start);
+    }
+
+    BlockCount &count = blocks[b.start];
+    count.entries++;
+    count.instrs += executed;
+    for (size_t i = 0; i < executed; i++) {
+      ops[static_cast<size_t>(b.instrs[i].op)]++;
+    }
+
+    if (options.samplePeriod) {
+      size_t done = 0;
+      while (untilSample <= executed - done) {
+        done += untilSample;
+        sample(b, done - 1);
+        untilSample = options.samplePeriod;
+      }
+      untilSample -= executed - done;
+    }
+
+    // Only a block's last instruction can transfer control.
+    const risc::DecodedInstr &last = b.instrs[executed - 1];
+    if (last.op != risc::Op::JAL && last.op != risc::Op::JALR) {
+      return;
+    }
+    auto isLink = [](uint8_t r) { return r == 1 || r == 5; };
+    if (isLink(last.rd)) {
+      if (stack.size() < options.maxDepth) {
+        stack.push_back(pc);
+      } else {
+        untracked++;
+      }
+    } else if (last.op == risc::Op::JALR && last.rd == 0 &&
+               isLink(last.rs1)) {
+      if (untracked) {
+        untracked--;
+      } else if (stack.size() > 1) {
+        stack.pop_back();
+      }
+    }
+  }
+
+  [[nodiscard]] inline const std::unordered_map<uint64_t, BlockCount> &
+  blockCounts() const {
+    return blocks;
+  }
+
+  // Retired instructions of `op`.
+  [[nodiscard]] inline uint64_t opCount(risc::Op op) const {
+    return ops[static_cast<size_t>(op)];
+  }
+
+  // The writers below emit the folded-stack format of flamegraph.pl and
+  // friends, one "frame;frame;... count" line per distinct stack. Addresses
+  // are named after the symbol containing them when `symbols` is given.
+  //
+  // Samples: the functions on the call stack, outermost first, then the
+  // sampled pc.
+  void writeSamples(output::Writer &out,
+                    const elf::SymbolIndex *symbols = nullptr) const;
+
+  // Instructions retired per block, under the function containing it.
+  void writeBlocks(output::Writer &out,
+                   const elf::SymbolIndex *symbols = nullptr) const;
+
+  // Instructions retired per Op, under its major opcode.
+  void writeOps(output::Writer &out) const;
+
+  void clear();
+};
+
+} // namespace riscy::vm
@@ -1,12 +1,13 @@
 #pragma once
 
-#include <bitset>
 #include <cassert>
 #include <cstdint>
 #include <format>
 #include <iostream>
 #include <memory>
 
+#include "decode.h"
+
 namespace riscy::risc {
 
 struct Instr {
@@ -262,91 +263,21 @@ struct InstrU : public Instr {
   }
 };
 
-enum InstrType : int {
-  LOAD = 0,
-  LOAD_FP,
-  _custom_0,
-  MISC_MEM,
-  OP_IMM,
-  AUIPC,
-  OP_IMM_32,
-  _invalid_48b_1,
-  //
-  STORE,
-  STORE_FP,
-  _custom_1,
-  AMO,
-  OP,
-  LUI,
-  OP_32,
-  _invalid_64b,
-  //
-  MADD,
-  MSUB,
-  NMSUB,
-  NMADD,
-  OP_FP,
-  _reserved_10101,
-  _custom_2_rv128,
-  _invalid_48b_2,
-  //
-  BRANCH,
-  JALR,
-  _reserved_11010,
-  JAL,
-  SYSTEM,
-  _reserved_11101,
-  _custom_3_rv128,
-  _invalid_ge80b,
-};
-
-constexpr std::string_view InstrTypeNames[] = {
-    "LOAD",
-    "LOAD_FP",
-    "_custom_0",
-    "MISC_MEM",
-    "OP_IMM",
-    "AUIPC",
-    "OP_IMM_32",
-    "_invalid_48b_1",
-    //
-    "STORE",
-    "STORE_FP",
-    "_custom_1",
-    "AMO",
-    "OP",
-    "LUI",
-    "OP_32",
-    "_invalid_64b",
-    //
-    "MADD",
-    "MSUB",
-    "NMSUB",
-    "NMADD",
-    "OP_FP",
-    "_reserved_10101",
-    "_custom_2_rv128",
-    "_invalid_48b_2",
-    //
-    "BRANCH",
-    "JALR",
-    "_reserved_11010",
-    "JAL",
-    "SYSTEM",
-    "_reserved_11101",
-    "_custom_3_rv128",
-    "_invalid_ge80b",
-};
-
+// Pretty-printing layer: builds the Instr hierarchy above for a word. Hot
+// paths should use the allocation-free decode() in decode.h instead.
 [[nodiscard]] inline std::shared_ptr<Instr> decode_instr(uint32_t n) {
-  int opcode = n & 0b1111111;
+  // Compressed instructions are shown as what they expand to.
+  if ((n & 0b11) != 0b11) {
+    n = expandCompressed(static_cast<uint16_t>(n));
+    // Illegal ones (0x0000 padding among them) expand to 0.
+    if (n == 0) {
+      return std::make_shared<Instr>(0);
+    }
+  }
 
-  assert((opcode & 0b11) == 0b11);
+  int opcode = n & 0b1111111;
 
   int tag = (opcode >> 2) & 0b11111;
-  auto type = InstrTypeNames[tag];
-
-  std::cout << "(type=" << type << ", tag=" << std::bitset<5>(tag) << ")\n";
 
   switch (tag) {
   case InstrType::LOAD:
@@ -380,7 +311,11 @@ constexpr std::string_view InstrTypeNames[] = {
     // S-type
     // imm[11:5] | rs2    | rs1    | funct3 | imm[4:0] | opcode
     // 31-25       24-20    19-15    14-12    11-7       6-0
-    int imm = ((n >> 7) & 0b11111) | ((n >> 25) & 0b111111111111);
+    int imm = ((n >> 7) & 0b11111) | ((n >> 25) << 5);
+    // sign-extend
+    if (imm & 0x800) {
+      imm |= 0xFFFFF000;
+    }
     int funct3 = (n >> 12) & 0b111;
     int rs1 = (n >> 15) & 0b11111;
     int rs2 = (n >> 20) & 0b11111;
@@ -392,7 +327,12 @@ constexpr std::string_view InstrTypeNames[] = {
     // opcode
     // 31        30-25       24-20    19-15    14-12    11-8       7
     // 6-0
-    int imm = ((n >> 7) & 0b111111) | ((n >> 25) & 0b111111111111) << 1;
+    int imm = (((n >> 8) & 0b1111) << 1) | (((n >> 25) & 0b111111) << 5) |
+              (((n >> 7) & 1) << 11) | ((n >> 31) << 12);
+    // sign-extend
+    if (imm & 0x1000) {
+      imm |= 0xFFFFE000;
+    }
     int funct3 = (n >> 12) & 0b111;
     int rs1 = (n >> 15) & 0b11111;
     int rs2 = (n >> 20) & 0b11111;
@@ -412,9 +352,10 @@ constexpr std::string_view InstrTypeNames[] = {
     // imm[20] | imm[10:1] | imm[11] | imm[19:12] | rd    | opcode
     // 31        30-21       20        19-12        11-7    6-0
     int rd = (n >> 7) & 0b11111;
-    int imm = ((n >> 21) & 0b11111111111) << 1;
+    int imm = ((n >> 21) & 0b1111111111) << 1;
     imm |= ((n >> 20) & 1) << 11;
     imm |= ((n >> 12) & 0b11111111) << 12;
+    imm |= (n >> 31) << 20;
     // sign-extend
     if (imm & 0x100000) {
       imm |= 0xFFF00000;
@@ -0,0 +1,281 @@
+#include "symbols.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "elf.h"
+
+namespace riscy::elf {
+
+namespace {
+
+struct RawSymbol { // Elf64_Sym
+  uint32_t name;
+  uint8_t info;
+  uint8_t other;
+  uint16_t shndx;
+  uint64_t value;
+  uint64_t size;
+
+  void byteswap() { buffer::byteswapFields(name, shndx, value, size); }
+};
+constexpr size_t kSymbolEntrySize = sizeof(RawSymbol);
+static_assert(kSymbolEntrySize == 24);
+
+uint32_t gnuHash(std::string_view name) {
+  uint32_t h = 5381;
+  for (unsigned char c : name) {
+    h = h * 33 + c;
+  }
+  return h;
+}
+
+uint32_t sysvHash(std::string_view name) {
+  uint32_t h = 0;
+  for (unsigned char c : name) {
+    h = (h << 4) + c;
+    uint32_t g = h & 0xf0000000;
+    if (g)
+      h ^= g >> 24;
+    h &= ~g;
+  }
+  return h;
+}
+
+} // namespace
+
+SymbolIndex::SymbolIndex(const ELF &elf)
+    : SymbolIndex(elf, elf.getSymbolTable()) {}
+
+SymbolIndex::SymbolIndex(const ELF &elf,
+                         std::shared_ptr<SectionHeaderEntry> symt) {
+  if (!symt) {
+    return;
+  }
+
+  const auto &sections = elf.sectionHeaders();
+  if (symt->entrySize != kSymbolEntrySize) {
+    throw std::runtime_error("Unexpected symbol table entry size");
+  }
+  if (symt->linkIndex >= sections.size()) {
+    throw std::runtime_error("String table not found");
+  }
+  strings = sections[symt->linkIndex]->buffer;
+  table = symt->buffer;
+  count = symt->size / kSymbolEntrySize;
+
+  // Prefer a hash section that indexes this exact symbol table.
+  for (const auto &section : sections) {
+    if (section->linkIndex >= sections.size() ||
+        sections[section->linkIndex] != symt || section->buffer.empty()) {
+      continue;
+    }
+    if (section->type == SectionHeaderEntry::Type::GNUHashTable) {
+      hashKind = HashKind::GNU;
+      hashTable = section->buffer;
+      break;
+    }
+    if (section->type == SectionHeaderEntry::Type::SymbolHashTable) {
+      hashKind = HashKind::SysV;
+      hashTable = section->buffer;
+    }
+  }
+}
+
+Symbol SymbolIndex::symbolAt(uint32_t i) const {
+  auto raw = table.read_struct<RawSymbol>(i * kSymbolEntrySize);
+  Symbol sym;
+  sym.name = raw.name < strings.size() ? strings.string_at(raw.name)
+                                       : std::string_view();
+  sym.binding = (Symbol::Binding)(raw.info >> 4);
+  sym.type = (Symbol::Type)(raw.info & 0xf);
+  sym.sectionIndex = raw.shndx;
+  sym.value = raw.value;
+  sym.size = raw.size;
+  return sym;
+}
+
+std::string_view SymbolIndex::nameAt(uint32_t i) const {
+  uint32_t offset = table.read_u32(i * kSymbolEntrySize);
+  return offset < strings.size() ? strings.string_at(offset)
+                                 : std::string_view();
+}
+
+void SymbolIndex::decodeAll() const {
+  _symbols.reserve(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    _symbols.push_back(symbolAt(i));
+  }
+
+  if (hashKind == HashKind::None) {
+    byName.reserve(_symbols.size());
+    for (uint32_t i = 0; i < _symbols.size(); ++i) {
+      if (!_symbols[i].name.empty()) {
+        byName.emplace(_symbols[i].name, i);
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < _symbols.size(); ++i) {
+    const auto &sym = _symbols[i];
+    if (sym.size == 0 || (sym.type != Symbol::Type::Func &&
+                          sym.type != Symbol::Type::Object)) {
+      continue;
+    }
+    byAddress.push_back({sym.value, sym.value + sym.size, 0, i});
+  }
+  std::sort(byAddress.begin(), byAddress.end(),
+            [](const Range &a, const Range &b) { return a.start < b.start; });
+  uint64_t reach = 0;
+  for (auto &range : byAddress) {
+    reach = std::max(reach, range.end);
+    range.reach = reach;
+  }
+}
+
+uint32_t SymbolIndex::findGNU(std::string_view name) const {
+  // nbuckets | symoffset | bloomSize | bloomShift | bloom[] | buckets[] |
+  // chains[]
+  uint32_t nbuckets = hashTable.read_u32(0);
+  uint32_t symoffset = hashTable.read_u32(4);
+  uint32_t bloomSize = hashTable.read_u32(8);
+  uint32_t bloomShift = hashTable.read_u32(12);
+  if (nbuckets == 0 || bloomSize == 0) {
+    return kNotFound;
+  }
+
+  size_t bloomOff = 16;
+  size_t bucketOff = bloomOff + size_t(bloomSize) * 8;
+  size_t chainOff = bucketOff + size_t(nbuckets) * 4;
+
+  uint32_t h = gnuHash(name);
+  uint64_t word = hashTable.read_u64(bloomOff + ((h / 64) % bloomSize) * 8);
+  uint64_t mask = (uint64_t(1) << (h % 64)) |
+                  (uint64_t(1) << ((h >> bloomShift) % 64));
+  if ((word & mask) != mask) {
+    return kNotFound;
+  }
+
+  uint32_t idx = hashTable.read_u32(bucketOff + (h % nbuckets) * 4);
+  if (idx < symoffset) {
+    return kNotFound;
+  }
+
+  for (; idx < count; ++idx) {
+    uint32_t chain = hashTable.read_u32(chainOff + (idx - symoffset) * 4);
+    if ((chain | 1) == (h | 1) && nameAt(idx) == name) {
+      return idx;
+    }
+    if (chain & 1) {
+      break;
+    }
+  }
+  return kNotFound;
+}
+
+uint32_t SymbolIndex::findSysV(std::string_view name) const {
+  // nbucket | nchain | buckets[] | chains[]
+  uint32_t nbucket = hashTable.read_u32(0);
+  uint32_t nchain = hashTable.read_u32(4);
+  if (nbucket == 0) {
+    return kNotFound;
+  }
+
+  size_t bucketOff = 8;
+  size_t chainOff = bucketOff + size_t(nbucket) * 4;
+
+  uint32_t h = sysvHash(name);
+  uint32_t idx = hashTable.read_u32(bucketOff + (h % nbucket) * 4);
+  while (idx != 0 && idx < nchain && idx < count) {
+    if (nameAt(idx) == name) {
+      return idx;
+    }
+    idx = hashTable.read_u32(chainOff + idx * 4);
+  }
+  return kNotFound;
+}
+
+const Symbol *SymbolIndex::find(std::string_view name) const {
+  ensureDecoded();
+  uint32_t idx = kNotFound;
+  switch (hashKind) {
+  case HashKind::GNU:
+    idx = findGNU(name);
+    break;
+  case HashKind::SysV:
+    idx = findSysV(name);
+    break;
+  case HashKind::None: {
+    auto it = byName.find(name);
+    if (it != byName.end()) {
+      idx = it->second;
+    }
+    break;
+  }
+  }
+  return idx == kNotFound ? nullptr : &_symbols[idx];
+}
+
+std::optional<Symbol> SymbolIndex::lookup(std::string_view name) const {
+  uint32_t idx = kNotFound;
+  switch (hashKind) {
+  case HashKind::GNU:
+    idx = findGNU(name);
+    break;
+  case HashKind::SysV:
+    idx = findSysV(name);
+    break;
+  case HashKind::None:
+    if (auto sym = find(name)) {
+      return *sym;
+    }
+    return std::nullopt;
+  }
+  if (idx == kNotFound) {
+    return std::nullopt;
+  }
+  return symbolAt(idx);
+}
+
+const Symbol *SymbolIndex::findByAddress(uint64_t addr) const {
+  ensureDecoded();
+  auto it = std::upper_bound(
+      byAddress.begin(), byAddress.end(), addr,
+      [](uint64_t a, const Range &r) { return a < r.start; });
+  // Symbols may nest (aliases, sized local labels), so the nearest range
+  // starting at or below `addr` need not contain it. Walk back while some
+  // earlier range can still reach past `addr`.
+  while (it != byAddress.begin()) {
+    --it;
+    if (addr < it->end) {
+      return &_symbols[it->symbol];
+    }
+    if (it->reach <= addr) {
+      break;
+    }
+  }
+  return nullptr;
+}
+
+std::vector<const Symbol *> SymbolIndex::functions() const {
+  ensureDecoded();
+  std::vector<const Symbol *> functions;
+  for (const auto &sym : _symbols) {
+    if (sym.type == Symbol::Type::Func && sym.size > 0 &&
+        sym.sectionIndex != 0) {
+      functions.push_back(&sym);
+    }
+  }
+  std::stable_sort(functions.begin(), functions.end(),
+                   [](const Symbol *a, const Symbol *b) {
+                     return a->value < b->value;
+                   });
+  functions.erase(std::unique(functions.begin(), functions.end(),
+                              [](const Symbol *a, const Symbol *b) {
+                                return a->value == b->value;
+                              }),
+                  functions.end());
+  return functions;
+}
+
+} // namespace riscy::elf
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "buffer.h"
+
+namespace riscy::elf {
+
+struct ELF;
+struct SectionHeaderEntry;
+
+struct Symbol {
+  std::string_view name;
+  uint64_t value;
+  uint64_t size;
+
+  // st_shndx
+  uint16_t sectionIndex;
+
+  // ELF64_ST_BIND(st_info)
+  enum class Binding : uint8_t {
+    Local = 0,
+    Global = 1,
+    Weak = 2,
+  };
+  Binding binding;
+
+  // ELF64_ST_TYPE(st_info)
+  enum class Type : uint8_t {
+    NoType = 0,
+    Object = 1,
+    Func = 2,
+    Section = 3,
+    File = 4,
+    Common = 5,
+    TLS = 6,
+  };
+  Type type;
+};
+
+// Answers name and address lookups on the symbol table without touching any
+// Buffer cursor. Name lookups go through the ELF's own .gnu.hash/.hash
+// section when it covers the chosen symbol table, and through an owned hash
+// map otherwise.
+//
+// Construction only locates the tables. With a hash section, lookup() reads
+// the few entries on the probed chain straight from the file; everything
+// else decodes the whole table, once, on first use. Safe to share between
+// threads.
+class SymbolIndex {
+private:
+  buffer::Buffer table;
+  buffer::Buffer strings;
+  size_t count = 0;
+
+  enum class HashKind { None, GNU, SysV };
+  HashKind hashKind = HashKind::None;
+  buffer::Buffer hashTable;
+
+  // Built by decodeAll().
+  mutable std::once_flag decoded;
+  mutable std::vector<Symbol> _symbols;
+
+  // Only populated when there is no usable hash section.
+  mutable std::unordered_map<std::string_view, uint32_t> byName;
+
+  // [start, end) address ranges of sized symbols, sorted by start. `reach` is
+  // the largest `end` of this and every preceding range.
+  struct Range {
+    uint64_t start;
+    uint64_t end;
+    uint64_t reach;
+    uint32_t symbol;
+  };
+  mutable std::vector<Range> byAddress;
+
+  static constexpr uint32_t kNotFound = UINT32_MAX;
+
+  [[nodiscard]] std::string_view nameAt(uint32_t i) const;
+  [[nodiscard]] uint32_t findGNU(std::string_view name) const;
+  [[nodiscard]] uint32_t findSysV(std::string_view name) const;
+
+  void decodeAll() const;
+  inline void ensureDecoded() const {
+    std::call_once(decoded, [this] { decodeAll(); });
+  }
+
+public:
+  SymbolIndex() = default;
+  // Indexes .symtab, or .dynsym if the file has no .symtab.
+  explicit SymbolIndex(const ELF &elf);
+  // Indexes `symt` (none if null), which must be one of elf's sections.
+  SymbolIndex(const ELF &elf, std::shared_ptr<SectionHeaderEntry> symt);
+
+  // Entry `i` of the table, decoded on its own (as relocations refer to
+  // them); i must be below size().
+  [[nodiscard]] Symbol symbolAt(uint32_t i) const;
+  [[nodiscard]] inline size_t size() const { return count; }
+
+  [[nodiscard]] const Symbol *find(std::string_view name) const;
+
+  // find(name) by value, without decoding the whole table when a hash
+  // section can answer it.
+  [[nodiscard]] std::optional<Symbol> lookup(std::string_view name) const;
+
+  // Returns the sized function/object symbol whose range contains `addr`.
+  [[nodiscard]] const Symbol *findByAddress(uint64_t addr) const;
+
+  // Sized, defined function symbols in address order; of several aliases
+  // at one address, only the first is kept.
+  [[nodiscard]] std::vector<const Symbol *> functions() const;
+
+  [[nodiscard]] inline std::span<const Symbol> symbols() const {
+    ensureDecoded();
+    return _symbols;
+  }
+
+  [[nodiscard]] inline bool empty() const { return count == 0; }
+};
+
+} // namespace riscy::elf
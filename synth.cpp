@@ -0,0 +1,379 @@
+#include "synth.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
+#include <format>
+#include <random>
+#include <string_view>
+#include <system_error>
+
+#include "decode.h"
+#include "output.h"
+
+namespace riscy::synth {
+
+namespace {
+
+constexpr uint64_t kPageSize = 0x1000;
+constexpr size_t kHeaderSize = 64;
+constexpr size_t kProgramHeaderSize = 56;
+constexpr size_t kSectionHeaderSize = 64;
+constexpr size_t kSymbolSize = 24;
+constexpr size_t kObjectSize = 8;
+
+static_assert(std::endian::native == std::endian::little,
+              "the generator writes host integers as little-endian");
+
+// Calls only go to one of the last few functions. With the default lengths
+// that keeps them well within JAL's +-1 MiB; with long functions the ones
+// that would reach further are left out.
+constexpr size_t kCallWindow = 64;
+constexpr int64_t kJalRange = int64_t(1) << 20;
+
+constexpr uint32_t kRet = 0x00008067;
+
+// Section indices.
+enum : uint16_t { kNull, kText, kData, kSymtab, kStrtab, kShstrtab, kCount };
+
+constexpr char kSectionNameTable[] =
+    "\0.text\0.data\0.symtab\0.strtab\0.shstrtab";
+// The table, including the final terminator.
+constexpr std::string_view kSectionNames(kSectionNameTable,
+                                         sizeof(kSectionNameTable));
+constexpr uint32_t kNameOffsets[kCount] = {0, 1, 7, 13, 21, 29};
+
+[[nodiscard]] constexpr uint64_t alignUp(uint64_t v, uint64_t a) {
+  return (v + a - 1) & ~(a - 1);
+}
+
+[[nodiscard]] size_t decimalDigits(size_t v) {
+  size_t n = 1;
+  while (v >= 10) {
+    v /= 10;
+    n++;
+  }
+  return n;
+}
+
+// Appends generated bytes to an output::Writer's buffer (or, in memory, to
+// a plain string) and keeps track of the file offset reached.
+template <typename Out> class Emitter {
+private:
+  Out &out;
+  uint64_t pos = 0;
+
+public:
+  explicit Emitter(Out &out) : out(out) {}
+
+  [[nodiscard]] inline uint64_t offset() const { return pos; }
+
+  // Appends the low `bytes` bytes of `v`, little-endian.
+  inline void put(uint64_t v, size_t bytes) {
+    out.buffer().append(reinterpret_cast<const char *>(&v), bytes);
+    pos += bytes;
+    out.done();
+  }
+
+  inline void text(std::string_view s) {
+    out.buffer() += s;
+    pos += s.size();
+    out.done();
+  }
+
+  // Zero-fills up to file offset `to`.
+  inline void padTo(uint64_t to) {
+    while (pos < to) {
+      size_t n = static_cast<size_t>(std::min<uint64_t>(to - pos, 1 << 16));
+      out.buffer().append(n, '\0');
+      pos += n;
+      out.done();
+    }
+  }
+};
+
+// Everything is derived from the seed, so each part of the file can be
+// regenerated when it is written instead of being kept around.
+class Generator {
+private:
+  const Options &options;
+  size_t objects;
+
+  // Layout.
+  uint64_t textSize = 0;
+  uint64_t dataAddr = 0;
+  uint64_t symtabOff = 0;
+  uint64_t strtabOff = 0;
+  uint64_t strtabSize = 0;
+  uint64_t shstrtabOff = 0;
+  uint64_t shOff = 0;
+
+  // The lengths of the functions, in order, from the start.
+  [[nodiscard]] inline auto lengths() const {
+    return [rng = std::mt19937_64(options.seed ^ 0x6c656e67746873),
+            dist = std::uniform_int_distribution<size_t>(
+                std::max<size_t>(options.minLength, 1),
+                std::max(options.minLength, options.maxLength))]() mutable {
+      return dist(rng);
+    };
+  }
+
+  template <typename Out> void header(Emitter<Out> &e) const {
+    const bool hasData = objects != 0;
+    e.text(std::string_view("\x7f"
+                            "ELF\x02\x01\x01",
+                            7));
+    e.padTo(16);
+    e.put(3, 2);    // e_type: ET_DYN
+    e.put(0xF3, 2); // e_machine: RISC-V
+    e.put(1, 4);    // e_version
+    e.put(0, 8);    // e_entry
+    e.put(kHeaderSize, 8);
+    e.put(shOff, 8);
+    e.put(0, 4); // e_flags
+    e.put(kHeaderSize, 2);
+    e.put(kProgramHeaderSize, 2);
+    e.put(hasData ? 2 : 1, 2);
+    e.put(kSectionHeaderSize, 2);
+    e.put(kCount, 2);
+    e.put(kShstrtab, 2);
+
+    // The text segment also maps the headers, as linkers do.
+    programHeader(e, 0x4 | 0x1, 0, kTextAddr + textSize);
+    if (hasData) {
+      programHeader(e, 0x4 | 0x2, dataAddr, objects * kObjectSize);
+    }
+  }
+
+  template <typename Out>
+  void programHeader(Emitter<Out> &e, uint32_t flags, uint64_t addr,
+                     uint64_t size) const {
+    e.put(1, 4); // PT_LOAD
+    e.put(flags, 4);
+    e.put(addr, 8); // p_offset
+    e.put(addr, 8); // p_vaddr
+    e.put(addr, 8); // p_paddr
+    e.put(size, 8);
+    e.put(size, 8);
+    e.put(kPageSize, 8);
+  }
+
+  // A random valid instruction that falls through. The major opcode and
+  // funct7 are drawn from the encodings that have such instructions, and
+  // the rest of the word is retried until it decodes.
+  [[nodiscard]] static uint32_t straightLine(std::mt19937_64 &rng) {
+    // Fences are left out: decode() ignores their reserved fields, but other
+    // tools reject random bits there.
+    constexpr risc::InstrType kMajors[] = {
+        risc::LOAD, risc::OP_IMM, risc::AUIPC, risc::OP_IMM_32,
+        risc::STORE, risc::OP,    risc::LUI,   risc::OP_32,
+    };
+    constexpr uint32_t kFunct7[] = {0b0000000, 0b0100000, 0b0000001};
+    for (;;) {
+      uint64_t r = rng();
+      auto major = kMajors[(r >> 32) % std::size(kMajors)];
+      uint32_t w = (static_cast<uint32_t>(r) & ~uint32_t(0x7F)) |
+                   uint32_t(major) << 2 | 0b11;
+      if (major == risc::OP || major == risc::OP_32) {
+        w = (w & 0x01FFFFFF) | kFunct7[(r >> 40) % std::size(kFunct7)] << 25;
+      }
+      if (risc::decode(w).valid()) {
+        return w;
+      }
+    }
+  }
+
+  template <typename Out> void text(Emitter<Out> &e) const {
+    std::mt19937_64 rng(options.seed);
+    auto nextLength = lengths();
+    // Start addresses of the last kCallWindow functions.
+    std::array<uint64_t, kCallWindow> recent{};
+    constexpr uint32_t kBranchFunct3[] = {0b000, 0b001, 0b100,
+                                          0b101, 0b110, 0b111};
+
+    uint64_t pc = kTextAddr;
+    for (size_t f = 0; f < options.functions; f++) {
+      size_t length = nextLength();
+      recent[f % kCallWindow] = pc;
+      for (size_t i = 0; i + 1 < length; i++, pc += 4) {
+        uint32_t roll = static_cast<uint32_t>(rng() % 32);
+        if (options.controlFlow && roll == 0) {
+          // A forward branch to a later instruction of this function,
+          // within B-type range.
+          size_t ahead = 1 + rng() % std::min<size_t>(length - 1 - i, 1023);
+          uint32_t funct3 = kBranchFunct3[rng() % 6];
+          e.put(risc::detail::encodeB(funct3, rng() % 32, rng() % 32,
+                                      static_cast<int32_t>(ahead * 4)),
+                4);
+          continue;
+        }
+        if (options.controlFlow && roll == 1 && f > 0) {
+          size_t back = 1 + rng() % std::min(f, kCallWindow);
+          uint64_t target = recent[(f - back) % kCallWindow];
+          // Always backward.
+          int64_t offset = static_cast<int64_t>(target - pc);
+          if (offset >= -kJalRange) {
+            e.put(risc::detail::encodeJ(1, static_cast<int32_t>(offset)), 4);
+            continue;
+          }
+        }
+        e.put(straightLine(rng), 4);
+      }
+      e.put(kRet, 4);
+      pc += 4;
+    }
+  }
+
+  template <typename Out> void symbols(Emitter<Out> &e) const {
+    e.padTo(e.offset() + kSymbolSize); // the null symbol
+    auto nextLength = lengths();
+    uint64_t addr = kTextAddr;
+    uint64_t name = 1;
+    for (size_t f = 0; f < options.functions; f++) {
+      uint64_t size = nextLength() * 4;
+      symbol(e, name, 0x12, kText, addr, size); // STB_GLOBAL, STT_FUNC
+      name += 3 + decimalDigits(f) + 1;
+      addr += size;
+    }
+    for (size_t o = 0; o < objects; o++) {
+      symbol(e, name, 0x11, kData, dataAddr + o * kObjectSize, // STT_OBJECT
+             kObjectSize);
+      name += 4 + decimalDigits(o) + 1;
+    }
+  }
+
+  template <typename Out>
+  void symbol(Emitter<Out> &e, uint64_t name, uint8_t info, uint16_t section,
+              uint64_t value, uint64_t size) const {
+    e.put(name, 4);
+    e.put(info, 1);
+    e.put(0, 1); // st_other
+    e.put(section, 2);
+    e.put(value, 8);
+    e.put(size, 8);
+  }
+
+  template <typename Out> void strings(Emitter<Out> &e) const {
+    char buf[32];
+    e.put(0, 1);
+    for (size_t f = 0; f < options.functions; f++) {
+      e.text({buf, std::format_to_n(buf, sizeof(buf), "fn_{}", f).out});
+      e.put(0, 1);
+    }
+    for (size_t o = 0; o < objects; o++) {
+      e.text({buf, std::format_to_n(buf, sizeof(buf), "obj_{}", o).out});
+      e.put(0, 1);
+    }
+  }
+
+  template <typename Out>
+  void sectionHeader(Emitter<Out> &e, uint16_t index, uint32_t type,
+                     uint64_t flags, uint64_t addr, uint64_t offset,
+                     uint64_t size, uint32_t link, uint32_t info,
+                     uint64_t align, uint64_t entsize) const {
+    e.put(kNameOffsets[index], 4);
+    e.put(type, 4);
+    e.put(flags, 8);
+    e.put(addr, 8);
+    e.put(offset, 8);
+    e.put(size, 8);
+    e.put(link, 4);
+    e.put(info, 4);
+    e.put(align, 8);
+    e.put(entsize, 8);
+  }
+
+public:
+  explicit Generator(const Options &options)
+      : options(options),
+        objects(std::max(options.symbols, options.functions) -
+                options.functions) {
+    auto nextLength = lengths();
+    for (size_t f = 0; f < options.functions; f++) {
+      textSize += nextLength() * 4;
+    }
+
+    strtabSize = 1;
+    for (size_t f = 0; f < options.functions; f++) {
+      strtabSize += 3 + decimalDigits(f) + 1;
+    }
+    for (size_t o = 0; o < objects; o++) {
+      strtabSize += 4 + decimalDigits(o) + 1;
+    }
+
+    dataAddr = alignUp(kTextAddr + textSize, kPageSize);
+    symtabOff = alignUp(dataAddr + objects * kObjectSize, 8);
+    strtabOff =
+        symtabOff + (1 + options.functions + objects) * kSymbolSize;
+    shstrtabOff = strtabOff + strtabSize;
+    shOff = alignUp(shstrtabOff + kSectionNames.size(), 8);
+  }
+
+  template <typename Out> void emit(Out &out) const {
+    Emitter<Out> e(out);
+    header(e);
+    e.padTo(kTextAddr);
+    text(e);
+    e.padTo(dataAddr);
+    e.padTo(dataAddr + objects * kObjectSize);
+    e.padTo(symtabOff);
+    symbols(e);
+    strings(e);
+    e.text(kSectionNames);
+    e.padTo(shOff);
+
+    const uint64_t symtabSize = strtabOff - symtabOff;
+    sectionHeader(e, kNull, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    sectionHeader(e, kText, 1, 0x2 | 0x4, kTextAddr, kTextAddr, textSize, 0,
+                  0, 4, 0);
+    sectionHeader(e, kData, 1, 0x2 | 0x1, dataAddr, dataAddr,
+                  objects * kObjectSize, 0, 0, 8, 0);
+    // sh_info: index of the first non-local symbol.
+    sectionHeader(e, kSymtab, 2, 0, 0, symtabOff, symtabSize, kStrtab, 1, 8,
+                  kSymbolSize);
+    sectionHeader(e, kStrtab, 3, 0, 0, strtabOff, strtabSize, 0, 0, 1, 0);
+    sectionHeader(e, kShstrtab, 3, 0, 0, shstrtabOff, kSectionNames.size(),
+                  0, 0, 1, 0);
+  }
+};
+
+// Output::Writer's interface, without a file behind it.
+struct InMemory {
+  std::string buf;
+
+  [[nodiscard]] inline std::string &buffer() { return buf; }
+  inline void done() {}
+};
+
+} // namespace
+
+void write(std::FILE *file, const Options &options) {
+  output::Writer out(file);
+  Generator(options).emit(out);
+  out.flush();
+}
+
+void writeFile(const std::string &path, const Options &options) {
+  std::FILE *file = std::fopen(path.c_str(), "wb");
+  if (!file) {
+    throw std::system_error(errno, std::generic_category(), path);
+  }
+  try {
+    write(file, options);
+  } catch (...) {
+    std::fclose(file);
+    throw;
+  }
+  if (std::fclose(file) != 0) {
+    throw std::system_error(errno, std::generic_category(), path);
+  }
+}
+
+std::vector<uint8_t> generate(const Options &options) {
+  InMemory out;
+  Generator(options).emit(out);
+  return {out.buf.begin(), out.buf.end()};
+}
+
+} // namespace riscy::synth
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace riscy::synth {
+
+// Where .text starts, in the file and in memory alike.
+inline constexpr uint64_t kTextAddr = 0x1000;
+
+struct Options {
+  // Function symbols, each over its own run of code in .text.
+  size_t functions = 1000;
+  // Total symbols. Those beyond one per function name 8-byte data objects in
+  // .data; fewer than `functions` counts as `functions`.
+  size_t symbols = 0;
+  // Instructions per function, drawn uniformly from [minLength, maxLength].
+  // The last one is always `ret`.
+  size_t minLength = 16;
+  size_t maxLength = 128;
+  // Mix forward branches within a function and calls to earlier functions
+  // into the otherwise straight-line code.
+  bool controlFlow = true;
+  uint64_t seed = 42;
+};
+
+// Generates a little-endian ELF64 RISC-V shared object: .text holding the
+// functions (random but valid RV64IM instructions), .data holding the data
+// objects, each in its own PT_LOAD segment, plus .symtab, .strtab and
+// .shstrtab. The same options always give the same bytes.
+//
+// Only per-function lengths are kept in memory; everything else is written
+// as it is generated, so the output can be far larger than RAM. Throws
+// std::system_error if writing fails.
+void write(std::FILE *file, const Options &options);
+
+void writeFile(const std::string &path, const Options &options);
+
+// The same object, in memory.
+[[nodiscard]] std::vector<uint8_t> generate(const Options &options);
+
+} // namespace riscy::synth
@@ -0,0 +1,702 @@
+#include "syscalls.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "elf.h"
+
+namespace riscy::vm {
+
+namespace {
+
+// Flags and constants that are passed straight through must mean the same
+// on the host as in the asm-generic ABI the guest was built for.
+static_assert(O_WRONLY == 01 && O_RDWR == 02 && O_CREAT == 0100 &&
+              O_EXCL == 0200 && O_NOCTTY == 0400 && O_TRUNC == 01000 &&
+              O_APPEND == 02000 && O_NONBLOCK == 04000 &&
+              O_DIRECTORY == 0200000 && O_NOFOLLOW == 0400000 &&
+              O_CLOEXEC == 02000000);
+static_assert(AT_FDCWD == -100 && AT_SYMLINK_NOFOLLOW == 0x100 &&
+              AT_EMPTY_PATH == 0x1000);
+static_assert(MAP_SHARED == 0x01 && MAP_PRIVATE == 0x02 &&
+              MAP_FIXED == 0x10 && MAP_ANONYMOUS == 0x20);
+static_assert(PROT_READ == Memory::kRead && PROT_WRITE == Memory::kWrite &&
+              PROT_EXEC == Memory::kExec);
+static_assert(TCGETS == 0x5401 && TIOCGWINSZ == 0x5413);
+static_assert(CLOCK_REALTIME == 0 && CLOCK_MONOTONIC == 1);
+
+// struct stat of riscv64 Linux (asm-generic/stat.h).
+struct GuestStat {
+  uint64_t dev;
+  uint64_t ino;
+  uint32_t mode;
+  uint32_t nlink;
+  uint32_t uid;
+  uint32_t gid;
+  uint64_t rdev;
+  uint64_t pad1;
+  int64_t size;
+  int32_t blksize;
+  int32_t pad2;
+  int64_t blocks;
+  int64_t atime, atimeNsec;
+  int64_t mtime, mtimeNsec;
+  int64_t ctime, ctimeNsec;
+  uint32_t unused[2];
+};
+static_assert(sizeof(GuestStat) == 128);
+
+// struct termios as the kernel sees it (asm-generic/termbits.h, NCCS 19),
+// not glibc's larger one.
+constexpr size_t kTermiosSize = 36;
+
+// Auxiliary vector entry types.
+enum : uint64_t {
+  AT_NULL = 0,
+  AT_PHDR = 3,
+  AT_PHENT = 4,
+  AT_PHNUM = 5,
+  AT_PAGESZ = 6,
+  AT_BASE = 7,
+  AT_FLAGS = 8,
+  AT_ENTRY = 9,
+  AT_UID = 11,
+  AT_EUID = 12,
+  AT_GID = 13,
+  AT_EGID = 14,
+  AT_HWCAP = 16,
+  AT_CLKTCK = 17,
+  AT_SECURE = 23,
+  AT_RANDOM = 25,
+  AT_EXECFN = 31,
+};
+
+// AT_HWCAP bits are the single-letter extensions, 'a' at bit 0.
+constexpr uint64_t hwcap(std::string_view letters) {
+  uint64_t bits = 0;
+  for (char c : letters) {
+    bits |= uint64_t(1) << (c - 'a');
+  }
+  return bits;
+}
+
+inline int64_t result(int64_t r) { return r < 0 ? -int64_t(errno) : r; }
+
+inline uint64_t pageUp(uint64_t addr) {
+  return (addr + Memory::kPageSize - 1) & ~(Memory::kPageSize - 1);
+}
+
+} // namespace
+
+std::string_view syscallName(uint64_t number) {
+  switch (static_cast<Syscall>(number)) {
+#define NAME(x)                                                                \
+  case Syscall::x:                                                             \
+    return #x;
+    NAME(ioctl)
+    NAME(openat)
+    NAME(close)
+    NAME(lseek)
+    NAME(read)
+    NAME(write)
+    NAME(readv)
+    NAME(writev)
+    NAME(pread64)
+    NAME(pwrite64)
+    NAME(newfstatat)
+    NAME(fstat)
+    NAME(exit)
+    NAME(exit_group)
+    NAME(set_tid_address)
+    NAME(futex)
+    NAME(set_robust_list)
+    NAME(clock_gettime)
+    NAME(sched_yield)
+    NAME(sigaltstack)
+    NAME(rt_sigaction)
+    NAME(rt_sigprocmask)
+    NAME(uname)
+    NAME(getpid)
+    NAME(getppid)
+    NAME(getuid)
+    NAME(geteuid)
+    NAME(getgid)
+    NAME(getegid)
+    NAME(gettid)
+    NAME(brk)
+    NAME(munmap)
+    NAME(clone)
+    NAME(mmap)
+    NAME(mprotect)
+    NAME(getrandom)
+#undef NAME
+  }
+  return {};
+}
+
+Linux::Linux(Memory &memory, std::FILE *trace)
+    : memory(memory), trace(trace), brkBase(memory.heapBase()),
+      brkEnd(memory.heapBase()), mmapLow(memory.heapEnd()) {}
+
+Linux::~Linux() {
+  for (int host : fds) {
+    if (host > 2) {
+      ::close(host);
+    }
+  }
+}
+
+int Linux::hostFd(int64_t fd) const {
+  if (fd < 0 || uint64_t(fd) >= fds.size()) {
+    return -1;
+  }
+  return fds[fd];
+}
+
+int Linux::addFd(int host) {
+  auto it = std::find(fds.begin(), fds.end(), -1);
+  if (it != fds.end()) {
+    *it = host;
+    return int(it - fds.begin());
+  }
+  fds.push_back(host);
+  return int(fds.size() - 1);
+}
+
+bool Linux::gather(Pieces &pieces, uint64_t addr, uint64_t n,
+                   uint8_t perms) {
+  if (n == 0) {
+    return true;
+  }
+  if (!memory.permits(addr, n, perms)) {
+    return false;
+  }
+  if (memory.isFlat()) {
+    pieces.host.push_back({memory.translate(addr, n), n});
+    pieces.addrs.push_back(addr);
+    return true;
+  }
+  // Pages are backed individually; merge the runs that happen to be
+  // contiguous on the host too.
+  for (uint64_t end = addr + n; addr < end;) {
+    uint64_t len = std::min(end, (addr | (Memory::kPageSize - 1)) + 1) - addr;
+    uint8_t *host = memory.translate(addr, len);
+    std::vector<iovec> &runs = pieces.host;
+    if (!runs.empty() && pieces.addrs.back() + runs.back().iov_len == addr &&
+        static_cast<uint8_t *>(runs.back().iov_base) + runs.back().iov_len ==
+            host) {
+      runs.back().iov_len += len;
+    } else {
+      pieces.host.push_back({host, len});
+      pieces.addrs.push_back(addr);
+    }
+    addr += len;
+  }
+  return true;
+}
+
+bool Linux::gatherVector(Pieces &pieces, uint64_t iov, uint64_t count,
+                         uint8_t perms, uint64_t &n) {
+  n = 0;
+  if (count > IOV_MAX) {
+    return false;
+  }
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t base, len;
+    if (!memory.load(iov + 16 * i, base) ||
+        !memory.load(iov + 16 * i + 8, len) ||
+        !gather(pieces, base, len, perms)) {
+      return false;
+    }
+    n += len;
+  }
+  return true;
+}
+
+void Linux::noteWritten(const Pieces &pieces, uint64_t n) {
+  for (size_t i = 0; i < pieces.host.size() && n; i++) {
+    uint64_t len = std::min<uint64_t>(n, pieces.host[i].iov_len);
+    memory.noteHostWrite(pieces.addrs[i], len);
+    n -= len;
+  }
+}
+
+bool Linux::readString(uint64_t addr, std::string &out) const {
+  out.clear();
+  for (;;) {
+    uint8_t c;
+    if (out.size() >= PATH_MAX || !memory.load(addr + out.size(), c)) {
+      return false;
+    }
+    if (c == 0) {
+      return true;
+    }
+    out.push_back(char(c));
+  }
+}
+
+bool Linux::zero(Pieces &pieces, uint64_t addr, uint64_t n) {
+  if (!gather(pieces, addr, n, 0)) {
+    return false;
+  }
+  for (const iovec &piece : pieces.host) {
+    std::memset(piece.iov_base, 0, piece.iov_len);
+  }
+  noteWritten(pieces, n);
+  return true;
+}
+
+int64_t Linux::doIoctl(int64_t fd, uint64_t request, uint64_t arg) {
+  int host = hostFd(fd);
+  if (host < 0) {
+    return -EBADF;
+  }
+  // Enough for isatty() and terminal sizes; the layouts match the host's.
+  size_t size;
+  if (request == TCGETS) {
+    size = kTermiosSize;
+  } else if (request == TIOCGWINSZ) {
+    size = sizeof(winsize);
+  } else {
+    return -ENOTTY;
+  }
+  uint8_t buf[64] = {};
+  if (::ioctl(host, request, buf) < 0) {
+    return -errno;
+  }
+  return memory.write(arg, {buf, size}) ? 0 : -EFAULT;
+}
+
+int64_t Linux::doStat(int host, const char *path, int flags, uint64_t out) {
+  struct stat st;
+  if (::fstatat(host, path, &st, flags) < 0) {
+    return -errno;
+  }
+  GuestStat g{};
+  g.dev = st.st_dev;
+  g.ino = st.st_ino;
+  g.mode = st.st_mode;
+  g.nlink = uint32_t(st.st_nlink);
+  g.uid = st.st_uid;
+  g.gid = st.st_gid;
+  g.rdev = st.st_rdev;
+  g.size = st.st_size;
+  g.blksize = int32_t(st.st_blksize);
+  g.blocks = st.st_blocks;
+  g.atime = st.st_atim.tv_sec;
+  g.atimeNsec = st.st_atim.tv_nsec;
+  g.mtime = st.st_mtim.tv_sec;
+  g.mtimeNsec = st.st_mtim.tv_nsec;
+  g.ctime = st.st_ctim.tv_sec;
+  g.ctimeNsec = st.st_ctim.tv_nsec;
+  return memory.write(out, {reinterpret_cast<const uint8_t *>(&g), sizeof(g)})
+             ? 0
+             : -EFAULT;
+}
+
+int64_t Linux::doBrk(uint64_t addr) {
+  if (addr < brkBase || addr > mmapLow) {
+    return int64_t(brkEnd);
+  }
+  if (addr > brkEnd) {
+    // The range may have been grown and shrunk before; it must read as
+    // zero again.
+    memory.map(brkEnd, addr - brkEnd, Memory::kRead | Memory::kWrite);
+    Pieces pieces;
+    if (!zero(pieces, brkEnd, addr - brkEnd)) {
+      return int64_t(brkEnd);
+    }
+  }
+  brkEnd = addr;
+  return int64_t(brkEnd);
+}
+
+int64_t Linux::doMmap(uint64_t addr, uint64_t len, uint64_t prot,
+                      uint64_t flags, int64_t fd, uint64_t offset) {
+  if (len == 0 || (offset & (Memory::kPageSize - 1)) ||
+      !(flags & (MAP_SHARED | MAP_PRIVATE))) {
+    return -EINVAL;
+  }
+  len = pageUp(len);
+  if (len == 0) {
+    return -ENOMEM;
+  }
+
+  int host = -1;
+  if (!(flags & MAP_ANONYMOUS)) {
+    // Files are copied in: writes to a MAP_SHARED mapping never reach them.
+    host = hostFd(fd);
+    if (host < 0) {
+      return -EBADF;
+    }
+  }
+
+  if (flags & MAP_FIXED) {
+    if (addr & (Memory::kPageSize - 1)) {
+      return -EINVAL;
+    }
+  } else {
+    if (mmapLow - brkEnd < len) {
+      return -ENOMEM;
+    }
+    addr = (mmapLow - len) & ~(Memory::kPageSize - 1);
+    if (addr < pageUp(brkEnd)) {
+      return -ENOMEM;
+    }
+    mmapLow = addr;
+  }
+
+  try {
+    memory.map(addr, len, uint8_t(prot & 7));
+  } catch (const std::out_of_range &) {
+    return -ENOMEM;
+  }
+  Pieces pieces;
+  if (!zero(pieces, addr, len)) {
+    return -ENOMEM;
+  }
+  if (host >= 0) {
+    // zero() left the mapping's pieces behind.
+    ssize_t n = ::preadv(host, pieces.host.data(),
+                         int(std::min<size_t>(pieces.host.size(), IOV_MAX)),
+                         off_t(offset));
+    if (n < 0) {
+      return -errno;
+    }
+    noteWritten(pieces, n);
+  }
+  return int64_t(addr);
+}
+
+int64_t Linux::dispatch(Pieces &pieces, uint64_t number,
+                        const std::array<uint64_t, 6> &a) {
+  constexpr uint8_t kR = Memory::kRead, kW = Memory::kWrite;
+  auto fd = [&](size_t i) { return hostFd(int64_t(a[i])); };
+  // Host vectored I/O takes at most IOV_MAX pieces; beyond that the call is
+  // short, which callers must handle anyway.
+  auto count = [&] {
+    return int(std::min<size_t>(pieces.host.size(), IOV_MAX));
+  };
+  // Reads and writes may block; once their buffers are gathered they no
+  // longer need the lock.
+  std::unique_lock guard(lock);
+
+  switch (static_cast<Syscall>(number)) {
+  case Syscall::read:
+  case Syscall::pread64: {
+    int host = fd(0);
+    if (host < 0) {
+      return -EBADF;
+    }
+    if (!gather(pieces, a[1], a[2], kW)) {
+      return -EFAULT;
+    }
+    guard.unlock();
+    int64_t n = number == uint64_t(Syscall::read)
+                    ? result(::readv(host, pieces.host.data(), count()))
+                    : result(::preadv(host, pieces.host.data(), count(),
+                                      off_t(a[3])));
+    if (n > 0) {
+      noteWritten(pieces, n);
+    }
+    return n;
+  }
+  case Syscall::write:
+  case Syscall::pwrite64: {
+    int host = fd(0);
+    if (host < 0) {
+      return -EBADF;
+    }
+    if (!gather(pieces, a[1], a[2], kR)) {
+      return -EFAULT;
+    }
+    guard.unlock();
+    return number == uint64_t(Syscall::write)
+               ? result(::writev(host, pieces.host.data(), count()))
+               : result(::pwritev(host, pieces.host.data(), count(),
+                                  off_t(a[3])));
+  }
+  case Syscall::readv:
+  case Syscall::writev: {
+    int host = fd(0);
+    if (host < 0) {
+      return -EBADF;
+    }
+    bool reading = number == uint64_t(Syscall::readv);
+    uint64_t total;
+    if (a[2] > IOV_MAX) {
+      return -EINVAL;
+    }
+    if (!gatherVector(pieces, a[1], a[2], reading ? kW : kR, total)) {
+      return -EFAULT;
+    }
+    guard.unlock();
+    if (!reading) {
+      return result(::writev(host, pieces.host.data(), count()));
+    }
+    int64_t n = result(::readv(host, pieces.host.data(), count()));
+    if (n > 0) {
+      noteWritten(pieces, n);
+    }
+    return n;
+  }
+
+  case Syscall::openat: {
+    int dir = int64_t(a[0]) == AT_FDCWD ? AT_FDCWD : fd(0);
+    std::string path;
+    if (dir == -1) {
+      return -EBADF;
+    }
+    if (!readString(a[1], path)) {
+      return -EFAULT;
+    }
+    int host = ::openat(dir, path.c_str(), int(a[2]), mode_t(a[3]));
+    return host < 0 ? -errno : addFd(host);
+  }
+  case Syscall::close: {
+    int host = fd(0);
+    if (host < 0) {
+      return -EBADF;
+    }
+    fds[a[0]] = -1;
+    return host > 2 ? result(::close(host)) : 0;
+  }
+  case Syscall::lseek: {
+    int host = fd(0);
+    return host < 0 ? -EBADF
+                    : result(::lseek(host, off_t(a[1]), int(a[2])));
+  }
+  case Syscall::ioctl:
+    return doIoctl(int64_t(a[0]), a[1], a[2]);
+  case Syscall::newfstatat: {
+    int dir = int64_t(a[0]) == AT_FDCWD ? AT_FDCWD : fd(0);
+    std::string path;
+    if (dir == -1) {
+      return -EBADF;
+    }
+    if (!readString(a[1], path)) {
+      return -EFAULT;
+    }
+    return doStat(dir, path.c_str(), int(a[3]), a[2]);
+  }
+  case Syscall::fstat: {
+    int host = fd(0);
+    return host < 0 ? -EBADF : doStat(host, "", AT_EMPTY_PATH, a[1]);
+  }
+
+  case Syscall::exit:
+  case Syscall::exit_group:
+    _exited = true;
+    _exitCode = int(a[0] & 0xff);
+    return 0;
+
+  case Syscall::set_tid_address:
+  case Syscall::getpid:
+  case Syscall::gettid:
+    return ::getpid();
+  case Syscall::getppid:
+    return ::getppid();
+  case Syscall::getuid:
+    return ::getuid();
+  case Syscall::geteuid:
+    return ::geteuid();
+  case Syscall::getgid:
+    return ::getgid();
+  case Syscall::getegid:
+    return ::getegid();
+  case Syscall::sched_yield:
+    ::sched_yield();
+    return 0;
+  // Single-threaded, there is no one to share a futex with; see ThreadGroup.
+  case Syscall::clone:
+  case Syscall::futex:
+    return -ENOSYS;
+  // No signal is ever delivered.
+  case Syscall::set_robust_list:
+  case Syscall::sigaltstack:
+  case Syscall::rt_sigaction:
+  case Syscall::rt_sigprocmask:
+    return 0;
+
+  case Syscall::clock_gettime: {
+    timespec ts;
+    if (::clock_gettime(clockid_t(a[0]), &ts) < 0) {
+      return -errno;
+    }
+    int64_t guest[2] = {ts.tv_sec, ts.tv_nsec};
+    return memory.write(a[1], {reinterpret_cast<const uint8_t *>(guest),
+                               sizeof(guest)})
+               ? 0
+               : -EFAULT;
+  }
+  case Syscall::uname: {
+    // struct utsname: six 65-byte fields.
+    char uts[6][65] = {"Linux", "riscy", "6.1.0", "#1", "riscv64", "(none)"};
+    return memory.write(a[0], {reinterpret_cast<const uint8_t *>(uts),
+                               sizeof(uts)})
+               ? 0
+               : -EFAULT;
+  }
+  case Syscall::getrandom: {
+    if (!gather(pieces, a[0], a[1], kW)) {
+      return -EFAULT;
+    }
+    uint64_t done = 0;
+    for (const iovec &piece : pieces.host) {
+      ssize_t n = ::getrandom(piece.iov_base, piece.iov_len, unsigned(a[2]));
+      if (n < 0) {
+        return done ? int64_t(done) : -errno;
+      }
+      done += n;
+      if (size_t(n) < piece.iov_len) {
+        break;
+      }
+    }
+    noteWritten(pieces, done);
+    return int64_t(done);
+  }
+
+  case Syscall::brk:
+    return doBrk(a[0]);
+  case Syscall::mmap:
+    return doMmap(a[0], a[1], a[2], a[3], int64_t(a[4]), a[5]);
+  // Mappings are never reused, so there is nothing to release; permissions
+  // stay as mapped.
+  case Syscall::munmap:
+  case Syscall::mprotect:
+    return 0;
+  }
+  return -ENOSYS;
+}
+
+bool Linux::syscall(Hart &hart) {
+  uint64_t number = hart.x[Hart::kA7];
+  std::array<uint64_t, 6> args;
+  for (size_t i = 0; i < args.size(); i++) {
+    args[i] = hart.x[Hart::kA0 + i];
+  }
+  // Reused by each host thread, so that I/O doesn't allocate.
+  static thread_local Pieces pieces;
+  pieces.host.clear();
+  pieces.addrs.clear();
+  int64_t r = dispatch(pieces, number, args);
+  traced(number, args, r);
+  if (number == uint64_t(Syscall::exit) ||
+      number == uint64_t(Syscall::exit_group)) {
+    return false;
+  }
+  hart.x[Hart::kA0] = uint64_t(r);
+  hart.pc += 4;
+  return true;
+}
+
+void Linux::traced(uint64_t number, const std::array<uint64_t, 6> &args,
+                   int64_t result) {
+  if (!trace) {
+    return;
+  }
+  std::string name(syscallName(number));
+  if (name.empty()) {
+    name = "syscall_" + std::to_string(number);
+  }
+  std::fprintf(trace, "%s(%#lx, %#lx, %#lx) = %ld\n", name.c_str(), args[0],
+               args[1], args[2], result);
+}
+
+void prepareProcess(Hart &hart, Memory &memory, const elf::ELF &elf,
+                    std::span<const std::string> argv,
+                    std::span<const std::string> envp) {
+  using Segment = elf::ProgramHeaderEntry;
+
+  // The program headers, if some segment maps them.
+  uint64_t phdr = 0;
+  for (const auto &ph : elf.programHeaders()) {
+    if (ph->type == Segment::SegmentType::Loadable &&
+        ph->fileOffset <= elf.header->phOffset &&
+        elf.header->phOffset < ph->fileOffset + ph->size) {
+      phdr = ph->virtAddr + (elf.header->phOffset - ph->fileOffset);
+      break;
+    }
+  }
+
+  uint64_t sp = memory.stackTop();
+  auto push = [&](std::span<const uint8_t> bytes) {
+    sp -= bytes.size();
+    if (!memory.write(sp, bytes)) {
+      throw std::runtime_error("Process arguments do not fit on the stack");
+    }
+    return sp;
+  };
+  auto pushString = [&](const std::string &s) {
+    return push({reinterpret_cast<const uint8_t *>(s.c_str()), s.size() + 1});
+  };
+
+  std::vector<uint64_t> argvAddrs, envpAddrs;
+  for (const auto &s : envp) {
+    envpAddrs.push_back(pushString(s));
+  }
+  for (const auto &s : argv) {
+    argvAddrs.push_back(pushString(s));
+  }
+  uint64_t execfn = argvAddrs.empty() ? 0 : argvAddrs.front();
+  std::array<uint8_t, 16> random;
+  std::random_device rd;
+  for (auto &b : random) {
+    b = uint8_t(rd());
+  }
+  uint64_t randomAddr = push(random);
+
+  const std::pair<uint64_t, uint64_t> auxv[] = {
+      {AT_PHDR, phdr},
+      {AT_PHENT, elf.header->phEntrySize},
+      {AT_PHNUM, elf.header->phEntryCount},
+      {AT_PAGESZ, Memory::kPageSize},
+      {AT_BASE, 0},
+      {AT_FLAGS, 0},
+      {AT_ENTRY, elf.header->entry},
+      {AT_UID, ::getuid()},
+      {AT_EUID, ::geteuid()},
+      {AT_GID, ::getgid()},
+      {AT_EGID, ::getegid()},
+      {AT_HWCAP, hwcap("imac")},
+      {AT_CLKTCK, uint64_t(::sysconf(_SC_CLK_TCK))},
+      {AT_SECURE, 0},
+      {AT_RANDOM, randomAddr},
+      {AT_EXECFN, execfn},
+      {AT_NULL, 0},
+  };
+
+  std::vector<uint64_t> words;
+  words.push_back(argv.size());
+  words.insert(words.end(), argvAddrs.begin(), argvAddrs.end());
+  words.push_back(0);
+  words.insert(words.end(), envpAddrs.begin(), envpAddrs.end());
+  words.push_back(0);
+  for (auto [type, value] : auxv) {
+    words.push_back(type);
+    words.push_back(value);
+  }
+  // argc sits at the 16-byte aligned stack pointer.
+  sp = (sp - words.size() * 8) & ~uint64_t(15);
+  sp += words.size() * 8;
+  push({reinterpret_cast<const uint8_t *>(words.data()), words.size() * 8});
+
+  hart.x.fill(0);
+  hart.x[Hart::kSP] = sp;
+  hart.pc = elf.header->entry;
+}
+
+} // namespace riscy::vm
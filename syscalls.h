@@ -0,0 +1,189 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "execute.h"
+#include "hart.h"
+#include "interp.h"
+#include "memory.h"
+
+namespace riscy::elf {
+struct ELF;
+}
+
+namespace riscy::vm {
+
+// Linux system call numbers for RV64 (the asm-generic table), as passed in
+// a7.
+enum class Syscall : uint64_t {
+  ioctl = 29,
+  openat = 56,
+  close = 57,
+  lseek = 62,
+  read = 63,
+  write = 64,
+  readv = 65,
+  writev = 66,
+  pread64 = 67,
+  pwrite64 = 68,
+  newfstatat = 79,
+  fstat = 80,
+  exit = 93,
+  exit_group = 94,
+  set_tid_address = 96,
+  futex = 98,
+  set_robust_list = 99,
+  clock_gettime = 113,
+  sched_yield = 124,
+  sigaltstack = 132,
+  rt_sigaction = 134,
+  rt_sigprocmask = 135,
+  uname = 160,
+  getpid = 172,
+  getppid = 173,
+  getuid = 174,
+  geteuid = 175,
+  getgid = 176,
+  getegid = 177,
+  gettid = 178,
+  brk = 214,
+  munmap = 215,
+  clone = 220,
+  mmap = 222,
+  mprotect = 226,
+  getrandom = 278,
+};
+
+// Name of system call `number`, or an empty view if Linux doesn't handle
+// it.
+[[nodiscard]] std::string_view syscallName(uint64_t number);
+
+// Linux user-mode system calls for a guest process, serviced by the host. The
+// calls that create, identify, end and synchronise threads are left to
+// ThreadGroup (clone() fails here). Harts may call in concurrently: the fd
+// table and brk/mmap state are behind a lock, which blocking reads and writes
+// don't hold while they wait on the host. File descriptors are virtualised
+// (guest 0-2 start out as the host's 0-2, which are never closed); brk() and
+// mmap() carve up memory.heapBase()..heapEnd(), the heap from below and
+// mappings from above. Unsupported calls fail with ENOSYS.
+//
+// I/O on guest buffers doesn't copy: each buffer is translated to host
+// pieces (one per contiguous run of pages) and a whole read/write/readv/
+// writev goes to the host as a single vectored call.
+class Linux {
+private:
+  // Host pieces of a call's guest buffers, and the guest address of each.
+  struct Pieces {
+    std::vector<iovec> host;
+    std::vector<uint64_t> addrs;
+  };
+
+  Memory &memory;
+  std::FILE *trace;
+
+  // Guards everything below.
+  std::mutex lock;
+
+  // Guest fd -> host fd, or -1 if closed.
+  std::vector<int> fds{0, 1, 2};
+
+  uint64_t brkBase, brkEnd;
+  // Lowest address handed out by mmap() so far.
+  uint64_t mmapLow;
+
+  bool _exited = false;
+  int _exitCode = 0;
+
+  [[nodiscard]] int hostFd(int64_t fd) const;
+  int addFd(int host);
+
+  // Appends the host pieces of guest range [addr, addr + n) to `pieces`.
+  // Returns false if any of it lacks `perms`.
+  [[nodiscard]] bool gather(Pieces &pieces, uint64_t addr, uint64_t n,
+                            uint8_t perms);
+  // gather() over a guest iovec array; `n` is set to its total length.
+  [[nodiscard]] bool gatherVector(Pieces &pieces, uint64_t iov,
+                                  uint64_t count, uint8_t perms, uint64_t &n);
+  // Reports `n` bytes written by the host through `pieces` to memory.
+  void noteWritten(const Pieces &pieces, uint64_t n);
+
+  [[nodiscard]] bool readString(uint64_t addr, std::string &out) const;
+  // Zeroes guest range [addr, addr + n), leaving its pieces in `pieces`.
+  [[nodiscard]] bool zero(Pieces &pieces, uint64_t addr, uint64_t n);
+
+  int64_t doIoctl(int64_t fd, uint64_t request, uint64_t arg);
+  int64_t doStat(int host, const char *path, int flags, uint64_t out);
+  int64_t doBrk(uint64_t addr);
+  int64_t doMmap(uint64_t addr, uint64_t len, uint64_t prot, uint64_t flags,
+                 int64_t fd, uint64_t offset);
+  int64_t dispatch(Pieces &pieces, uint64_t number,
+                   const std::array<uint64_t, 6> &a);
+
+public:
+  // `trace`, if given, gets a line per call.
+  explicit Linux(Memory &memory, std::FILE *trace = nullptr);
+  ~Linux();
+
+  Linux(const Linux &) = delete;
+  Linux &operator=(const Linux &) = delete;
+
+  // Services the ECALL at hart.pc: a7 holds the call number, a0-a5 its
+  // arguments, and the result (or -errno) goes to a0. Steps past the ECALL,
+  // unless the process exited, in which case it returns false.
+  bool syscall(Hart &hart);
+
+  // Traces a call serviced elsewhere, as syscall() does its own.
+  void traced(uint64_t number, const std::array<uint64_t, 6> &args,
+              int64_t result);
+
+  [[nodiscard]] inline bool exited() const { return _exited; }
+  [[nodiscard]] inline int exitCode() const { return _exitCode; }
+
+  // Current program break.
+  [[nodiscard]] inline uint64_t programBreak() const { return brkEnd; }
+};
+
+// Sets up `hart` to start the executable `elf` loaded into `memory` the way
+// the kernel does: pc at its entry point and, at memory.stackTop(), argc,
+// argv, envp and the auxiliary vector (with program headers, page size,
+// AT_RANDOM bytes and so on), followed by the strings they point to.
+void prepareProcess(Hart &hart, Memory &memory, const elf::ELF &elf,
+                    std::span<const std::string> argv,
+                    std::span<const std::string> envp);
+
+// Runs `engine` (an Interpreter or a Jit) from hart.pc, servicing the
+// ECALLs it stops on with `os`, until the process exits (StopReason::Exited,
+// with os.exitCode()), some other stop, or `maxSteps` retired instructions.
+// Each ECALL counts as one.
+template <typename Engine>
+RunResult runProcess(Engine &engine, Hart &hart, Linux &os,
+                     uint64_t maxSteps = std::numeric_limits<uint64_t>::max()) {
+  uint64_t steps = 0;
+  for (;;) {
+    RunResult r = engine.run(maxSteps - steps);
+    steps += r.steps;
+    if (r.reason != StopReason::EnvironmentCall) {
+      return {r.reason, r.pc, steps};
+    }
+    if (steps == maxSteps) {
+      return {StopReason::StepLimit, r.pc, steps};
+    }
+    steps++;
+    hart.instret++;
+    if (!os.syscall(hart)) {
+      return {StopReason::Exited, hart.pc, steps};
+    }
+  }
+}
+
+} // namespace riscy::vm
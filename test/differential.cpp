@@ -0,0 +1,280 @@
+// Differential checks, run by `make test`. Each pits two implementations of
+// the same semantics against each other and reports where they disagree:
+//
+//   decode   decode_range(), with every kernel, against decode()
+//   jit      the Jit, compiling every block, against the Interpreter
+//   codegen  generated C, built with $CC (default cc) and loaded with
+//            dlopen(), against the Interpreter; whatever the C code leaves
+//            for the interpreter is run by one
+//
+// The engines run quad() from the given object (examples/quad.so) and every
+// function of a synthetic object from synth.h. Synthetic code is random, so
+// most functions stop at a fault; it must be the same fault, with the same
+// registers and memory.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+
+#include "buffer.h"
+#include "cfg.h"
+#include "codegen.h"
+#include "decode.h"
+#include "decode_block.h"
+#include "elf.h"
+#include "interp.h"
+#include "jit.h"
+#include "memory.h"
+#include "synth.h"
+
+using namespace riscy;
+
+namespace {
+
+constexpr uint64_t kMaxSteps = 1 << 20;
+
+int failures = 0;
+
+void fail(const std::string &what) {
+  std::fprintf(stderr, "FAIL %s\n", what.c_str());
+  failures++;
+}
+
+// The riscy_machine of the generated C's prelude.
+struct Machine {
+  uint64_t x[32];
+  uint8_t *mem;
+  uint64_t base;
+  uint64_t size;
+};
+using MachineFn = uint64_t (*)(Machine *);
+
+// Where a run stopped and the state it left.
+struct Outcome {
+  vm::StopReason reason;
+  uint64_t pc;
+  uint64_t steps;
+  uint64_t x[32];
+  std::vector<uint8_t> memory;
+};
+
+Outcome outcome(const vm::RunResult &r, const vm::Hart &hart,
+                vm::Memory &memory) {
+  Outcome o{r.reason, r.pc, r.steps, {}, {}};
+  std::memcpy(o.x, hart.x.data(), sizeof(o.x));
+  const uint8_t *p = memory.translate(memory.base(), memory.size());
+  o.memory.assign(p, p + memory.size());
+  return o;
+}
+
+// Reports the first difference between `a` and `b`; steps only if asked.
+void compare(const std::string &what, const Outcome &a, const Outcome &b,
+             bool steps) {
+  if (a.reason != b.reason || a.pc != b.pc) {
+    return fail(std::format("{}: stopped with {} at {:#x}, expected {} at {:#x}",
+                            what, vm::StopReasonNames[(int)b.reason], b.pc,
+                            vm::StopReasonNames[(int)a.reason], a.pc));
+  }
+  if (steps && a.steps != b.steps) {
+    return fail(std::format("{}: {} steps, expected {}", what, b.steps,
+                            a.steps));
+  }
+  for (int r = 1; r < 32; r++) {
+    if (a.x[r] != b.x[r]) {
+      return fail(std::format("{}: x{} = {:#x}, expected {:#x}", what, r,
+                              b.x[r], a.x[r]));
+    }
+  }
+  if (a.memory != b.memory) {
+    return fail(std::format("{}: memory differs", what));
+  }
+}
+
+Outcome interpret(const elf::ELF &elf, uint64_t entry,
+                  std::span<const uint64_t> args) {
+  auto memory = vm::Memory::fromELF(elf);
+  vm::Hart hart;
+  vm::Interpreter interp(hart, memory);
+  return outcome(interp.call(entry, args, kMaxSteps), hart, memory);
+}
+
+Outcome jit(const elf::ELF &elf, uint64_t entry,
+            std::span<const uint64_t> args) {
+  auto memory = vm::Memory::fromELF(elf);
+  vm::Hart hart;
+  vm::Jit jit(hart, memory, {.hotThreshold = 1});
+  return outcome(jit.call(entry, args, kMaxSteps), hart, memory);
+}
+
+Outcome native(const elf::ELF &elf, MachineFn fn, uint64_t entry,
+               std::span<const uint64_t> args) {
+  auto memory = vm::Memory::fromELF(elf);
+  vm::Hart hart;
+  vm::prepareCall(hart, memory, entry, args);
+  Machine m{};
+  std::memcpy(m.x, hart.x.data(), sizeof(m.x));
+  m.mem = memory.translate(memory.base(), memory.size());
+  m.base = memory.base();
+  m.size = memory.size();
+  uint64_t pc = fn(&m);
+  std::memcpy(hart.x.data(), m.x, sizeof(m.x));
+  hart.pc = pc;
+  vm::Interpreter interp(hart, memory);
+  return outcome(interp.run(kMaxSteps), hart, memory);
+}
+
+void checkDecode() {
+  std::mt19937 rng(1);
+  std::vector<uint32_t> words(1 << 20);
+  for (size_t i = 0; i < words.size(); i++) {
+    // Half of them uncompressed, so that most of the table is reached.
+    words[i] = rng() | (i & 1 ? 0b11 : 0);
+  }
+  risc::DecodedBlock block;
+  for (auto kernel : {risc::DecodeKernel::Scalar, risc::DecodeKernel::SSE2,
+                      risc::DecodeKernel::AVX2}) {
+    if (kernel > risc::bestDecodeKernel()) {
+      continue;
+    }
+    risc::decode_range(words, block, kernel);
+    for (size_t i = 0; i < words.size(); i++) {
+      risc::DecodedInstr a = risc::decode(words[i]), b = block[i];
+      if (a.op != b.op || a.format != b.format || a.rd != b.rd ||
+          a.rs1 != b.rs1 || a.rs2 != b.rs2 || a.imm != b.imm) {
+        fail(std::format("decode: kernel {} disagrees on {:08x}",
+                         static_cast<int>(kernel), words[i]));
+        break;
+      }
+    }
+  }
+}
+
+// A function to run and the arguments to run it with.
+struct Case {
+  std::string name;
+  uint64_t entry;
+  std::vector<uint64_t> args;
+};
+
+std::vector<Case> quadCases(const elf::ELF &elf) {
+  std::vector<Case> cases;
+  auto quad = elf.getSymbolLocation("quad");
+  if (!quad) {
+    fail("quad: no symbol");
+    return cases;
+  }
+  for (uint64_t n : {0, 1, 5, 17, 1000}) {
+    cases.push_back({std::format("quad({})", n), quad->value, {n}});
+  }
+  return cases;
+}
+
+std::vector<Case> synthCases(const elf::ELF &elf) {
+  std::mt19937_64 rng(2);
+  std::vector<Case> cases;
+  for (const auto *sym : elf.symbols().functions()) {
+    // Some arguments point into .text, so that loads get somewhere.
+    std::vector<uint64_t> args{synth::kTextAddr, synth::kTextAddr + 0x400,
+                               rng(), rng() & 0xFFF, rng()};
+    cases.push_back({std::string(sym->name), sym->value, std::move(args)});
+  }
+  return cases;
+}
+
+void checkJit(const std::string &object, const elf::ELF &elf,
+              const std::vector<Case> &cases) {
+  for (const auto &c : cases) {
+    compare(std::format("jit {} {}", object, c.name),
+            interpret(elf, c.entry, c.args), jit(elf, c.entry, c.args), true);
+  }
+}
+
+void checkCodegen(const std::string &object, const elf::ELF &elf,
+                  const std::vector<Case> &cases,
+                  const std::filesystem::path &dir) {
+  auto source = dir / (object + ".c"), library = dir / (object + ".so");
+  {
+    std::string c = codegen::emitTranslationUnit(cfg::buildAllCFGs(elf));
+    std::FILE *file = std::fopen(source.c_str(), "w");
+    if (!file || std::fwrite(c.data(), 1, c.size(), file) != c.size() ||
+        std::fclose(file) != 0) {
+      return fail(std::format("codegen {}: cannot write {}", object,
+                              source.string()));
+    }
+  }
+  const char *cc = std::getenv("CC");
+  std::string command =
+      std::format("{} -shared -fPIC -O1 -w -o {} {}", cc && *cc ? cc : "cc",
+                  library.string(), source.string());
+  if (std::system(command.c_str()) != 0) {
+    return fail(std::format("codegen {}: {} failed", object, command));
+  }
+  void *handle = ::dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    return fail(std::format("codegen {}: {}", object, ::dlerror()));
+  }
+  for (const auto &c : cases) {
+    auto fn = reinterpret_cast<MachineFn>(
+        ::dlsym(handle, codegen::functionName(c.entry).c_str()));
+    std::string what = std::format("codegen {} {}", object, c.name);
+    if (!fn) {
+      fail(what + ": not translated");
+      continue;
+    }
+    // Steps aren't counted by the C code.
+    compare(what, interpret(elf, c.entry, c.args),
+            native(elf, fn, c.entry, c.args), false);
+  }
+  ::dlclose(handle);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "usage: %s <quad.so>\n", argv[0]);
+    return 2;
+  }
+
+  char pattern[] = "/tmp/riscy-test.XXXXXX";
+  if (!::mkdtemp(pattern)) {
+    std::perror("mkdtemp");
+    return 2;
+  }
+  const std::filesystem::path dir = pattern;
+
+  checkDecode();
+
+  auto quadBuf = buffer::Buffer::map(argv[1]);
+  auto quad = elf::readELF(quadBuf);
+  synth::Options options;
+  options.functions = 200;
+  buffer::Buffer synthBuf(synth::generate(options));
+  auto synthetic = elf::readELF(synthBuf);
+  if (!quad || !synthetic) {
+    fail("cannot read the test objects");
+  } else {
+    auto quadRuns = quadCases(*quad);
+    auto synthRuns = synthCases(*synthetic);
+    checkJit("quad", *quad, quadRuns);
+    checkJit("synth", *synthetic, synthRuns);
+    checkCodegen("quad", *quad, quadRuns, dir);
+    checkCodegen("synth", *synthetic, synthRuns, dir);
+  }
+
+  std::filesystem::remove_all(dir);
+  if (failures) {
+    std::fprintf(stderr, "%d failures\n", failures);
+    return 1;
+  }
+  std::printf("differential checks passed\n");
+  return 0;
+}
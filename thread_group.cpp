@@ -0,0 +1,382 @@
+#include "thread_group.h"
+
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <stdexcept>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "jit.h"
+
+namespace riscy::vm {
+
+namespace {
+
+// futex() operations and flags.
+enum : uint64_t {
+  FUTEX_WAIT = 0,
+  FUTEX_WAKE = 1,
+  FUTEX_WAIT_BITSET = 9,
+  FUTEX_WAKE_BITSET = 10,
+  FUTEX_PRIVATE_FLAG = 128,
+  FUTEX_CLOCK_REALTIME = 256,
+};
+
+// What pthread_create() passes, less the flags that only share what guest
+// threads share anyway.
+constexpr uint64_t kThreadFlags = CLONE_VM | CLONE_SIGHAND | CLONE_THREAD;
+
+// Sent to host threads still running once the process has stopped. Its
+// handler does nothing, but without SA_RESTART a blocking host call it
+// arrives during fails with EINTR.
+constexpr int kInterruptSignal = SIGURG;
+
+void installInterruptHandler() {
+  static std::once_flag once;
+  std::call_once(once, [] {
+    struct sigaction action = {};
+    action.sa_handler = [](int) {};
+    sigemptyset(&action.sa_mask);
+    ::sigaction(kInterruptSignal, &action, nullptr);
+  });
+}
+
+inline std::atomic_ref<uint32_t> word(uint8_t *p) {
+  return std::atomic_ref<uint32_t>(*reinterpret_cast<uint32_t *>(p));
+}
+
+} // namespace
+
+int64_t Futexes::wait(uint64_t addr, uint8_t *p, uint32_t expected,
+                      uint32_t bitset, std::optional<Deadline> deadline) {
+  std::unique_lock guard(lock);
+  if (cancelled) {
+    return -EINTR;
+  }
+  // Wakers change the word before they take `lock` to wake(), so checking
+  // it under `lock` can't miss one.
+  if (word(p).load() != expected) {
+    return -EAGAIN;
+  }
+  Waiter self{bitset};
+  auto &queue = queues[addr];
+  auto it = queue.insert(queue.end(), &self);
+  auto done = [&] { return self.woken || cancelled; };
+  bool timedOut = false;
+  if (deadline) {
+    timedOut = !self.cv.wait_until(guard, *deadline, done);
+  } else {
+    self.cv.wait(guard, done);
+  }
+  if (self.woken) {
+    return 0;
+  }
+  queue.erase(it);
+  if (queue.empty()) {
+    queues.erase(addr);
+  }
+  return timedOut ? -ETIMEDOUT : -EINTR;
+}
+
+int64_t Futexes::wake(uint64_t addr, uint32_t bitset, uint64_t count) {
+  std::lock_guard guard(lock);
+  auto q = queues.find(addr);
+  if (q == queues.end()) {
+    return 0;
+  }
+  int64_t woken = 0;
+  for (auto it = q->second.begin();
+       it != q->second.end() && uint64_t(woken) < count;) {
+    Waiter *w = *it;
+    if (!(w->bitset & bitset)) {
+      ++it;
+      continue;
+    }
+    w->woken = true;
+    w->cv.notify_one();
+    it = q->second.erase(it);
+    woken++;
+  }
+  if (q->second.empty()) {
+    queues.erase(q);
+  }
+  return woken;
+}
+
+void Futexes::cancel() {
+  std::lock_guard guard(lock);
+  cancelled = true;
+  for (auto &[addr, queue] : queues) {
+    for (Waiter *w : queue) {
+      w->cv.notify_one();
+    }
+  }
+}
+
+template <typename Engine>
+ThreadGroup<Engine>::ThreadGroup(Memory &memory, Linux &os, uint64_t quantum)
+    : memory(memory), os(os), quantum(quantum) {
+  // Paged memory keeps a TLB per address space, which harts can't share.
+  if (!memory.isFlat()) {
+    throw std::invalid_argument("ThreadGroup needs flat memory");
+  }
+  auto main = std::make_unique<Thread>();
+  main->engine = std::make_unique<Engine>(main->hart, memory);
+  main->tid = ::getpid();
+  nextTid = main->tid + 1;
+  threads.push_back(std::move(main));
+}
+
+template <typename Engine> ThreadGroup<Engine>::~ThreadGroup() = default;
+
+template <typename Engine> size_t ThreadGroup<Engine>::threadCount() {
+  std::lock_guard guard(lock);
+  return threads.size();
+}
+
+template <typename Engine> RunResult ThreadGroup<Engine>::run() {
+  installInterruptHandler();
+  {
+    std::unique_lock guard(lock);
+    Thread &main = *threads.front();
+    live = 1;
+    main.host = std::thread([this, &main] { host(main); });
+    stopped.wait(guard, [&] { return stopping.load(); });
+  }
+  // clone() starts no thread once stopping is set, so `threads` is final.
+  uint64_t steps = 0;
+  for (auto &t : threads) {
+    // A thread blocked in a host call (a read of stdin, say) only comes
+    // back when interrupted, and the signal may land just before it blocks.
+    while (!t->done) {
+      ::pthread_kill(t->host.native_handle(), kInterruptSignal);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    t->host.join();
+    steps += t->steps;
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  return {result->reason, result->pc, steps};
+}
+
+template <typename Engine> void ThreadGroup<Engine>::stop(RunResult r) {
+  if (!stopping) {
+    result = r;
+    stopping = true;
+    futexes.cancel();
+    stopped.notify_all();
+  }
+}
+
+template <typename Engine> void ThreadGroup<Engine>::host(Thread &t) {
+  try {
+    runThread(t);
+  } catch (...) {
+    std::lock_guard guard(lock);
+    if (!error) {
+      error = std::current_exception();
+    }
+    stop({StopReason::Exited, t.hart.pc, 0});
+  }
+  t.done = true;
+}
+
+template <typename Engine> void ThreadGroup<Engine>::runThread(Thread &t) {
+  while (!stopping.load(std::memory_order_relaxed)) {
+    RunResult r = t.engine->run(quantum);
+    t.steps += r.steps;
+    if (r.reason == StopReason::StepLimit) {
+      continue;
+    }
+    if (r.reason != StopReason::EnvironmentCall) {
+      std::lock_guard guard(lock);
+      stop(r);
+      return;
+    }
+    t.steps++;
+    t.hart.instret++;
+    if (!syscall(t)) {
+      return;
+    }
+  }
+}
+
+template <typename Engine> bool ThreadGroup<Engine>::syscall(Thread &t) {
+  Hart &hart = t.hart;
+  uint64_t number = hart.x[Hart::kA7];
+  std::array<uint64_t, 6> args;
+  for (size_t i = 0; i < args.size(); i++) {
+    args[i] = hart.x[Hart::kA0 + i];
+  }
+
+  int64_t r;
+  switch (static_cast<Syscall>(number)) {
+  case Syscall::clone:
+    r = clone(t, args);
+    break;
+  case Syscall::futex:
+    r = futex(args);
+    break;
+  case Syscall::gettid:
+    r = t.tid;
+    break;
+  case Syscall::set_tid_address:
+    t.clearTid = args[0];
+    r = t.tid;
+    break;
+  case Syscall::exit: {
+    std::unique_lock guard(lock);
+    if (live == 1) {
+      // The last thread out ends the process.
+      if (!stopping && !os.syscall(hart)) {
+        stop({StopReason::Exited, hart.pc, 0});
+      }
+      return false;
+    }
+    live--;
+    guard.unlock();
+    os.traced(number, args, 0);
+    // What pthread_join() waits on.
+    if (t.clearTid) {
+      if (uint8_t *p = memory.atomic(t.clearTid, 4, true)) {
+        word(p).store(0);
+        futexes.wake(t.clearTid, ~0u, 1);
+      }
+    }
+    return false;
+  }
+  default: {
+    // Linux locks for itself, and may block (e.g. on a read), so other
+    // threads carry on meanwhile.
+    if (stopping) {
+      return false;
+    }
+    if (os.syscall(hart)) {
+      return true;
+    }
+    std::lock_guard guard(lock);
+    stop({StopReason::Exited, hart.pc, 0});
+    return false;
+  }
+  }
+
+  os.traced(number, args, r);
+  hart.x[Hart::kA0] = uint64_t(r);
+  hart.pc += 4;
+  return true;
+}
+
+template <typename Engine>
+int64_t ThreadGroup<Engine>::clone(Thread &parent,
+                                   const std::array<uint64_t, 6> &args) {
+  // The RV64 argument order: flags, stack, parent_tid, tls, child_tid.
+  uint64_t flags = args[0], stack = args[1], parentTid = args[2],
+           tls = args[3], childTid = args[4];
+  if ((flags & kThreadFlags) != kThreadFlags) {
+    return -ENOSYS;
+  }
+
+  auto child = std::make_unique<Thread>();
+  Hart &hart = child->hart;
+  hart = parent.hart;
+  hart.x[Hart::kA0] = 0;
+  if (stack) {
+    hart.x[Hart::kSP] = stack;
+  }
+  if (flags & CLONE_SETTLS) {
+    hart.x[Hart::kTP] = tls;
+  }
+  hart.pc += 4;
+  hart.reservation = Hart::kNoReservation;
+  child->engine = std::make_unique<Engine>(hart, memory);
+
+  std::lock_guard guard(lock);
+  if (stopping) {
+    return -EAGAIN;
+  }
+  int64_t tid = nextTid++;
+  child->tid = tid;
+  if ((flags & CLONE_PARENT_SETTID) &&
+      !memory.store(parentTid, uint32_t(tid))) {
+    return -EFAULT;
+  }
+  if ((flags & CLONE_CHILD_SETTID) && !memory.store(childTid, uint32_t(tid))) {
+    return -EFAULT;
+  }
+  if (flags & CLONE_CHILD_CLEARTID) {
+    child->clearTid = childTid;
+  }
+  Thread &t = *child;
+  threads.push_back(std::move(child));
+  live++;
+  t.host = std::thread([this, &t] { host(t); });
+  return tid;
+}
+
+template <typename Engine>
+int64_t ThreadGroup<Engine>::futex(const std::array<uint64_t, 6> &args) {
+  uint64_t addr = args[0];
+  uint64_t op = args[1] & ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME);
+  bool realtime = args[1] & FUTEX_CLOCK_REALTIME;
+  uint32_t val = uint32_t(args[2]);
+  if (addr & 3) {
+    return -EINVAL;
+  }
+
+  switch (op) {
+  case FUTEX_WAIT:
+  case FUTEX_WAIT_BITSET: {
+    uint32_t bitset = op == FUTEX_WAIT ? ~0u : uint32_t(args[5]);
+    if (!bitset) {
+      return -EINVAL;
+    }
+    uint8_t *p = memory.atomic(addr, 4, false);
+    if (!p) {
+      return -EFAULT;
+    }
+    std::optional<Futexes::Deadline> deadline;
+    if (args[3]) {
+      int64_t ts[2];
+      if (!memory.load(args[3], ts[0]) || !memory.load(args[3] + 8, ts[1])) {
+        return -EFAULT;
+      }
+      if (ts[0] < 0 || ts[1] < 0 || ts[1] >= 1'000'000'000) {
+        return -EINVAL;
+      }
+      auto timeout =
+          std::chrono::seconds(ts[0]) + std::chrono::nanoseconds(ts[1]);
+      auto now = std::chrono::steady_clock::now();
+      if (op == FUTEX_WAIT) {
+        // Relative.
+        deadline = now + timeout;
+      } else {
+        // Absolute, on the guest's chosen clock.
+        timespec clock;
+        ::clock_gettime(realtime ? CLOCK_REALTIME : CLOCK_MONOTONIC, &clock);
+        deadline = now + (timeout - std::chrono::seconds(clock.tv_sec) -
+                          std::chrono::nanoseconds(clock.tv_nsec));
+      }
+    }
+    return futexes.wait(addr, p, val, bitset, deadline);
+  }
+  case FUTEX_WAKE:
+  case FUTEX_WAKE_BITSET: {
+    uint32_t bitset = op == FUTEX_WAKE ? ~0u : uint32_t(args[5]);
+    if (!bitset) {
+      return -EINVAL;
+    }
+    return futexes.wake(addr, bitset, val);
+  }
+  }
+  return -ENOSYS;
+}
+
+template class ThreadGroup<Interpreter>;
+template class ThreadGroup<Jit>;
+
+} // namespace riscy::vm
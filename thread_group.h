@@ -0,0 +1,137 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "hart.h"
+#include "interp.h"
+#include "memory.h"
+#include "syscalls.h"
+
+namespace riscy::vm {
+
+// Guest futexes, queued on the host by guest address.
+class Futexes {
+private:
+  struct Waiter {
+    uint32_t bitset;
+    bool woken = false;
+    std::condition_variable cv;
+  };
+
+  std::mutex lock;
+  std::unordered_map<uint64_t, std::list<Waiter *>> queues;
+  bool cancelled = false;
+
+public:
+  using Deadline = std::chrono::steady_clock::time_point;
+
+  // FUTEX_WAIT_BITSET: unless the 32-bit guest word at `addr` (host address
+  // `word`) no longer holds `expected`, sleeps until a wake() whose bitset
+  // intersects `bitset`, `deadline`, or cancel(). Returns 0, -EAGAIN,
+  // -ETIMEDOUT or -EINTR.
+  int64_t wait(uint64_t addr, uint8_t *word, uint32_t expected,
+               uint32_t bitset, std::optional<Deadline> deadline);
+
+  // FUTEX_WAKE_BITSET: wakes up to `count` waiters on `addr`, oldest first.
+  // Returns how many were woken.
+  int64_t wake(uint64_t addr, uint32_t bitset, uint64_t count);
+
+  // Fails every wait, current and future, with -EINTR.
+  void cancel();
+};
+
+// Runs a multithreaded guest process: each guest thread gets its own hart,
+// driven by its own `Engine` (an Interpreter or a Jit, each with its own
+// block cache) on its own host thread. They all share `memory`, which must
+// be flat, and `os`, which they call into concurrently; LR/SC and AMOs are
+// host atomics on that memory, and FENCEs host barriers (see execute()).
+//
+// clone() with CLONE_VM | CLONE_THREAD | CLONE_SIGHAND, as pthread_create()
+// makes it, starts a thread; other clone()s fail with ENOSYS. exit() ends
+// the calling thread, and exit_group() (or the last thread's exit()) the
+// process. futex() supports FUTEX_WAIT and FUTEX_WAKE and their _BITSET
+// forms, private or not; set_tid_address() and CLONE_CHILD_CLEARTID behave
+// as in Linux, so pthread_join() works.
+template <typename Engine> class ThreadGroup {
+private:
+  struct Thread {
+    Hart hart;
+    std::unique_ptr<Engine> engine;
+    int64_t tid = 0;
+    // Zeroed and woken as a futex when the thread exits.
+    uint64_t clearTid = 0;
+    uint64_t steps = 0;
+    std::thread host;
+    // Set as host() returns.
+    std::atomic<bool> done{false};
+  };
+
+  Memory &memory;
+  Linux &os;
+  uint64_t quantum;
+
+  // Guards everything below except `stopping`.
+  std::mutex lock;
+  std::condition_variable stopped;
+  std::vector<std::unique_ptr<Thread>> threads;
+  size_t live = 0;
+  int64_t nextTid;
+  std::optional<RunResult> result;
+  std::exception_ptr error;
+  // Checked by every thread between quanta.
+  std::atomic<bool> stopping{false};
+  Futexes futexes;
+
+  // Body of each host thread.
+  void host(Thread &t);
+  void runThread(Thread &t);
+  // Services the ECALL `t` stopped at; false if the thread has ended.
+  bool syscall(Thread &t);
+  int64_t clone(Thread &parent, const std::array<uint64_t, 6> &args);
+  int64_t futex(const std::array<uint64_t, 6> &args);
+  // Records the first reason the process stopped and stops every thread.
+  // Call with `lock` held.
+  void stop(RunResult r);
+
+public:
+  // Makes the initial thread; no host thread runs until run().
+  // `quantum` bounds how many instructions a thread runs between checks for
+  // the process having stopped.
+  ThreadGroup(Memory &memory, Linux &os, uint64_t quantum = 1 << 20);
+  ~ThreadGroup();
+
+  ThreadGroup(const ThreadGroup &) = delete;
+  ThreadGroup &operator=(const ThreadGroup &) = delete;
+
+  // The initial thread's hart and engine, for the caller to set up (e.g.
+  // with prepareProcess()) before run().
+  [[nodiscard]] inline Hart &mainHart() { return threads.front()->hart; }
+  [[nodiscard]] inline Engine &mainEngine() {
+    return *threads.front()->engine;
+  }
+
+  // Runs every thread on a host thread of its own until the process exits
+  // (StopReason::Exited, with os.exitCode()) or any thread stops for another
+  // reason, at its pc. Steps are counted over all threads, one per ECALL as
+  // in runProcess(). Every host thread has been joined on return, those
+  // blocked in a host call interrupted with a signal; an exception thrown by
+  // any of them is rethrown.
+  RunResult run();
+
+  // Threads created so far, the initial one included.
+  [[nodiscard]] size_t threadCount();
+};
+
+} // namespace riscy::vm
@@ -0,0 +1,146 @@
+#include "translation_cache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <system_error>
+
+#include <unistd.h>
+
+namespace riscy::cache {
+
+namespace {
+
+constexpr uint64_t kSecret0 = 0xA0761D6478BD642F;
+constexpr uint64_t kSecret1 = 0xE7037ED1A0B428DB;
+constexpr uint64_t kSecret2 = 0x8EBC6AF09C88C6E3;
+
+inline uint64_t mix(uint64_t a, uint64_t b) {
+  __uint128_t r = static_cast<__uint128_t>(a) * b;
+  return uint64_t(r) ^ uint64_t(r >> 64);
+}
+
+inline uint64_t load64(const uint8_t *p) {
+  uint64_t v;
+  std::memcpy(&v, p, 8);
+  return v;
+}
+
+// Bump whenever the file layout changes.
+constexpr uint32_t kFormatVersion = 1;
+
+// Written in host byte order; the cache isn't meant to be shared between
+// machines.
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint8_t kind;
+  uint8_t pad[3];
+  uint64_t address;
+  uint64_t input;
+  uint64_t payloadSize;
+  uint64_t payloadHash;
+};
+static_assert(sizeof(FileHeader) == 48);
+
+constexpr char kMagic[8] = {'R', 'I', 'S', 'C', 'Y', 'T', 'C', '\0'};
+
+} // namespace
+
+uint64_t hash(std::span<const uint8_t> bytes, uint64_t seed) {
+  const uint8_t *p = bytes.data();
+  size_t n = bytes.size();
+  uint64_t h = mix(seed ^ kSecret0, n ^ kSecret1);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    h = mix(load64(p + i) ^ kSecret1, load64(p + i + 8) ^ h);
+  }
+  if (i < n) {
+    uint8_t tail[16] = {};
+    std::memcpy(tail, p + i, n - i);
+    h = mix(load64(tail) ^ kSecret1, load64(tail + 8) ^ h);
+  }
+  return mix(h ^ kSecret2, n ^ kSecret1);
+}
+
+std::filesystem::path TranslationCache::pathOf(const Key &key) const {
+  static constexpr const char *kKindNames[] = {"cfn", "blocks"};
+  return dir / std::format("{:016x}", key.binary) /
+         std::format("{}-{:x}", kKindNames[static_cast<size_t>(key.kind)],
+                        key.address);
+}
+
+std::optional<Entry> TranslationCache::load(const Key &key) const {
+  buffer::Buffer file;
+  try {
+    file = buffer::Buffer::map(pathOf(key));
+  } catch (const std::system_error &) {
+    return std::nullopt;
+  }
+  if (file.size() < sizeof(FileHeader)) {
+    return std::nullopt;
+  }
+
+  FileHeader header;
+  std::memcpy(&header, file.span().data(), sizeof(header));
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kFormatVersion ||
+      header.kind != static_cast<uint8_t>(key.kind) ||
+      header.address != key.address ||
+      header.payloadSize != file.size() - sizeof(FileHeader)) {
+    return std::nullopt;
+  }
+  buffer::Buffer payload = file.slice(sizeof(FileHeader), file.size());
+  if (hash(payload.span()) != header.payloadHash) {
+    return std::nullopt;
+  }
+  return Entry{header.input, std::move(payload)};
+}
+
+bool TranslationCache::store(const Key &key, uint64_t input,
+                             std::span<const uint8_t> payload) {
+  std::filesystem::path path = pathOf(key);
+  std::error_code ec;
+  std::filesystem::create_directories(path.parent_path(), ec);
+  if (ec) {
+    return false;
+  }
+
+  FileHeader header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kFormatVersion;
+  header.kind = static_cast<uint8_t>(key.kind);
+  header.address = key.address;
+  header.input = input;
+  header.payloadSize = payload.size();
+  header.payloadHash = hash(payload);
+
+  // A name of its own, so that concurrent stores of the same key (from
+  // other threads too) can't write into one another's file.
+  std::string tmp = path.string() + ".tmpXXXXXX";
+  int fd = ::mkstemp(tmp.data());
+  if (fd < 0) {
+    return false;
+  }
+  std::FILE *file = ::fdopen(fd, "wb");
+  if (!file) {
+    ::close(fd);
+    std::filesystem::remove(tmp, ec);
+    return false;
+  }
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+            (payload.empty() ||
+             std::fwrite(payload.data(), payload.size(), 1, file) == 1);
+  ok = std::fclose(file) == 0 && ok;
+  if (ok) {
+    std::filesystem::rename(tmp, path, ec);
+    ok = !ec;
+  }
+  if (!ok) {
+    std::filesystem::remove(tmp, ec);
+  }
+  return ok;
+}
+
+} // namespace riscy::cache
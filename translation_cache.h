@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+
+#include "buffer.h"
+
+namespace riscy::cache {
+
+// 64-bit content hash (a wyhash-style multiply-mix, 16 bytes per step). Fast
+// enough to hash a whole binary at startup; not meant to resist deliberate
+// collisions.
+[[nodiscard]] uint64_t hash(std::span<const uint8_t> bytes, uint64_t seed = 0);
+
+// hash() of a trivially copyable value, e.g. to mix options into a key.
+template <typename T>
+[[nodiscard]] inline uint64_t hashValue(const T &value, uint64_t seed = 0) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  return hash({reinterpret_cast<const uint8_t *>(&value), sizeof(T)}, seed);
+}
+
+// What an entry holds; part of its file name.
+enum class Kind : uint8_t {
+  // C source of one function from codegen::emitFunction().
+  CFunction,
+  // Pre-decoded vm::Blocks starting in one page.
+  Blocks,
+};
+
+struct Key {
+  // hash() of the whole ELF file the translation came from.
+  uint64_t binary;
+  Kind kind;
+  // Guest address: the function entry, or the page.
+  uint64_t address;
+};
+
+struct Entry {
+  // Hash of the input the payload was translated from, as given to store();
+  // callers compare it against the input they have now.
+  uint64_t input;
+  // Mapped straight from the cache file.
+  buffer::Buffer payload;
+};
+
+// Content-addressed store of translated code on disk, one file per key
+// under <dir>/<binary hash>/. Entries are written to a temporary file and
+// renamed into place, so concurrent processes only ever see whole ones, and
+// are mapped back in on load. A stale format, a truncated file or a payload
+// that fails its checksum reads as a miss.
+class TranslationCache {
+private:
+  std::filesystem::path dir;
+
+  [[nodiscard]] std::filesystem::path pathOf(const Key &key) const;
+
+public:
+  explicit TranslationCache(std::filesystem::path dir) : dir(std::move(dir)) {}
+
+  [[nodiscard]] inline const std::filesystem::path &directory() const {
+    return dir;
+  }
+
+  [[nodiscard]] std::optional<Entry> load(const Key &key) const;
+
+  // load() if the entry was stored for input `input`.
+  [[nodiscard]] inline std::optional<buffer::Buffer>
+  load(const Key &key, uint64_t input) const {
+    auto entry = load(key);
+    if (!entry || entry->input != input) {
+      return std::nullopt;
+    }
+    return std::move(entry->payload);
+  }
+
+  // Returns false if the entry could not be written; the cache is only ever
+  // an optimisation.
+  bool store(const Key &key, uint64_t input, std::span<const uint8_t> payload);
+};
+
+} // namespace riscy::cache
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+namespace riscy::x86 {
+
+// Just enough of an x86-64 assembler for the JIT: the integer instructions
+// it emits, with explicit operand forms rather than a general encoder.
+
+enum Reg : uint8_t {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+  kNoReg = 0xFF,
+};
+
+enum Cond : uint8_t {
+  kOverflow = 0x0,
+  kBelow = 0x2,
+  kAboveEqual = 0x3,
+  kEqual = 0x4,
+  kNotEqual = 0x5,
+  kBelowEqual = 0x6,
+  kAbove = 0x7,
+  kSign = 0x8,
+  kLess = 0xC,
+  kGreaterEqual = 0xD,
+  kLessEqual = 0xE,
+  kGreater = 0xF,
+};
+
+// Group-1 ALU operations (the /digit of opcodes 81/83 and the base of the
+// r/m, reg forms).
+enum Alu : uint8_t {
+  kAdd = 0,
+  kOr = 1,
+  kAnd = 4,
+  kSub = 5,
+  kXor = 6,
+  kCmp = 7,
+};
+
+// Group-2 shifts (the /digit of C1/D3).
+enum Shift : uint8_t {
+  kShl = 4,
+  kShr = 5,
+  kSar = 7,
+};
+
+// [base + index + disp]
+struct Mem {
+  Reg base;
+  Reg index = kNoReg;
+  int32_t disp = 0;
+};
+
+struct Label {
+  int32_t id = -1;
+};
+
+class Assembler {
+private:
+  std::vector<uint8_t> &code;
+  // Address the first byte of `code` will be executed at; needed for
+  // rel32 jumps to code outside this buffer.
+  uint64_t origin;
+
+  std::vector<int64_t> labels;
+  // (offset of a rel32 field, label id)
+  std::vector<std::pair<size_t, int32_t>> fixups;
+
+  inline void rex(bool w, uint8_t reg, uint8_t index, uint8_t base,
+                  bool force = false) {
+    uint8_t r = 0x40 | (w << 3) | ((reg >> 3) & 1) << 2 |
+                ((index >> 3) & 1) << 1 | ((base >> 3) & 1);
+    if (r != 0x40 || force) {
+      byte(r);
+    }
+  }
+
+  inline void modrm(uint8_t reg, const Mem &m) {
+    bool sib = m.index != kNoReg || (m.base & 7) == RSP;
+    uint8_t rm = sib ? 0b100 : (m.base & 7);
+    uint8_t mod;
+    if (m.disp == 0 && (m.base & 7) != RBP) {
+      mod = 0b00;
+    } else if (m.disp >= -128 && m.disp <= 127) {
+      mod = 0b01;
+    } else {
+      mod = 0b10;
+    }
+    byte(mod << 6 | (reg & 7) << 3 | rm);
+    if (sib) {
+      uint8_t index = m.index == kNoReg ? 0b100 : (m.index & 7);
+      byte(index << 3 | (m.base & 7));
+    }
+    if (mod == 0b01) {
+      byte(static_cast<uint8_t>(m.disp));
+    } else if (mod == 0b10) {
+      dword(static_cast<uint32_t>(m.disp));
+    }
+  }
+
+  inline void memOp(bool w, std::initializer_list<uint8_t> opcode, uint8_t reg,
+                    const Mem &m, bool forceRex = false) {
+    rex(w, reg, m.index == kNoReg ? 0 : m.index, m.base, forceRex);
+    for (uint8_t b : opcode) {
+      byte(b);
+    }
+    modrm(reg, m);
+  }
+
+  inline void regOp(bool w, std::initializer_list<uint8_t> opcode, uint8_t reg,
+                    uint8_t rm) {
+    rex(w, reg, 0, rm);
+    for (uint8_t b : opcode) {
+      byte(b);
+    }
+    byte(0b11 << 6 | (reg & 7) << 3 | (rm & 7));
+  }
+
+  inline void rel32To(uint64_t target) {
+    int64_t rel = static_cast<int64_t>(target - (origin + code.size() + 4));
+    assert(rel == static_cast<int32_t>(rel));
+    dword(static_cast<uint32_t>(rel));
+  }
+
+public:
+  Assembler(std::vector<uint8_t> &code, uint64_t origin)
+      : code(code), origin(origin) {}
+
+  [[nodiscard]] inline size_t size() const { return code.size(); }
+  [[nodiscard]] inline uint64_t here() const { return origin + code.size(); }
+
+  inline void byte(uint8_t b) { code.push_back(b); }
+  inline void dword(uint32_t v) {
+    uint8_t b[4];
+    std::memcpy(b, &v, 4);
+    code.insert(code.end(), b, b + 4);
+  }
+  inline void qword(uint64_t v) {
+    uint8_t b[8];
+    std::memcpy(b, &v, 8);
+    code.insert(code.end(), b, b + 8);
+  }
+
+  // Labels
+
+  [[nodiscard]] inline Label label() {
+    labels.push_back(-1);
+    return {static_cast<int32_t>(labels.size() - 1)};
+  }
+
+  inline void bind(Label l) { labels[l.id] = static_cast<int64_t>(code.size()); }
+
+  // Patches every rel32 that refers to a label; all of them must be bound.
+  inline void resolve() {
+    for (auto [at, id] : fixups) {
+      assert(labels[id] >= 0);
+      int32_t rel = static_cast<int32_t>(labels[id] - int64_t(at + 4));
+      std::memcpy(&code[at], &rel, 4);
+    }
+    fixups.clear();
+  }
+
+  // Moves
+
+  inline void mov(Reg dst, const Mem &src) { memOp(true, {0x8B}, dst, src); }
+  inline void mov(const Mem &dst, Reg src) { memOp(true, {0x89}, src, dst); }
+  inline void mov(Reg dst, Reg src) { regOp(true, {0x89}, src, dst); }
+
+  // mov r64, imm, picking the shortest encoding.
+  inline void movImm(Reg dst, uint64_t imm) {
+    if (imm <= 0xFFFF'FFFF) {
+      rex(false, 0, 0, dst);
+      byte(0xB8 + (dst & 7));
+      dword(static_cast<uint32_t>(imm));
+    } else if (static_cast<int64_t>(imm) ==
+               static_cast<int32_t>(static_cast<int64_t>(imm))) {
+      regOp(true, {0xC7}, 0, dst);
+      dword(static_cast<uint32_t>(imm));
+    } else {
+      rex(true, 0, 0, dst);
+      byte(0xB8 + (dst & 7));
+      qword(imm);
+    }
+  }
+
+  // mov qword [m], simm32
+  inline void movImm(const Mem &dst, int32_t imm) {
+    memOp(true, {0xC7}, 0, dst);
+    dword(static_cast<uint32_t>(imm));
+  }
+
+  // Loads of `bytes` bytes, sign- or zero-extended to 64 bits.
+  inline void load(Reg dst, const Mem &src, unsigned bytes, bool sign) {
+    switch (bytes) {
+    case 1:
+      memOp(sign, sign ? std::initializer_list<uint8_t>{0x0F, 0xBE}
+                       : std::initializer_list<uint8_t>{0x0F, 0xB6},
+            dst, src);
+      break;
+    case 2:
+      memOp(sign, sign ? std::initializer_list<uint8_t>{0x0F, 0xBF}
+                       : std::initializer_list<uint8_t>{0x0F, 0xB7},
+            dst, src);
+      break;
+    case 4:
+      if (sign) {
+        memOp(true, {0x63}, dst, src);
+      } else {
+        memOp(false, {0x8B}, dst, src);
+      }
+      break;
+    default:
+      mov(dst, src);
+      break;
+    }
+  }
+
+  // Stores the low `bytes` bytes of `src`.
+  inline void store(const Mem &dst, Reg src, unsigned bytes) {
+    switch (bytes) {
+    case 1:
+      // REX is required to address sil/dil and above as bytes.
+      memOp(false, {0x88}, src, dst, (src & 7) >= RSP);
+      break;
+    case 2:
+      byte(0x66);
+      memOp(false, {0x89}, src, dst);
+      break;
+    case 4:
+      memOp(false, {0x89}, src, dst);
+      break;
+    default:
+      mov(dst, src);
+      break;
+    }
+  }
+
+  inline void lea(Reg dst, const Mem &src) { memOp(true, {0x8D}, dst, src); }
+
+  // movsxd dst, src32
+  inline void movsxd(Reg dst, Reg src) { regOp(true, {0x63}, dst, src); }
+
+  // ALU
+
+  inline void alu(Alu op, Reg dst, Reg src, bool w = true) {
+    regOp(w, {static_cast<uint8_t>(op << 3 | 0x01)}, src, dst);
+  }
+
+  inline void alu(Alu op, Reg dst, int32_t imm, bool w = true) {
+    if (imm >= -128 && imm <= 127) {
+      regOp(w, {0x83}, op, dst);
+      byte(static_cast<uint8_t>(imm));
+    } else {
+      regOp(w, {0x81}, op, dst);
+      dword(static_cast<uint32_t>(imm));
+    }
+  }
+
+  // op qword [m], simm32
+  inline void alu(Alu op, const Mem &dst, int32_t imm) {
+    memOp(true, {0x81}, op, dst);
+    dword(static_cast<uint32_t>(imm));
+  }
+
+  // cmp byte [m], imm8
+  inline void cmpByte(const Mem &m, uint8_t imm) {
+    memOp(false, {0x80}, kCmp, m);
+    byte(imm);
+  }
+
+  inline void shift(Shift op, Reg dst, uint8_t amount, bool w = true) {
+    regOp(w, {0xC1}, op, dst);
+    byte(amount);
+  }
+
+  // Shift by cl.
+  inline void shiftCl(Shift op, Reg dst, bool w = true) {
+    regOp(w, {0xD3}, op, dst);
+  }
+
+  // dst *= src
+  inline void imul(Reg dst, Reg src, bool w = true) {
+    regOp(w, {0x0F, 0xAF}, dst, src);
+  }
+
+  // rdx:rax = rax * src, unsigned (mul) or signed (imul).
+  inline void mulWide(Reg src, bool sign) {
+    regOp(true, {0xF7}, sign ? 5 : 4, src);
+  }
+
+  // dst = cond ? 1 : 0, for dst in rax..rbx.
+  inline void setcc(Cond cond, Reg dst) {
+    assert(dst < RSP);
+    byte(0x0F);
+    byte(0x90 | cond);
+    byte(0b11 << 6 | dst);
+    // movzx dst32, dst8
+    byte(0x0F);
+    byte(0xB6);
+    byte(0b11 << 6 | dst << 3 | dst);
+  }
+
+  // Full barrier: orders earlier stores before later loads.
+  inline void mfence() {
+    byte(0x0F);
+    byte(0xAE);
+    byte(0xF0);
+  }
+
+  // Control flow
+
+  inline void jmp(Label l) {
+    byte(0xE9);
+    fixups.emplace_back(code.size(), l.id);
+    dword(0);
+  }
+
+  inline void jcc(Cond cond, Label l) {
+    byte(0x0F);
+    byte(0x80 | cond);
+    fixups.emplace_back(code.size(), l.id);
+    dword(0);
+  }
+
+  // jmp to an absolute address within ±2 GiB; returns the offset of the
+  // rel32 field so that the jump can be retargeted later.
+  inline size_t jmp(uint64_t target) {
+    byte(0xE9);
+    size_t at = code.size();
+    rel32To(target);
+    return at;
+  }
+
+  inline void jmp(Reg target) { regOp(false, {0xFF}, 4, target); }
+  inline void call(Reg target) { regOp(false, {0xFF}, 2, target); }
+  inline void ret() { byte(0xC3); }
+
+  inline void push(Reg r) {
+    rex(false, 0, 0, r);
+    byte(0x50 + (r & 7));
+  }
+
+  inline void pop(Reg r) {
+    rex(false, 0, 0, r);
+    byte(0x58 + (r & 7));
+  }
+};
+
+} // namespace riscy::x86